@@ -53,4 +53,146 @@ DEFINE_GUID(GUID_XENCONS_DEVICE,
                                              METHOD_BUFFERED,           \
                                              FILE_ANY_ACCESS)
 
+// Input: ULONG, non-zero to subscribe the handle to broadcast input
+// (every subscriber receives every byte), zero to return to competing
+// with the other handles for it
+#define IOCTL_XENCONS_SET_BROADCAST CTL_CODE(FILE_DEVICE_UNKNOWN,       \
+                                             __IOCTL_XENCONS_BEGIN + 3, \
+                                             METHOD_BUFFERED,           \
+                                             FILE_ANY_ACCESS)
+
+// Equivalent to ReadFile()/WriteFile() but using direct I/O, so data
+// is copied straight between the caller's buffer (passed as the output
+// buffer in both cases) and the shared ring. Worthwhile only for large
+// transfers; the input buffer must be empty.
+#define IOCTL_XENCONS_READ_DIRECT   CTL_CODE(FILE_DEVICE_UNKNOWN,       \
+                                             __IOCTL_XENCONS_BEGIN + 4, \
+                                             METHOD_OUT_DIRECT,         \
+                                             FILE_READ_ACCESS)
+
+#define IOCTL_XENCONS_WRITE_DIRECT  CTL_CODE(FILE_DEVICE_UNKNOWN,       \
+                                             __IOCTL_XENCONS_BEGIN + 5, \
+                                             METHOD_IN_DIRECT,          \
+                                             FILE_WRITE_ACCESS)
+
+typedef struct _XENCONS_WRITE_SEGMENT {
+    ULONG   Offset;     // From the start of the input buffer
+    ULONG   Length;
+} XENCONS_WRITE_SEGMENT, *PXENCONS_WRITE_SEGMENT;
+
+typedef struct _XENCONS_WRITE_GATHER {
+    ULONG                   Count;
+    XENCONS_WRITE_SEGMENT   Segment[1];
+} XENCONS_WRITE_GATHER, *PXENCONS_WRITE_GATHER;
+
+// Input: XENCONS_WRITE_GATHER with Count segments, followed by their
+// data. The segments are written, in order, as one contiguous stream.
+// Output: ULONG[Count], the number of bytes written from each segment.
+// As with WriteFile() the request may complete having written only
+// part of the data, in which case every segment after the first short
+// one reports 0.
+#define IOCTL_XENCONS_WRITE_GATHER  CTL_CODE(FILE_DEVICE_UNKNOWN,       \
+                                             __IOCTL_XENCONS_BEGIN + 6, \
+                                             METHOD_BUFFERED,           \
+                                             FILE_WRITE_ACCESS)
+
+typedef struct _XENCONS_RECORD {
+    LARGE_INTEGER   Timestamp;  // System time the data left the shared ring,
+                                // at performance counter resolution
+    ULONGLONG       Sequence;
+    ULONG           Length;     // Of the data that follows
+    ULONG           Reserved;
+} XENCONS_RECORD, *PXENCONS_RECORD;
+
+#define XENCONS_RECORD_ALIGNMENT    8
+
+// Output: a sequence of XENCONS_RECORD, each followed by its data and
+// padded to XENCONS_RECORD_ALIGNMENT. Each record is a chunk of input
+// as it was taken from the shared ring. Sequence numbers increase by
+// one per chunk, so a gap means that input was consumed by an
+// ordinary read. A chunk that does not fit is split and the remainder
+// is returned, with the same sequence number, by the next call.
+#define IOCTL_XENCONS_READ_RECORDS  CTL_CODE(FILE_DEVICE_UNKNOWN,       \
+                                             __IOCTL_XENCONS_BEGIN + 7, \
+                                             METHOD_BUFFERED,           \
+                                             FILE_READ_ACCESS)
+
+// Modeled on termios VMIN/VTIME. A read completes as soon as it holds
+// Minimum bytes (or is full). Otherwise it completes with whatever it
+// holds once InterByteTimeout ms pass without more input after the
+// first byte, or Timeout ms after the read was issued. A timeout of 0
+// is infinite. The default is { 1, 0, 0 }: complete on any input.
+// { 0, 0, 0 } makes reads non-blocking and { 0, 0, T } completes on
+// the first byte or after T ms. An InterByteTimeout needs a non-zero
+// Minimum, and neither timeout may exceed XENCONS_READ_TIMEOUT_MAXIMUM.
+// A read that is cancelled while it holds input completes successfully
+// with that input, so nothing taken from the console is lost.
+typedef struct _XENCONS_READ_POLICY {
+    ULONG   Minimum;
+    ULONG   InterByteTimeout;
+    ULONG   Timeout;
+} XENCONS_READ_POLICY, *PXENCONS_READ_POLICY;
+
+#define XENCONS_READ_TIMEOUT_MAXIMUM    (60 * 60 * 1000)
+
+// Input: XENCONS_READ_POLICY, applied to all reads on the handle
+#define IOCTL_XENCONS_SET_READ_POLICY CTL_CODE(FILE_DEVICE_UNKNOWN,       \
+                                               __IOCTL_XENCONS_BEGIN + 8, \
+                                               METHOD_BUFFERED,           \
+                                               FILE_READ_ACCESS)
+
+#define XENCONS_WAIT_READABLE       0x00000001
+#define XENCONS_WAIT_WRITABLE       0x00000002
+#define XENCONS_WAIT_DISCONNECTED   0x00000004
+
+#define XENCONS_WAIT_MASK           (XENCONS_WAIT_READABLE |    \
+                                     XENCONS_WAIT_WRITABLE |    \
+                                     XENCONS_WAIT_DISCONNECTED)
+
+typedef struct _XENCONS_WAIT {
+    ULONG   Mask;       // XENCONS_WAIT_* events of interest
+    ULONG   WriteSpace; // Bytes that must be writable, 0 means any
+} XENCONS_WAIT, *PXENCONS_WAIT;
+
+// Input: XENCONS_WAIT. Output: a ULONG holding whichever of the events
+// in Mask are true at completion. Events are level triggered, so the
+// request completes at once if any of them already holds.
+#define IOCTL_XENCONS_WAIT          CTL_CODE(FILE_DEVICE_UNKNOWN,       \
+                                             __IOCTL_XENCONS_BEGIN + 9, \
+                                             METHOD_BUFFERED,           \
+                                             FILE_ANY_ACCESS)
+
+typedef struct _XENCONS_SELECT_ENTRY {
+    ULONGLONG       Handle; // Of an open console, widened for WoW64
+    XENCONS_WAIT    Wait;
+} XENCONS_SELECT_ENTRY, *PXENCONS_SELECT_ENTRY;
+
+#define XENCONS_SELECT_MAXIMUM  1024
+
+typedef struct _XENCONS_SELECT {
+    ULONG                   Count;
+    ULONG                   Reserved;
+    XENCONS_SELECT_ENTRY    Entry[1];
+} XENCONS_SELECT, *PXENCONS_SELECT;
+
+// Input: XENCONS_SELECT. Output: Count ULONGs, one per entry. May be
+// sent to any PV console handle and completes as soon as any entry
+// has one of the events in its Wait, as IOCTL_XENCONS_WAIT would. Each
+// output holds the events true for that entry at completion, or
+// XENCONS_WAIT_DISCONNECTED if its handle has been closed.
+#define IOCTL_XENCONS_SELECT        CTL_CODE(FILE_DEVICE_UNKNOWN,        \
+                                             __IOCTL_XENCONS_BEGIN + 10, \
+                                             METHOD_BUFFERED,            \
+                                             FILE_ANY_ACCESS)
+
+#define XENCONS_FLUSH_TIMEOUT_MAXIMUM   (60 * 60 * 1000)
+
+// Input: a ULONG timeout in ms, 0 being infinite. As FlushFileBuffers()
+// but completes only once the backend has consumed everything written
+// on the handle before the flush, or fails with ERROR_SEM_TIMEOUT.
+#define IOCTL_XENCONS_FLUSH         CTL_CODE(FILE_DEVICE_UNKNOWN,        \
+                                             __IOCTL_XENCONS_BEGIN + 11, \
+                                             METHOD_BUFFERED,            \
+                                             FILE_WRITE_ACCESS)
+
 #endif  // _XENCONS_DEVICE_H
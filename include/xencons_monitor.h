@@ -0,0 +1,68 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _XENCONS_MONITOR_H
+#define _XENCONS_MONITOR_H
+
+// The monitor serves each console's output on \\.\pipe\xencons\<name>
+// from the moment a client connects. Clients of
+// \\.\pipe\xencons\<name>\history must first send a
+// XENCONS_HISTORY_REQUEST message. They then receive a
+// XENCONS_HISTORY_REPLY followed by recorded output from the offset in
+// the reply, and then live output with no gap. Offsets count bytes of
+// console output since the monitor attached to the console. History
+// clients cannot send console input: any further message closes the
+// connection.
+
+#define XENCONS_HISTORY_SIGNATURE   'TSHX'
+
+#define XENCONS_HISTORY_LAST    0   // Value is a byte count back from the end
+#define XENCONS_HISTORY_FROM    1   // Value is an offset to resume from
+
+typedef struct _XENCONS_HISTORY_REQUEST {
+    ULONG       Signature;
+    ULONG       Mode;
+    ULONGLONG   Value;
+} XENCONS_HISTORY_REQUEST, *PXENCONS_HISTORY_REQUEST;
+
+// The requested offset is no longer (or not yet) recorded, so the
+// stream starts at Offset instead
+#define XENCONS_HISTORY_GAP     0x00000001
+
+typedef struct _XENCONS_HISTORY_REPLY {
+    ULONG       Signature;
+    ULONG       Flags;
+    ULONGLONG   Instance;   // Changes if offsets restart from zero
+    ULONGLONG   Offset;     // Of the first byte that follows
+} XENCONS_HISTORY_REPLY, *PXENCONS_HISTORY_REPLY;
+
+#endif  // _XENCONS_MONITOR_H
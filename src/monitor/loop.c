@@ -0,0 +1,166 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include "loop.h"
+
+VOID
+LoopInitialize(
+    OUT PMONITOR_LOOP               Loop,
+    IN  const MONITOR_LOOP_BACKEND  *Backend,
+    IN  PVOID                       Context
+    )
+{
+    Loop->Backend = Backend;
+    Loop->Context = Context;
+    __InitializeListHead(&Loop->TimerList);
+}
+
+VOID
+LoopTeardown(
+    IN  PMONITOR_LOOP   Loop
+    )
+{
+    Loop->Backend = NULL;
+    Loop->Context = NULL;
+    Loop->TimerList.Flink = NULL;
+    Loop->TimerList.Blink = NULL;
+}
+
+// Complete an operation that has no I/O behind it
+BOOL
+LoopPost(
+    IN  PMONITOR_LOOP       Loop,
+    IN  PMONITOR_OPERATION  Operation
+    )
+{
+    return Loop->Backend->Post(Loop->Context, Operation);
+}
+
+VOID
+LoopTimerSet(
+    IN  PMONITOR_LOOP   Loop,
+    IN  PMONITOR_TIMER  Timer,
+    IN  DWORD           Milliseconds
+    )
+{
+    Timer->Deadline = Loop->Backend->Now(Loop->Context) + Milliseconds;
+
+    if (!Timer->Armed) {
+        __InsertTailList(&Loop->TimerList, &Timer->ListEntry);
+        Timer->Armed = TRUE;
+    }
+}
+
+VOID
+LoopTimerCancel(
+    IN  PMONITOR_TIMER  Timer
+    )
+{
+    if (!Timer->Armed)
+        return;
+
+    __RemoveEntryList(&Timer->ListEntry);
+    Timer->Armed = FALSE;
+}
+
+// Fire the earliest timer that is due, if any, and return how long
+// the loop may wait for the next one
+static DWORD
+LoopTimerPoll(
+    IN  PMONITOR_LOOP   Loop
+    )
+{
+    PLIST_ENTRY         ListEntry;
+    PMONITOR_TIMER      Earliest;
+    ULONGLONG           Now;
+
+again:
+    Now = Loop->Backend->Now(Loop->Context);
+    Earliest = NULL;
+
+    for (ListEntry = Loop->TimerList.Flink;
+         ListEntry != &Loop->TimerList;
+         ListEntry = ListEntry->Flink) {
+        PMONITOR_TIMER  Timer;
+
+        Timer = CONTAINING_RECORD(ListEntry,
+                                  MONITOR_TIMER,
+                                  ListEntry);
+
+        if (Earliest == NULL || Timer->Deadline < Earliest->Deadline)
+            Earliest = Timer;
+    }
+
+    if (Earliest == NULL)
+        return INFINITE;
+
+    if (Earliest->Deadline <= Now) {
+        LoopTimerCancel(Earliest);
+
+        // The callback may set or cancel any timer, so start over
+        Earliest->Operation.Complete(&Earliest->Operation,
+                                     ERROR_TIMEOUT,
+                                     0);
+        goto again;
+    }
+
+    return (DWORD)(Earliest->Deadline - Now);
+}
+
+// Everything the completion routines touch belongs to the loop thread,
+// so they need no further locking
+VOID
+LoopRun(
+    IN  PMONITOR_LOOP   Loop
+    )
+{
+    for (;;) {
+        PMONITOR_OPERATION  Operation;
+        DWORD               Timeout;
+        DWORD               Length;
+        DWORD               Error;
+
+        Timeout = LoopTimerPoll(Loop);
+
+        if (!Loop->Backend->Wait(Loop->Context,
+                                 Timeout,
+                                 &Operation,
+                                 &Error,
+                                 &Length))
+            continue;
+
+        if (Operation == NULL)
+            break;
+
+        Operation->Complete(Operation, Error, Length);
+    }
+}
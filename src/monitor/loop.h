@@ -0,0 +1,235 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _MONITOR_LOOP_H
+#define _MONITOR_LOOP_H
+
+// The monitor's event loop. Everything it does is an operation whose
+// completion routine the loop calls, on its own thread, when the
+// backend hands the operation back; timers fire on the same thread,
+// between completions. The loop itself only needs a clock and a queue
+// of completions from its backend: the service drives it from an I/O
+// completion port, but it builds as plain C outside Windows so it can
+// also be run against a stand-in.
+
+#if defined(_WIN32)
+
+#include <windows.h>
+
+#else   // _WIN32
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef IN
+#define IN
+#define OUT
+#endif
+
+#ifndef FORCEINLINE
+#define FORCEINLINE inline __attribute__((always_inline))
+#endif
+
+#define VOID    void
+
+typedef int         BOOL;
+typedef uint32_t    DWORD, *PDWORD;
+typedef uint64_t    ULONGLONG;
+typedef void        *PVOID;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY  *Flink;
+    struct _LIST_ENTRY  *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+#define TRUE                1
+#define FALSE               0
+#define INFINITE            0xFFFFFFFF
+#define MAXULONGLONG        UINT64_MAX
+#define ERROR_SUCCESS       0
+#define ERROR_TIMEOUT       1460
+
+#define CONTAINING_RECORD(_Address, _Type, _Field) \
+        ((_Type *)((char *)(_Address) - offsetof(_Type, _Field)))
+
+#define UNREFERENCED_PARAMETER(_Parameter)  (void)(_Parameter)
+
+#endif  // _WIN32
+
+static FORCEINLINE VOID
+__InitializeListHead(
+    IN  PLIST_ENTRY ListEntry
+    )
+{
+    ListEntry->Flink = ListEntry;
+    ListEntry->Blink = ListEntry;
+}
+
+static FORCEINLINE BOOL
+__IsListEmpty(
+    IN  PLIST_ENTRY ListHead
+    )
+{
+    return (ListHead->Flink == ListHead) ? TRUE : FALSE;
+}
+
+static FORCEINLINE VOID
+__InsertTailList(
+    IN  PLIST_ENTRY ListHead,
+    IN  PLIST_ENTRY ListEntry
+    )
+{
+    ListEntry->Blink = ListHead->Blink;
+    ListEntry->Flink = ListHead;
+    ListHead->Blink->Flink = ListEntry;
+    ListHead->Blink = ListEntry;
+}
+
+static FORCEINLINE VOID
+__RemoveEntryList(
+    IN  PLIST_ENTRY ListEntry
+    )
+{
+    PLIST_ENTRY     Flink;
+    PLIST_ENTRY     Blink;
+
+    Flink = ListEntry->Flink;
+    Blink = ListEntry->Blink;
+    Flink->Blink = Blink;
+    Blink->Flink = Flink;
+
+    ListEntry->Flink = ListEntry;
+    ListEntry->Blink = ListEntry;
+}
+
+typedef struct _MONITOR_OPERATION MONITOR_OPERATION, *PMONITOR_OPERATION;
+
+// Called on the loop thread when an operation completes
+typedef VOID
+(*MONITOR_COMPLETION)(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    );
+
+// Every device, pipe and process wait is driven by one of these. On
+// Windows the OVERLAPPED is what the completion port hands back.
+struct _MONITOR_OPERATION {
+#if defined(_WIN32)
+    OVERLAPPED              Overlapped;
+#endif
+    MONITOR_COMPLETION      Complete;
+    PVOID                   Argument;
+};
+
+// Timers complete with ERROR_TIMEOUT
+typedef struct _MONITOR_TIMER {
+    MONITOR_OPERATION       Operation;
+    LIST_ENTRY              ListEntry;
+    ULONGLONG               Deadline;
+    BOOL                    Armed;
+} MONITOR_TIMER, *PMONITOR_TIMER;
+
+typedef struct _MONITOR_LOOP_BACKEND {
+    // Milliseconds on a clock that never goes backwards
+    ULONGLONG
+    (*Now)(
+        IN  PVOID               Context
+        );
+
+    // Queue a completion for an operation that has no I/O behind it.
+    // This may be called from any thread.
+    BOOL
+    (*Post)(
+        IN  PVOID               Context,
+        IN  PMONITOR_OPERATION  Operation
+        );
+
+    // Wait up to Timeout milliseconds (or INFINITE) for a completion.
+    // Returns FALSE if none arrived in time. A completion without an
+    // operation asks the loop to exit.
+    BOOL
+    (*Wait)(
+        IN  PVOID               Context,
+        IN  DWORD               Timeout,
+        OUT PMONITOR_OPERATION  *Operation,
+        OUT PDWORD              Error,
+        OUT PDWORD              Length
+        );
+} MONITOR_LOOP_BACKEND, *PMONITOR_LOOP_BACKEND;
+
+typedef struct _MONITOR_LOOP {
+    const MONITOR_LOOP_BACKEND  *Backend;
+    PVOID                       Context;
+    LIST_ENTRY                  TimerList;
+} MONITOR_LOOP, *PMONITOR_LOOP;
+
+extern VOID
+LoopInitialize(
+    OUT PMONITOR_LOOP               Loop,
+    IN  const MONITOR_LOOP_BACKEND  *Backend,
+    IN  PVOID                       Context
+    );
+
+extern VOID
+LoopTeardown(
+    IN  PMONITOR_LOOP   Loop
+    );
+
+extern BOOL
+LoopPost(
+    IN  PMONITOR_LOOP       Loop,
+    IN  PMONITOR_OPERATION  Operation
+    );
+
+// Must be called on the loop thread. Setting an armed timer moves its
+// deadline.
+extern VOID
+LoopTimerSet(
+    IN  PMONITOR_LOOP   Loop,
+    IN  PMONITOR_TIMER  Timer,
+    IN  DWORD           Milliseconds
+    );
+
+// Must be called on the loop thread
+extern VOID
+LoopTimerCancel(
+    IN  PMONITOR_TIMER  Timer
+    );
+
+// Dispatches completions and timers until the backend asks it to exit
+extern VOID
+LoopRun(
+    IN  PMONITOR_LOOP   Loop
+    );
+
+#endif  // _MONITOR_LOOP_H
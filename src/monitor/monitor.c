@@ -41,11 +41,14 @@
 #include <setupapi.h>
 #include <malloc.h>
 #include <assert.h>
+#include <compressapi.h>
 
 #include <xencons_device.h>
+#include <xencons_monitor.h>
 #include <version.h>
 
 #include "messages.h"
+#include "loop.h"
 
 #define stringify_literal(_text) #_text
 #define stringify(_text) stringify_literal(_text)
@@ -54,6 +57,11 @@
 #define MONITOR_NAME        __MODULE__
 #define MONITOR_DISPLAYNAME MONITOR_NAME
 
+#define MAXIMUM_BUFFER_SIZE 1024
+
+// Device writes are counted by power of two size, up to 32 KiB and over
+#define WRITE_SIZE_BUCKETS  16
+
 typedef struct _MONITOR_CONTEXT {
     SERVICE_STATUS          Status;
     SERVICE_STATUS_HANDLE   Service;
@@ -64,37 +72,178 @@ typedef struct _MONITOR_CONTEXT {
     CRITICAL_SECTION        CriticalSection;
     LIST_ENTRY              ListHead;
     DWORD                   ListCount;
+    DWORD                   DirectThreshold;
+    DWORD                   QueueDepth;
+    DWORD                   LaggingPolicy;
+    DWORD                   ReadCount;
+    DWORD                   ReadSize;
+    DWORD                   WriteSize;
+    DWORD                   WriteWindow;
+    DWORD                   HistorySize;
+    HANDLE                  Port;
+    HANDLE                  LoopThread;
+    MONITOR_LOOP            Loop;
 } MONITOR_CONTEXT, *PMONITOR_CONTEXT;
 
+// Data read from the device is shared, rather than copied, between
+// the output queues of all the connections
+typedef struct _MONITOR_BUFFER {
+    struct _MONITOR_POOL    *Pool;
+    struct _MONITOR_BUFFER  *Next;
+    LONG                    References;
+    DWORD                   Length;
+    UCHAR                   Data[1];
+} MONITOR_BUFFER, *PMONITOR_BUFFER;
+
+// Device read buffers are recycled rather than allocated for every read
+typedef struct _MONITOR_POOL {
+    PMONITOR_BUFFER         Free;
+    DWORD                   FreeCount;
+    DWORD                   FreeMaximum;
+    DWORD                   Size;
+} MONITOR_POOL, *PMONITOR_POOL;
+
+typedef struct _MONITOR_READ {
+    MONITOR_OPERATION       Operation;
+    PMONITOR_BUFFER         Buffer;
+    BOOL                    Completed;
+    DWORD                   Error;
+} MONITOR_READ, *PMONITOR_READ;
+
+typedef struct _MONITOR_CHUNK {
+    LIST_ENTRY              ListEntry;
+    ULONGLONG               Offset;
+    DWORD                   Length;
+    DWORD                   Size;
+    BOOL                    Compressed;
+    UCHAR                   Data[1];
+} MONITOR_CHUNK, *PMONITOR_CHUNK;
+
+// Output is recorded at increasing byte offsets. Each chunk is
+// compressed once it is full and the oldest are discarded to keep
+// within the limit.
+typedef struct _MONITOR_HISTORY {
+    ULONGLONG               Instance;
+    ULONGLONG               Offset;
+    LIST_ENTRY              ChunkList;
+    ULONGLONG               Stored;
+    PUCHAR                  Pending;
+    DWORD                   PendingLength;
+    COMPRESSOR_HANDLE       Compressor;
+    DECOMPRESSOR_HANDLE     Decompressor;
+} MONITOR_HISTORY, *PMONITOR_HISTORY;
+
+typedef struct _MONITOR_LISTENER {
+    MONITOR_OPERATION       Operation;
+    CHAR                    PipeName[MAX_PATH];
+    HANDLE                  Pipe;
+    BOOL                    History;
+} MONITOR_LISTENER, *PMONITOR_LISTENER;
+
 typedef struct _MONITOR_CONSOLE {
     LIST_ENTRY              ListEntry;
     PWCHAR                  DevicePath;
     HANDLE                  DeviceHandle;
     HDEVNOTIFY              DeviceNotification;
     PCHAR                   DeviceName; // protocol and instance?
-    HANDLE                  ExecutableThread;
-    HANDLE                  ExecutableEvent;
-    HANDLE                  DeviceThread;
-    HANDLE                  DeviceEvent;
-    HANDLE                  ServerThread;
-    HANDLE                  ServerEvent;
-    CRITICAL_SECTION        CriticalSection;
+    HANDLE                  Device;
+    MONITOR_LISTENER        Listener;
+    MONITOR_LISTENER        HistoryListener;
+    MONITOR_HISTORY         History;
+    PCHAR                   Executable;
+    PROCESS_INFORMATION     ProcessInfo;
+    HANDLE                  ExecutableWait;
+    LONG                    ExecutableFired;
+    MONITOR_OPERATION       Start;
+    MONITOR_OPERATION       Stop;
+    MONITOR_OPERATION       Exit;
+    MONITOR_POOL            Pool;
+    PMONITOR_READ           Reads;
+    DWORD                   ReadHead;
+    BOOL                    ReadFailed;
+    MONITOR_OPERATION       Write;
+    MONITOR_TIMER           WriteTimer;
+    PUCHAR                  WriteBuffer[2];
+    DWORD                   WriteIndex;
+    DWORD                   WriteLength;
+    DWORD                   WriteOffset;
+    DWORD                   WriteCount;
+    BOOL                    Writing;
+    BOOL                    WriteDue;
+    LIST_ENTRY              InputList;
+    ULONGLONG               InputMessages;
+    ULONGLONG               Writes;
+    ULONGLONG               WriteBytes;
+    ULONGLONG               WriteSizes[WRITE_SIZE_BUCKETS];
+    DWORD                   Outstanding;
+    BOOL                    Stopping;
+    HANDLE                  StoppedEvent;
     LIST_ENTRY              ListHead;
     DWORD                   ListCount;
+    DWORD                   DirectThreshold;
 } MONITOR_CONSOLE, *PMONITOR_CONSOLE;
 
+// What to do with a client whose output queue is full
+typedef enum _MONITOR_LAGGING_POLICY {
+    MONITOR_LAGGING_DROP = 0,   // discard the new data
+    MONITOR_LAGGING_DISCONNECT, // close the connection
+    MONITOR_LAGGING_SKIP,       // discard the queued data instead
+    MONITOR_LAGGING_POLICY_COUNT
+} MONITOR_LAGGING_POLICY, *PMONITOR_LAGGING_POLICY;
+
 typedef struct _MONITOR_CONNECTION {
     PMONITOR_CONSOLE        Console;
     LIST_ENTRY              ListEntry;
     HANDLE                  Pipe;
-    HANDLE                  Thread;
+    MONITOR_OPERATION       Read;
+    MONITOR_OPERATION       Write;
+    UCHAR                   Buffer[MAXIMUM_BUFFER_SIZE];
+    DWORD                   InputOffset;
+    DWORD                   InputLength;
+    LIST_ENTRY              InputEntry;
+    BOOL                    InputWaiting;
+    BOOL                    History;
+    BOOL                    Requesting;
+    BOOL                    Replaying;
+    ULONGLONG               ReplayOffset;
+    PMONITOR_BUFFER         *Queue;
+    DWORD                   QueueHead;
+    DWORD                   QueueCount;
+    BOOL                    Writing;
+    BOOL                    Closing;
+    DWORD                   Outstanding;
+    ULONGLONG               Dropped;
 } MONITOR_CONNECTION, *PMONITOR_CONNECTION;
 
 static MONITOR_CONTEXT MonitorContext;
 
 #define PIPE_BASE_NAME "\\\\.\\pipe\\xencons\\"
 
-#define MAXIMUM_BUFFER_SIZE 1024
+// Device reads and writes of at least this many bytes use direct I/O
+#define DIRECT_IO_THRESHOLD 4096
+
+// Buffers queued for a pipe client before it is considered to be lagging
+#define OUTPUT_QUEUE_DEPTH 64
+
+// Reads kept outstanding on each console, and the size of each one
+#define DEVICE_READ_COUNT           4
+#define DEVICE_READ_MAXIMUM         32
+#define DEVICE_READ_SIZE            16384
+#define DEVICE_READ_SIZE_MAXIMUM    (1024 * 1024)
+
+// Client input is gathered into writes of up to this many bytes, and
+// held for up to this many milliseconds while no write is in progress
+#define DEVICE_WRITE_SIZE           4096
+#define DEVICE_WRITE_SIZE_MAXIMUM   (64 * 1024)
+#define DEVICE_WRITE_WINDOW         2
+#define DEVICE_WRITE_WINDOW_MAXIMUM 1000
+
+// Output recorded for each console, after compression
+#define HISTORY_SIZE                (1024 * 1024)
+#define HISTORY_SIZE_MAXIMUM        (256 * 1024 * 1024)
+#define HISTORY_CHUNK_SIZE          (64 * 1024)
+
+#define HISTORY_PIPE_SUFFIX "\\history"
 
 #define SERVICES_KEY "SYSTEM\\CurrentControlSet\\Services"
 
@@ -266,44 +415,6 @@ fail1:
     }
 }
 
-static FORCEINLINE VOID
-__InitializeListHead(
-    IN  PLIST_ENTRY ListEntry
-    )
-{
-    ListEntry->Flink = ListEntry;
-    ListEntry->Blink = ListEntry;
-}
-
-static FORCEINLINE VOID
-__InsertTailList(
-    IN  PLIST_ENTRY ListHead,
-    IN  PLIST_ENTRY ListEntry
-    )
-{
-    ListEntry->Blink = ListHead->Blink;
-    ListEntry->Flink = ListHead;
-    ListHead->Blink->Flink = ListEntry;
-    ListHead->Blink = ListEntry;
-}
-
-static FORCEINLINE VOID
-__RemoveEntryList(
-    IN  PLIST_ENTRY ListEntry
-    )
-{
-    PLIST_ENTRY     Flink;
-    PLIST_ENTRY     Blink;
-
-    Flink = ListEntry->Flink;
-    Blink = ListEntry->Blink;
-    Flink->Blink = Blink;
-    Blink->Flink = Flink;
-
-    ListEntry->Flink = ListEntry;
-    ListEntry->Blink = ListEntry;
-}
-
 static VOID
 PutString(
     IN  HANDLE      Handle,
@@ -333,198 +444,1304 @@ PutString(
 #define ECHO(_Handle, _Buffer) \
     PutString((_Handle), (PUCHAR)_Buffer, (DWORD)strlen((_Buffer)) * sizeof(CHAR))
 
-DWORD WINAPI
-ConnectionThread(
-    IN  LPVOID          Argument
+static PMONITOR_BUFFER
+BufferCreate(
+    IN  DWORD           Size
     )
 {
-    PMONITOR_CONNECTION Connection = (PMONITOR_CONNECTION)Argument;
-    PMONITOR_CONSOLE    Console = Connection->Console;
-    UCHAR               Buffer[MAXIMUM_BUFFER_SIZE];
-    OVERLAPPED          Overlapped;
-    HANDLE              Handle[2];
-    DWORD               Length;
-    DWORD               Object;
-    HRESULT             Error;
+    PMONITOR_BUFFER     Buffer;
 
-    Log("====> %s", Console->DeviceName);
+    Buffer = malloc(FIELD_OFFSET(MONITOR_BUFFER, Data) + Size);
+    if (Buffer == NULL)
+        return NULL;
 
-    ZeroMemory(&Overlapped, sizeof(OVERLAPPED));
-    Overlapped.hEvent = CreateEvent(NULL,
-                                    TRUE,
-                                    FALSE,
-                                    NULL);
-    if (Overlapped.hEvent == NULL)
-        goto fail1;
+    Buffer->Pool = NULL;
+    Buffer->Next = NULL;
+    Buffer->References = 1;
+    Buffer->Length = 0;
 
-    Handle[0] = Console->ServerEvent;
-    Handle[1] = Overlapped.hEvent;
+    return Buffer;
+}
 
-    EnterCriticalSection(&Console->CriticalSection);
-    __InsertTailList(&Console->ListHead, &Connection->ListEntry);
-    ++Console->ListCount;
-    LeaveCriticalSection(&Console->CriticalSection);
+// Pools are only used on the loop thread so they need no locking
+static VOID
+PoolInitialize(
+    IN  PMONITOR_POOL   Pool,
+    IN  DWORD           Size,
+    IN  DWORD           FreeMaximum
+    )
+{
+    ZeroMemory(Pool, sizeof(MONITOR_POOL));
+    Pool->Size = Size;
+    Pool->FreeMaximum = FreeMaximum;
+}
 
-    for (;;) {
-        (VOID) ReadFile(Connection->Pipe,
-                        Buffer,
-                        sizeof(Buffer),
-                        NULL,
-                        &Overlapped);
-
-        Object = WaitForMultipleObjects(ARRAYSIZE(Handle),
-                                        Handle,
-                                        FALSE,
-                                        INFINITE);
-        if (Object == WAIT_OBJECT_0)
-            break;
+static PMONITOR_BUFFER
+PoolGet(
+    IN  PMONITOR_POOL   Pool
+    )
+{
+    PMONITOR_BUFFER     Buffer;
+
+    Buffer = Pool->Free;
+    if (Buffer != NULL) {
+        Pool->Free = Buffer->Next;
+        --Pool->FreeCount;
+
+        Buffer->Next = NULL;
+        Buffer->References = 1;
+        Buffer->Length = 0;
+    } else {
+        Buffer = BufferCreate(Pool->Size);
+        if (Buffer == NULL)
+            return NULL;
+    }
 
-        if (!GetOverlappedResult(Connection->Pipe,
-                                 &Overlapped,
-                                 &Length,
-                                 FALSE))
-            break;
+    Buffer->Pool = Pool;
 
-        ResetEvent(Overlapped.hEvent);
+    return Buffer;
+}
 
-        PutString(Console->DeviceHandle,
-                  Buffer,
-                  Length);
+static VOID
+PoolPut(
+    IN  PMONITOR_POOL   Pool,
+    IN  PMONITOR_BUFFER Buffer
+    )
+{
+    if (Pool->FreeCount == Pool->FreeMaximum) {
+        free(Buffer);
+        return;
     }
 
-    EnterCriticalSection(&Console->CriticalSection);
-    __RemoveEntryList(&Connection->ListEntry);
-    --Console->ListCount;
-    LeaveCriticalSection(&Console->CriticalSection);
+    Buffer->Next = Pool->Free;
+    Pool->Free = Buffer;
+    ++Pool->FreeCount;
+}
 
-    CloseHandle(Overlapped.hEvent);
+static VOID
+PoolTeardown(
+    IN  PMONITOR_POOL   Pool
+    )
+{
+    while (Pool->Free != NULL) {
+        PMONITOR_BUFFER Buffer = Pool->Free;
 
-    FlushFileBuffers(Connection->Pipe);
-    DisconnectNamedPipe(Connection->Pipe);
-    CloseHandle(Connection->Pipe);
-    CloseHandle(Connection->Thread);
-    free(Connection);
+        Pool->Free = Buffer->Next;
+        --Pool->FreeCount;
 
-    Log("<==== %s", Console->DeviceName);
+        free(Buffer);
+    }
 
-    return 0;
+    assert(Pool->FreeCount == 0);
+    ZeroMemory(Pool, sizeof(MONITOR_POOL));
+}
 
-fail1:
-    Error = GetLastError();
+static FORCEINLINE VOID
+__BufferReference(
+    IN  PMONITOR_BUFFER Buffer
+    )
+{
+    InterlockedIncrement(&Buffer->References);
+}
 
-    {
-        PTCHAR  Message;
-        Message = GetErrorMessage(Error);
-        Log("fail1 (%s)", Message);
-        LocalFree(Message);
+static VOID
+BufferRelease(
+    IN  PMONITOR_BUFFER Buffer
+    )
+{
+    if (InterlockedDecrement(&Buffer->References) != 0)
+        return;
+
+    if (Buffer->Pool != NULL)
+        PoolPut(Buffer->Pool, Buffer);
+    else
+        free(Buffer);
+}
+
+static VOID
+HistoryDiscard(
+    IN  PMONITOR_HISTORY    History
+    )
+{
+    PMONITOR_CHUNK          Chunk;
+
+    Chunk = CONTAINING_RECORD(History->ChunkList.Flink,
+                              MONITOR_CHUNK,
+                              ListEntry);
+
+    __RemoveEntryList(&Chunk->ListEntry);
+    History->Stored -= Chunk->Size;
+
+    free(Chunk);
+}
+
+static VOID
+HistorySeal(
+    IN  PMONITOR_HISTORY    History
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    PMONITOR_CHUNK          Chunk;
+    DWORD                   Length;
+    SIZE_T                  Size;
+
+    Length = History->PendingLength;
+    History->PendingLength = 0;
+
+    Chunk = malloc(FIELD_OFFSET(MONITOR_CHUNK, Data) + Length);
+    if (Chunk == NULL) {
+        // Everything before the lost chunk has to go too, so that
+        // the history never has a hole in it
+        while (!__IsListEmpty(&History->ChunkList))
+            HistoryDiscard(History);
+
+        return;
+    }
+
+    Chunk->Offset = History->Offset - Length;
+    Chunk->Length = Length;
+
+    // Store the chunk as it is if it does not compress
+    if (History->Compressor != NULL &&
+        Compress(History->Compressor,
+                 History->Pending,
+                 Length,
+                 Chunk->Data,
+                 Length,
+                 &Size) &&
+        Size < Length) {
+        PMONITOR_CHUNK  Smaller;
+
+        Chunk->Compressed = TRUE;
+        Chunk->Size = (DWORD)Size;
+
+        Smaller = realloc(Chunk, FIELD_OFFSET(MONITOR_CHUNK, Data) + Size);
+        if (Smaller != NULL)
+            Chunk = Smaller;
+    } else {
+        memcpy(Chunk->Data, History->Pending, Length);
+
+        Chunk->Compressed = FALSE;
+        Chunk->Size = Length;
     }
 
-    return 1;
+    __InsertTailList(&History->ChunkList, &Chunk->ListEntry);
+    History->Stored += Chunk->Size;
+
+    while (History->Stored > Context->HistorySize)
+        HistoryDiscard(History);
 }
 
-DWORD WINAPI
-ServerThread(
-    IN  LPVOID          Argument
+static VOID
+HistoryAppend(
+    IN  PMONITOR_HISTORY    History,
+    IN  PUCHAR              Data,
+    IN  DWORD               Length
     )
 {
-    PMONITOR_CONSOLE    Console = (PMONITOR_CONSOLE)Argument;
-    CHAR                PipeName[MAXIMUM_BUFFER_SIZE];
-    OVERLAPPED          Overlapped;
-    HANDLE              Handle[2];
-    HANDLE              Pipe;
-    DWORD               Object;
-    PMONITOR_CONNECTION Connection;
-    HRESULT             Error;
+    // Offsets still count if nothing is being recorded
+    if (History->Pending == NULL) {
+        History->Offset += Length;
+        return;
+    }
 
-    Log("====> %s", Console->DeviceName);
+    while (Length != 0) {
+        DWORD   Count;
 
-    ZeroMemory(&Overlapped, sizeof(OVERLAPPED));
-    Overlapped.hEvent = CreateEvent(NULL,
-                                    TRUE,
-                                    FALSE,
-                                    NULL);
-    if (Overlapped.hEvent == NULL)
-        goto fail1;
+        Count = __min(HISTORY_CHUNK_SIZE - History->PendingLength, Length);
 
-    Handle[0] = Console->ServerEvent;
-    Handle[1] = Overlapped.hEvent;
+        memcpy(&History->Pending[History->PendingLength], Data, Count);
+        History->PendingLength += Count;
+        History->Offset += Count;
 
-    Error = StringCchPrintfA(PipeName,
-                             MAXIMUM_BUFFER_SIZE,
-                             "%s%s",
-                             PIPE_BASE_NAME,
-                             Console->DeviceName);
-    if (Error != S_OK && Error != STRSAFE_E_INSUFFICIENT_BUFFER)
-        goto fail2;
+        Data += Count;
+        Length -= Count;
 
-    Log("%s", PipeName);
+        if (History->PendingLength == HISTORY_CHUNK_SIZE)
+            HistorySeal(History);
+    }
+}
 
-    for (;;) {
-        Pipe = CreateNamedPipe(PipeName,
-                               PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
-                               PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE,
-                               PIPE_UNLIMITED_INSTANCES,
-                               MAXIMUM_BUFFER_SIZE,
-                               MAXIMUM_BUFFER_SIZE,
-                               0,
-                               NULL);
-        if (Pipe == INVALID_HANDLE_VALUE)
-            goto fail3;
+static ULONGLONG
+HistoryStart(
+    IN  PMONITOR_HISTORY    History
+    )
+{
+    PMONITOR_CHUNK          Chunk;
 
-        (VOID) ConnectNamedPipe(Pipe,
-                                &Overlapped);
+    if (__IsListEmpty(&History->ChunkList))
+        return History->Offset - History->PendingLength;
 
-        Object = WaitForMultipleObjects(ARRAYSIZE(Handle),
-                                        Handle,
-                                        FALSE,
-                                        INFINITE);
-        if (Object == WAIT_OBJECT_0) {
-            CloseHandle(Pipe);
-            break;
+    Chunk = CONTAINING_RECORD(History->ChunkList.Flink,
+                              MONITOR_CHUNK,
+                              ListEntry);
+
+    return Chunk->Offset;
+}
+
+// Return the recorded output from Offset to the end of the chunk that
+// holds it
+static PMONITOR_BUFFER
+HistoryRead(
+    IN  PMONITOR_HISTORY    History,
+    IN  ULONGLONG           Offset
+    )
+{
+    ULONGLONG               PendingStart;
+    PLIST_ENTRY             ListEntry;
+    PMONITOR_CHUNK          Chunk;
+    PMONITOR_BUFFER         Buffer;
+    DWORD                   Skip;
+    SIZE_T                  Length;
+
+    PendingStart = History->Offset - History->PendingLength;
+
+    if (Offset >= PendingStart) {
+        Length = (DWORD)(History->Offset - Offset);
+
+        Buffer = BufferCreate((DWORD)Length);
+        if (Buffer == NULL)
+            return NULL;
+
+        memcpy(Buffer->Data,
+               &History->Pending[Offset - PendingStart],
+               Length);
+        Buffer->Length = (DWORD)Length;
+
+        return Buffer;
+    }
+
+    for (ListEntry = History->ChunkList.Flink;
+         ListEntry != &History->ChunkList;
+         ListEntry = ListEntry->Flink) {
+        Chunk = CONTAINING_RECORD(ListEntry,
+                                  MONITOR_CHUNK,
+                                  ListEntry);
+
+        if (Offset >= Chunk->Offset &&
+            Offset < Chunk->Offset + Chunk->Length)
+            goto found;
+    }
+
+    return NULL;
+
+found:
+    Buffer = BufferCreate(Chunk->Length);
+    if (Buffer == NULL)
+        return NULL;
+
+    if (Chunk->Compressed) {
+        if (!Decompress(History->Decompressor,
+                        Chunk->Data,
+                        Chunk->Size,
+                        Buffer->Data,
+                        Chunk->Length,
+                        &Length) ||
+            Length != Chunk->Length) {
+            BufferRelease(Buffer);
+            return NULL;
         }
+    } else {
+        memcpy(Buffer->Data, Chunk->Data, Chunk->Length);
+    }
 
-        ResetEvent(Overlapped.hEvent);
+    Skip = (DWORD)(Offset - Chunk->Offset);
 
-        Connection = (PMONITOR_CONNECTION)malloc(sizeof(MONITOR_CONNECTION));
-        if (Connection == NULL)
-            goto fail4;
+    memmove(Buffer->Data, &Buffer->Data[Skip], Chunk->Length - Skip);
+    Buffer->Length = Chunk->Length - Skip;
 
-        __InitializeListHead(&Connection->ListEntry);
-        Connection->Console = Console;
-        Connection->Pipe = Pipe;
-        Connection->Thread = CreateThread(NULL,
-                                          0,
-                                          ConnectionThread,
-                                          Connection,
-                                          0,
-                                          NULL);
-        if (Connection->Thread == NULL)
-            goto fail5;
+    return Buffer;
+}
+
+static BOOL
+HistoryInitialize(
+    IN  PMONITOR_HISTORY    History
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    FILETIME                Time;
+
+    ZeroMemory(History, sizeof(MONITOR_HISTORY));
+    __InitializeListHead(&History->ChunkList);
+
+    // Lets clients tell offsets from an earlier attachment apart
+    GetSystemTimeAsFileTime(&Time);
+    History->Instance = ((ULONGLONG)Time.dwHighDateTime << 32) |
+                        Time.dwLowDateTime;
+
+    if (Context->HistorySize == 0)
+        return TRUE;
+
+    History->Pending = malloc(HISTORY_CHUNK_SIZE);
+    if (History->Pending == NULL)
+        return FALSE;
+
+    // Without both halves chunks are stored uncompressed
+    if (!CreateCompressor(COMPRESS_ALGORITHM_XPRESS,
+                          NULL,
+                          &History->Compressor))
+        History->Compressor = NULL;
+
+    if (!CreateDecompressor(COMPRESS_ALGORITHM_XPRESS,
+                            NULL,
+                            &History->Decompressor))
+        History->Decompressor = NULL;
+
+    if (History->Compressor == NULL || History->Decompressor == NULL) {
+        Log("compression not available");
+
+        if (History->Compressor != NULL)
+            CloseCompressor(History->Compressor);
+        History->Compressor = NULL;
+
+        if (History->Decompressor != NULL)
+            CloseDecompressor(History->Decompressor);
+        History->Decompressor = NULL;
     }
 
-    CloseHandle(Overlapped.hEvent);
+    return TRUE;
+}
 
-    Log("<==== %s", Console->DeviceName);
+static VOID
+HistoryTeardown(
+    IN  PMONITOR_HISTORY    History
+    )
+{
+    while (!__IsListEmpty(&History->ChunkList))
+        HistoryDiscard(History);
 
-    return 0;
+    assert(History->Stored == 0);
 
-fail5:
-    Log("fail5");
+    if (History->Decompressor != NULL)
+        CloseDecompressor(History->Decompressor);
 
-    free(Connection);
+    if (History->Compressor != NULL)
+        CloseCompressor(History->Compressor);
 
-fail4:
-    Log("fail4");
+    free(History->Pending);
+
+    ZeroMemory(History, sizeof(MONITOR_HISTORY));
+}
+
+static FORCEINLINE BOOL
+__DirectIoSupported(
+    IN  PMONITOR_CONSOLE    Console
+    )
+{
+    DWORD                   Error = GetLastError();
+
+    if (Error != ERROR_NOT_SUPPORTED &&
+        Error != ERROR_INVALID_FUNCTION)
+        return TRUE;
+
+    // Not all consoles support it, so stop trying
+    Log("%s: direct I/O not supported", Console->DeviceName);
+    Console->DirectThreshold = 0;
+
+    return FALSE;
+}
+
+// Large requests use direct I/O so that the driver copies straight
+// between our buffer and the shared ring; small ones stay buffered.
+// Both return TRUE if the loop will see a completion.
+static BOOL
+DeviceRead(
+    IN  PMONITOR_CONSOLE    Console,
+    IN  PUCHAR              Buffer,
+    IN  DWORD               Length,
+    IN  LPOVERLAPPED        Overlapped
+    )
+{
+    if (Console->DirectThreshold != 0 &&
+        Length >= Console->DirectThreshold) {
+        if (DeviceIoControl(Console->Device,
+                            IOCTL_XENCONS_READ_DIRECT,
+                            NULL,
+                            0,
+                            Buffer,
+                            Length,
+                            NULL,
+                            Overlapped) ||
+            GetLastError() == ERROR_IO_PENDING)
+            return TRUE;
+
+        if (__DirectIoSupported(Console))
+            return FALSE;
+    }
+
+    return (ReadFile(Console->Device,
+                     Buffer,
+                     Length,
+                     NULL,
+                     Overlapped) ||
+            GetLastError() == ERROR_IO_PENDING) ? TRUE : FALSE;
+}
+
+static BOOL
+DeviceWrite(
+    IN  PMONITOR_CONSOLE    Console,
+    IN  PUCHAR              Buffer,
+    IN  DWORD               Length,
+    IN  LPOVERLAPPED        Overlapped
+    )
+{
+    if (Console->DirectThreshold != 0 &&
+        Length >= Console->DirectThreshold) {
+        // The data goes in the output buffer of an IN_DIRECT request
+        if (DeviceIoControl(Console->Device,
+                            IOCTL_XENCONS_WRITE_DIRECT,
+                            NULL,
+                            0,
+                            Buffer,
+                            Length,
+                            NULL,
+                            Overlapped) ||
+            GetLastError() == ERROR_IO_PENDING)
+            return TRUE;
+
+        if (__DirectIoSupported(Console))
+            return FALSE;
+    }
+
+    return (WriteFile(Console->Device,
+                      Buffer,
+                      Length,
+                      NULL,
+                      Overlapped) ||
+            GetLastError() == ERROR_IO_PENDING) ? TRUE : FALSE;
+}
+
+static FORCEINLINE VOID
+__OperationInitialize(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  MONITOR_COMPLETION  Complete,
+    IN  PVOID               Argument
+    )
+{
+    ZeroMemory(Operation, sizeof(MONITOR_OPERATION));
+    Operation->Complete = Complete;
+    Operation->Argument = Argument;
+}
+
+// The OVERLAPPED must be clean each time an operation is started
+static FORCEINLINE LPOVERLAPPED
+__OperationOverlapped(
+    IN  PMONITOR_OPERATION  Operation
+    )
+{
+    ZeroMemory(&Operation->Overlapped, sizeof(OVERLAPPED));
+    return &Operation->Overlapped;
+}
+
+static BOOL
+LoopAssociate(
+    IN  HANDLE          Handle
+    )
+{
+    PMONITOR_CONTEXT    Context = &MonitorContext;
+
+    return (CreateIoCompletionPort(Handle,
+                                   Context->Port,
+                                   0,
+                                   0) != NULL) ? TRUE : FALSE;
+}
+
+// The loop backend for the service: completions come from an I/O
+// completion port and the clock is GetTickCount64()
+
+static ULONGLONG
+PortNow(
+    IN  PVOID   Context
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    return GetTickCount64();
+}
+
+static BOOL
+PortPost(
+    IN  PVOID               Context,
+    IN  PMONITOR_OPERATION  Operation
+    )
+{
+    HANDLE                  Port = Context;
+
+    return PostQueuedCompletionStatus(Port,
+                                      0,
+                                      0,
+                                      __OperationOverlapped(Operation));
+}
+
+static BOOL
+PortWait(
+    IN  PVOID               Context,
+    IN  DWORD               Timeout,
+    OUT PMONITOR_OPERATION  *Operation,
+    OUT PDWORD              Error,
+    OUT PDWORD              Length
+    )
+{
+    HANDLE                  Port = Context;
+    LPOVERLAPPED            Overlapped;
+    ULONG_PTR               Key;
+
+    Overlapped = NULL;
+    *Error = GetQueuedCompletionStatus(Port,
+                                       Length,
+                                       &Key,
+                                       &Overlapped,
+                                       Timeout) ?
+             ERROR_SUCCESS :
+             GetLastError();
+
+    if (Overlapped == NULL && *Error == WAIT_TIMEOUT)
+        return FALSE;
+
+    // A packet without an operation asks the loop to exit
+    *Operation = (Overlapped != NULL) ?
+                 CONTAINING_RECORD(Overlapped,
+                                   MONITOR_OPERATION,
+                                   Overlapped) :
+                 NULL;
+
+    return TRUE;
+}
+
+static const MONITOR_LOOP_BACKEND PortBackend = {
+    PortNow,
+    PortPost,
+    PortWait
+};
+
+// Everything other than the console list belongs to this thread
+DWORD WINAPI
+LoopThread(
+    IN  LPVOID          Argument
+    )
+{
+    PMONITOR_CONTEXT    Context = &MonitorContext;
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    Log("====>");
+
+    LoopRun(&Context->Loop);
+
+    Log("<====");
+
+    return 0;
+}
+
+// Once this signals the console may be freed, so it must be the last
+// thing a completion does with it
+static FORCEINLINE VOID
+__ConsoleCheckStopped(
+    IN  PMONITOR_CONSOLE    Console
+    )
+{
+    if (Console->Stopping &&
+        Console->Outstanding == 0 &&
+        Console->ListCount == 0)
+        SetEvent(Console->StoppedEvent);
+}
+
+static VOID
+ConnectionSkip(
+    IN  PMONITOR_CONNECTION Connection
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    DWORD                   Keep;
+
+    // The buffer at the head may be being written
+    Keep = Connection->Writing ? 1 : 0;
+
+    while (Connection->QueueCount > Keep) {
+        DWORD           Index;
+        PMONITOR_BUFFER Buffer;
+
+        Index = (Connection->QueueHead + Connection->QueueCount - 1) %
+                Context->QueueDepth;
+        Buffer = Connection->Queue[Index];
+        Connection->Queue[Index] = NULL;
+        --Connection->QueueCount;
+
+        Connection->Dropped += Buffer->Length;
+        BufferRelease(Buffer);
+    }
+}
+
+static VOID
+ConnectionDestroy(
+    IN  PMONITOR_CONNECTION Connection
+    )
+{
+    PMONITOR_CONSOLE        Console = Connection->Console;
+
+    assert(Connection->Outstanding == 0);
+    assert(!Connection->Writing);
+
+    __RemoveEntryList(&Connection->ListEntry);
+    --Console->ListCount;
+
+    if (Connection->InputWaiting) {
+        __RemoveEntryList(&Connection->InputEntry);
+        Connection->InputWaiting = FALSE;
+    }
+
+    ConnectionSkip(Connection);
+    assert(Connection->QueueCount == 0);
+
+    if (Connection->Dropped != 0)
+        Log("%s: dropped %llu bytes", Console->DeviceName,
+            Connection->Dropped);
+
+    free(Connection->Queue);
+
+    DisconnectNamedPipe(Connection->Pipe);
+    CloseHandle(Connection->Pipe);
+    free(Connection);
+
+    Log("%s: disconnected", Console->DeviceName);
+
+    __ConsoleCheckStopped(Console);
+}
+
+// The connection is gone once nothing is in flight, so callers must
+// not touch it afterwards
+static VOID
+ConnectionClose(
+    IN  PMONITOR_CONNECTION Connection
+    )
+{
+    if (!Connection->Closing) {
+        Connection->Closing = TRUE;
+
+        (VOID) CancelIoEx(Connection->Pipe, NULL);
+    }
+
+    if (Connection->Outstanding == 0)
+        ConnectionDestroy(Connection);
+}
+
+static FORCEINLINE VOID
+__ConnectionPush(
+    IN  PMONITOR_CONNECTION Connection,
+    IN  PMONITOR_BUFFER     Buffer
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    DWORD                   Index;
+
+    assert(Connection->QueueCount < Context->QueueDepth);
+
+    Index = (Connection->QueueHead + Connection->QueueCount) %
+            Context->QueueDepth;
+
+    __BufferReference(Buffer);
+    Connection->Queue[Index] = Buffer;
+    ++Connection->QueueCount;
+}
+
+// Queue the next piece of recorded output for a client that is
+// catching up, which joins the live stream once it has it all
+static BOOL
+ConnectionReplay(
+    IN  PMONITOR_CONNECTION Connection
+    )
+{
+    PMONITOR_CONSOLE        Console = Connection->Console;
+    PMONITOR_HISTORY        History = &Console->History;
+    PMONITOR_BUFFER         Buffer;
+
+    if (Connection->ReplayOffset < HistoryStart(History)) {
+        Log("%s: history overtaken at %llu", Console->DeviceName,
+            Connection->ReplayOffset);
+        return FALSE;
+    }
+
+    Buffer = HistoryRead(History, Connection->ReplayOffset);
+    if (Buffer == NULL)
+        return FALSE;
+
+    Connection->ReplayOffset += Buffer->Length;
+    if (Connection->ReplayOffset == History->Offset)
+        Connection->Replaying = FALSE;
+
+    __ConnectionPush(Connection, Buffer);
+    BufferRelease(Buffer);
+
+    return TRUE;
+}
+
+// Start writing the buffer at the head of the queue, unless a write is
+// already in progress
+static BOOL
+ConnectionWrite(
+    IN  PMONITOR_CONNECTION Connection
+    )
+{
+    PMONITOR_BUFFER         Buffer;
+
+    if (Connection->Writing)
+        return TRUE;
+
+    if (Connection->QueueCount == 0 &&
+        Connection->Replaying &&
+        !ConnectionReplay(Connection))
+        return FALSE;
+
+    if (Connection->QueueCount == 0)
+        return TRUE;
+
+    Buffer = Connection->Queue[Connection->QueueHead];
+
+    if (!WriteFile(Connection->Pipe,
+                   Buffer->Data,
+                   Buffer->Length,
+                   NULL,
+                   __OperationOverlapped(&Connection->Write)) &&
+        GetLastError() != ERROR_IO_PENDING)
+        return FALSE;
+
+    Connection->Writing = TRUE;
+    ++Connection->Outstanding;
+
+    return TRUE;
+}
+
+static VOID
+ConnectionQueue(
+    IN  PMONITOR_CONNECTION Connection,
+    IN  PMONITOR_BUFFER     Buffer
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    PMONITOR_CONSOLE        Console = Connection->Console;
+
+    // Clients that are catching up take output from the history
+    if (Connection->Closing ||
+        Connection->Requesting ||
+        Connection->Replaying)
+        return;
+
+    if (Connection->QueueCount == Context->QueueDepth) {
+        switch (Context->LaggingPolicy) {
+        case MONITOR_LAGGING_DISCONNECT:
+            Log("%s: disconnecting lagging client", Console->DeviceName);
+            ConnectionClose(Connection);
+            return;
+
+        case MONITOR_LAGGING_SKIP:
+            ConnectionSkip(Connection);
+            break;
+
+        default:
+            Connection->Dropped += Buffer->Length;
+            return;
+        }
+    }
+
+    __ConnectionPush(Connection, Buffer);
+
+    if (!ConnectionWrite(Connection))
+        ConnectionClose(Connection);
+}
+
+// The first message from a history client says where its output should
+// start. The reply goes out ahead of any output.
+static BOOL
+ConnectionRequest(
+    IN  PMONITOR_CONNECTION     Connection
+    )
+{
+    PMONITOR_CONSOLE            Console = Connection->Console;
+    PMONITOR_HISTORY            History = &Console->History;
+    PXENCONS_HISTORY_REQUEST    Request;
+    PXENCONS_HISTORY_REPLY      Reply;
+    PMONITOR_BUFFER             Buffer;
+    ULONGLONG                   Start;
+    ULONGLONG                   End;
+    ULONGLONG                   Offset;
+
+    if (Connection->InputLength != sizeof(XENCONS_HISTORY_REQUEST))
+        goto fail1;
+
+    Request = (PXENCONS_HISTORY_REQUEST)Connection->Buffer;
+    if (Request->Signature != XENCONS_HISTORY_SIGNATURE)
+        goto fail1;
+
+    Start = HistoryStart(History);
+    End = History->Offset;
+
+    switch (Request->Mode) {
+    case XENCONS_HISTORY_LAST:
+        Offset = (Request->Value < End - Start) ?
+                 End - Request->Value :
+                 Start;
+        break;
+
+    case XENCONS_HISTORY_FROM:
+        Offset = Request->Value;
+        break;
+
+    default:
+        goto fail1;
+    }
+
+    Buffer = BufferCreate(sizeof(XENCONS_HISTORY_REPLY));
+    if (Buffer == NULL)
+        goto fail2;
+
+    Reply = (PXENCONS_HISTORY_REPLY)Buffer->Data;
+    Reply->Signature = XENCONS_HISTORY_SIGNATURE;
+    Reply->Flags = 0;
+    Reply->Instance = History->Instance;
+
+    if (Offset < Start || Offset > End) {
+        Offset = (Offset < Start) ? Start : End;
+        Reply->Flags |= XENCONS_HISTORY_GAP;
+    }
+
+    Reply->Offset = Offset;
+    Buffer->Length = sizeof(XENCONS_HISTORY_REPLY);
+
+    __ConnectionPush(Connection, Buffer);
+    BufferRelease(Buffer);
+
+    Log("%s: replaying from %llu", Console->DeviceName, Offset);
+
+    Connection->Requesting = FALSE;
+    Connection->ReplayOffset = Offset;
+    Connection->Replaying = (Offset < End) ? TRUE : FALSE;
+
+    return ConnectionWrite(Connection);
+
+fail2:
+    Log("fail2");
+
+    return FALSE;
+
+fail1:
+    Log("%s: bad history request", Console->DeviceName);
+
+    return FALSE;
+}
+
+static BOOL
+ConnectionRead(
+    IN  PMONITOR_CONNECTION Connection
+    )
+{
+    if (!ReadFile(Connection->Pipe,
+                  Connection->Buffer,
+                  sizeof(Connection->Buffer),
+                  NULL,
+                  __OperationOverlapped(&Connection->Read)) &&
+        GetLastError() != ERROR_IO_PENDING)
+        return FALSE;
+
+    ++Connection->Outstanding;
+
+    return TRUE;
+}
+
+static VOID
+ConsoleInputDrain(
+    IN  PMONITOR_CONSOLE    Console
+    );
+
+static VOID
+ConsoleWrite(
+    IN  PMONITOR_CONSOLE    Console
+    )
+{
+    PUCHAR                  Buffer;
+    DWORD                   Length;
+    DWORD                   Bucket;
+
+    assert(!Console->Writing);
+    assert(Console->WriteLength != 0);
+
+    LoopTimerCancel(&Console->WriteTimer);
+    Console->WriteDue = FALSE;
+
+    // Swap buffers so that input can gather while this one is written
+    Buffer = Console->WriteBuffer[Console->WriteIndex];
+    Length = Console->WriteLength;
+
+    Console->WriteIndex ^= 1;
+    Console->WriteLength = 0;
+
+    Console->WriteOffset = 0;
+    Console->WriteCount = Length;
+
+    ++Console->Writes;
+    Console->WriteBytes += Length;
+
+    for (Bucket = 0; Length >> (Bucket + 1) != 0; Bucket++)
+        ;
+    if (Bucket >= WRITE_SIZE_BUCKETS)
+        Bucket = WRITE_SIZE_BUCKETS - 1;
+
+    ++Console->WriteSizes[Bucket];
+
+    if (DeviceWrite(Console,
+                    Buffer,
+                    Length,
+                    __OperationOverlapped(&Console->Write))) {
+        Console->Writing = TRUE;
+        ++Console->Outstanding;
+    } else {
+        Log("%s: dropped %u bytes of input", Console->DeviceName, Length);
+    }
+}
+
+// Start a write unless one is already in progress. Input is held back
+// for a short window in case more arrives, but not once the buffer is
+// full or clients are waiting for space.
+static VOID
+ConsoleWriteKick(
+    IN  PMONITOR_CONSOLE    Console
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+
+    if (Console->Writing || Console->WriteLength == 0)
+        return;
+
+    if (Context->WriteWindow != 0 &&
+        !Console->WriteDue &&
+        Console->WriteLength < Context->WriteSize &&
+        __IsListEmpty(&Console->InputList)) {
+        if (!Console->WriteTimer.Armed)
+            LoopTimerSet(&Context->Loop,
+                         &Console->WriteTimer,
+                         Context->WriteWindow);
+        return;
+    }
+
+    ConsoleWrite(Console);
+
+    if (!Console->Writing)
+        ConsoleInputDrain(Console);
+}
+
+// Copy as much of a client's message as fits into the pending buffer
+static BOOL
+ConsoleInputCopy(
+    IN  PMONITOR_CONSOLE    Console,
+    IN  PMONITOR_CONNECTION Connection
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    PUCHAR                  Buffer;
+    DWORD                   Count;
+
+    Buffer = Console->WriteBuffer[Console->WriteIndex];
+
+    Count = __min(Context->WriteSize - Console->WriteLength,
+                  Connection->InputLength - Connection->InputOffset);
+
+    memcpy(&Buffer[Console->WriteLength],
+           &Connection->Buffer[Connection->InputOffset],
+           Count);
+
+    Console->WriteLength += Count;
+    Connection->InputOffset += Count;
+
+    return (Connection->InputOffset == Connection->InputLength) ? TRUE : FALSE;
+}
+
+// Clients waiting for space are served in the order they arrived and
+// each asks for more input only once all of its last message has been
+// taken, so input from any one client reaches the device in order
+static VOID
+ConsoleInputDrain(
+    IN  PMONITOR_CONSOLE    Console
+    )
+{
+    while (!__IsListEmpty(&Console->InputList)) {
+        PMONITOR_CONNECTION Connection;
+
+        Connection = CONTAINING_RECORD(Console->InputList.Flink,
+                                       MONITOR_CONNECTION,
+                                       InputEntry);
+
+        if (!ConsoleInputCopy(Console, Connection))
+            break;
+
+        __RemoveEntryList(&Connection->InputEntry);
+        Connection->InputWaiting = FALSE;
+
+        if (!ConnectionRead(Connection))
+            ConnectionClose(Connection);
+    }
+
+    ConsoleWriteKick(Console);
+}
+
+// Returns TRUE if all of the message was taken, otherwise the client
+// waits for space
+static BOOL
+ConsoleInput(
+    IN  PMONITOR_CONSOLE    Console,
+    IN  PMONITOR_CONNECTION Connection
+    )
+{
+    ++Console->InputMessages;
+
+    if (__IsListEmpty(&Console->InputList) &&
+        ConsoleInputCopy(Console, Connection)) {
+        ConsoleWriteKick(Console);
+        return TRUE;
+    }
+
+    __InsertTailList(&Console->InputList, &Connection->InputEntry);
+    Connection->InputWaiting = TRUE;
+
+    ConsoleWriteKick(Console);
+    return FALSE;
+}
+
+static VOID
+ConsoleWriteComplete(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    PMONITOR_CONSOLE        Console = Operation->Argument;
+
+    Console->Writing = FALSE;
+
+    if (Error == ERROR_SUCCESS)
+        Console->WriteOffset += Length;
+    else if (Error != ERROR_OPERATION_ABORTED)
+        Log("%s: dropped %u bytes of input", Console->DeviceName,
+            Console->WriteCount - Console->WriteOffset);
+
+    if (!Console->Stopping) {
+        // Finish a short write before anything else
+        if (Error == ERROR_SUCCESS &&
+            Console->WriteOffset < Console->WriteCount) {
+            PUCHAR  Buffer;
+
+            Buffer = Console->WriteBuffer[Console->WriteIndex ^ 1];
+
+            if (DeviceWrite(Console,
+                            &Buffer[Console->WriteOffset],
+                            Console->WriteCount - Console->WriteOffset,
+                            __OperationOverlapped(&Console->Write))) {
+                Console->Writing = TRUE;
+                goto done;
+            }
+        }
+
+        ConsoleInputDrain(Console);
+    }
+
+    --Console->Outstanding;
+
+done:
+    __ConsoleCheckStopped(Console);
+}
+
+static VOID
+ConsoleWriteTimerComplete(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    PMONITOR_CONSOLE        Console = Operation->Argument;
+
+    UNREFERENCED_PARAMETER(Error);
+    UNREFERENCED_PARAMETER(Length);
+
+    Console->WriteDue = TRUE;
+    ConsoleWriteKick(Console);
+}
+
+static VOID
+ConnectionReadComplete(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    PMONITOR_CONNECTION     Connection = Operation->Argument;
+
+    --Connection->Outstanding;
+
+    // The rest of a long message comes with the next read
+    if (Error == ERROR_MORE_DATA)
+        Error = ERROR_SUCCESS;
+
+    if (Error == ERROR_SUCCESS && !Connection->Closing) {
+        Connection->InputOffset = 0;
+        Connection->InputLength = Length;
+
+        if (Connection->Requesting) {
+            if (ConnectionRequest(Connection) &&
+                ConnectionRead(Connection))
+                return;
+        } else if (Connection->History) {
+            // History clients only collect output. Reads stay posted
+            // to notice the client going away, but anything more it
+            // sends ends the connection rather than reaching the guest.
+            Log("%s: input on history connection",
+                Connection->Console->DeviceName);
+        } else {
+            // The next read is issued once the aggregator has taken
+            // all of this message
+            if (!ConsoleInput(Connection->Console, Connection) ||
+                ConnectionRead(Connection))
+                return;
+        }
+    }
+
+    ConnectionClose(Connection);
+}
+
+static VOID
+ConnectionWriteComplete(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    PMONITOR_CONNECTION     Connection = Operation->Argument;
+    PMONITOR_BUFFER         Buffer;
+
+    UNREFERENCED_PARAMETER(Length);
+
+    --Connection->Outstanding;
+
+    assert(Connection->Writing);
+    assert(Connection->QueueCount != 0);
+
+    Buffer = Connection->Queue[Connection->QueueHead];
+    Connection->Queue[Connection->QueueHead] = NULL;
+    Connection->QueueHead = (Connection->QueueHead + 1) %
+                            Context->QueueDepth;
+    --Connection->QueueCount;
+    Connection->Writing = FALSE;
+
+    BufferRelease(Buffer);
+
+    if (Error == ERROR_SUCCESS && !Connection->Closing) {
+        if (ConnectionWrite(Connection))
+            return;
+    }
+
+    ConnectionClose(Connection);
+}
+
+static BOOL
+ConnectionCreate(
+    IN  PMONITOR_CONSOLE    Console,
+    IN  HANDLE              Pipe,
+    IN  BOOL                History
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    PMONITOR_CONNECTION     Connection;
+    HRESULT                 Error;
+
+    Connection = calloc(1, sizeof(MONITOR_CONNECTION));
+    if (Connection == NULL)
+        goto fail1;
+
+    Connection->Queue = calloc(Context->QueueDepth,
+                               sizeof(PMONITOR_BUFFER));
+    if (Connection->Queue == NULL)
+        goto fail2;
+
+    __InitializeListHead(&Connection->ListEntry);
+    __InitializeListHead(&Connection->InputEntry);
+    Connection->Console = Console;
+    Connection->Pipe = Pipe;
+    Connection->History = History;
+    Connection->Requesting = History;
+
+    __OperationInitialize(&Connection->Read,
+                          ConnectionReadComplete,
+                          Connection);
+    __OperationInitialize(&Connection->Write,
+                          ConnectionWriteComplete,
+                          Connection);
+
+    __InsertTailList(&Console->ListHead, &Connection->ListEntry);
+    ++Console->ListCount;
+
+    if (!ConnectionRead(Connection))
+        goto fail3;
+
+    Log("%s: connected", Console->DeviceName);
+
+    return TRUE;
+
+fail3:
+    Log("fail3");
+
+    __RemoveEntryList(&Connection->ListEntry);
+    --Console->ListCount;
+
+    free(Connection->Queue);
+
+fail2:
+    Log("fail2");
+
+    free(Connection);
+
+fail1:
+    Error = GetLastError();
+
+    {
+        PTCHAR  Message;
+        Message = GetErrorMessage(Error);
+        Log("fail1 (%s)", Message);
+        LocalFree(Message);
+    }
+
+    return FALSE;
+}
+
+static BOOL
+ConsoleRead(
+    IN  PMONITOR_CONSOLE    Console,
+    IN  PMONITOR_READ       Read
+    )
+{
+    PMONITOR_BUFFER         Buffer;
+    HRESULT                 Error;
+
+    // Read straight into a buffer that the connections can share
+    Buffer = PoolGet(&Console->Pool);
+    if (Buffer == NULL)
+        goto fail1;
+
+    Read->Buffer = Buffer;
+    Read->Completed = FALSE;
+
+    if (!DeviceRead(Console,
+                    Buffer->Data,
+                    Console->Pool.Size,
+                    __OperationOverlapped(&Read->Operation)))
+        goto fail2;
 
-    CloseHandle(Pipe);
+    ++Console->Outstanding;
 
-fail3:
-    Log("fail3");
+    return TRUE;
 
 fail2:
     Log("fail2");
 
-    CloseHandle(Overlapped.hEvent);
+    Read->Buffer = NULL;
+    BufferRelease(Buffer);
 
 fail1:
     Error = GetLastError();
@@ -536,101 +1753,140 @@ fail1:
         LocalFree(Message);
     }
 
-    return 1;
+    return FALSE;
 }
 
-DWORD WINAPI
-DeviceThread(
-    IN  LPVOID          Argument
+static VOID
+ConsoleOutput(
+    IN  PMONITOR_CONSOLE    Console,
+    IN  PMONITOR_BUFFER     Buffer
     )
 {
-    PMONITOR_CONSOLE    Console = (PMONITOR_CONSOLE)Argument;
-    OVERLAPPED          Overlapped;
-    HANDLE              Device;
-    UCHAR               Buffer[MAXIMUM_BUFFER_SIZE];
-    DWORD               Length;
-    DWORD               Wait;
-    HANDLE              Handles[2];
-    DWORD               Error;
+    PLIST_ENTRY             ListEntry;
+    PLIST_ENTRY             Next;
 
-    Log("====> %s", Console->DeviceName);
+    // Record the output before it goes out, so that a client catching
+    // up can never miss any
+    HistoryAppend(&Console->History, Buffer->Data, Buffer->Length);
 
-    ZeroMemory(&Overlapped, sizeof(OVERLAPPED));
-    Overlapped.hEvent = CreateEvent(NULL,
-                                    TRUE,
-                                    FALSE,
-                                    NULL);
-    if (Overlapped.hEvent == NULL)
-        goto fail1;
+    // Queueing never blocks so a slow client cannot hold up the
+    // others, or the device
+    for (ListEntry = Console->ListHead.Flink;
+         ListEntry != &Console->ListHead;
+         ListEntry = Next) {
+        PMONITOR_CONNECTION Connection;
 
-    Handles[0] = Console->DeviceEvent;
-    Handles[1] = Overlapped.hEvent;
-
-    Device = CreateFileW(Console->DevicePath,
-                         GENERIC_READ,
-                         FILE_SHARE_READ | FILE_SHARE_WRITE,
-                         NULL,
-                         OPEN_EXISTING,
-                         FILE_FLAG_OVERLAPPED,
-                         NULL);
-    if (Device == INVALID_HANDLE_VALUE)
-        goto fail2;
+        Next = ListEntry->Flink;
+
+        Connection = CONTAINING_RECORD(ListEntry,
+                                       MONITOR_CONNECTION,
+                                       ListEntry);
+
+        ConnectionQueue(Connection, Buffer);
+    }
+}
 
+static VOID
+ConsoleReadComplete(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    PMONITOR_CONSOLE        Console = Operation->Argument;
+    PMONITOR_READ           Read;
+
+    Read = CONTAINING_RECORD(Operation, MONITOR_READ, Operation);
+
+    Read->Completed = TRUE;
+    Read->Error = Error;
+    Read->Buffer->Length = Length;
+
+    // Reads may complete out of order but their data is passed on in
+    // the order they were issued, and each is re-issued as it is
+    // passed on so that the issue order never changes
     for (;;) {
-        PLIST_ENTRY     ListEntry;
-
-        (VOID) ReadFile(Device,
-                        Buffer,
-                        sizeof(Buffer),
-                        NULL,
-                        &Overlapped);
-
-        Wait = WaitForMultipleObjects(ARRAYSIZE(Handles),
-                                      Handles,
-                                      FALSE,
-                                      INFINITE);
-        if (Wait == WAIT_OBJECT_0)
-            break;
+        PMONITOR_BUFFER Buffer;
 
-        if (!GetOverlappedResult(Device,
-                                 &Overlapped,
-                                 &Length,
-                                 FALSE))
+        Read = &Console->Reads[Console->ReadHead];
+        if (!Read->Completed)
             break;
 
-        ResetEvent(Overlapped.hEvent);
+        Buffer = Read->Buffer;
+        Read->Buffer = NULL;
+        Read->Completed = FALSE;
 
-        EnterCriticalSection(&Console->CriticalSection);
+        Console->ReadHead = (Console->ReadHead + 1) % Context->ReadCount;
 
-        for (ListEntry = Console->ListHead.Flink;
-                ListEntry != &Console->ListHead;
-                ListEntry = ListEntry->Flink) {
-            PMONITOR_CONNECTION Connection;
+        if (Read->Error != ERROR_SUCCESS)
+            Console->ReadFailed = TRUE;
+        else if (!Console->Stopping)
+            ConsoleOutput(Console, Buffer);
 
-            Connection = CONTAINING_RECORD(ListEntry,
-                                           MONITOR_CONNECTION,
-                                           ListEntry);
+        BufferRelease(Buffer);
+        --Console->Outstanding;
 
-            PutString(Connection->Pipe,
-                      Buffer,
-                      Length);
-        }
-
-        LeaveCriticalSection(&Console->CriticalSection);
+        if (!Console->Stopping &&
+            !Console->ReadFailed &&
+            !ConsoleRead(Console, Read))
+            Console->ReadFailed = TRUE;
     }
 
-    CloseHandle(Device);
+    __ConsoleCheckStopped(Console);
+}
+
+static VOID
+ConsoleListen(
+    IN  PMONITOR_CONSOLE    Console,
+    IN  PMONITOR_LISTENER   Listener
+    )
+{
+    HANDLE                  Pipe;
+    HRESULT                 Error;
+
+    Pipe = CreateNamedPipe(Listener->PipeName,
+                           PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                           PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE,
+                           PIPE_UNLIMITED_INSTANCES,
+                           MAXIMUM_BUFFER_SIZE,
+                           MAXIMUM_BUFFER_SIZE,
+                           0,
+                           NULL);
+    if (Pipe == INVALID_HANDLE_VALUE)
+        goto fail1;
 
-    CloseHandle(Overlapped.hEvent);
+    if (!LoopAssociate(Pipe))
+        goto fail2;
 
-    Log("<==== %s", Console->DeviceName);
+    Listener->Pipe = Pipe;
+    ++Console->Outstanding;
 
-    return 0;
+    if (!ConnectNamedPipe(Pipe,
+                          __OperationOverlapped(&Listener->Operation))) {
+        Error = GetLastError();
+
+        // A client that got in first does not generate a completion
+        if (Error == ERROR_PIPE_CONNECTED) {
+            if (!LoopPost(&MonitorContext.Loop, &Listener->Operation))
+                goto fail3;
+        } else if (Error != ERROR_IO_PENDING) {
+            goto fail3;
+        }
+    }
+
+    return;
+
+fail3:
+    Log("fail3");
+
+    --Console->Outstanding;
+    Listener->Pipe = NULL;
 
 fail2:
-    Log("fail2\n");
+    Log("fail2");
 
-    CloseHandle(Overlapped.hEvent);
+    CloseHandle(Pipe);
 
 fail1:
     Error = GetLastError();
@@ -641,8 +1897,64 @@ fail1:
         Log("fail1 (%s)", Message);
         LocalFree(Message);
     }
+}
+
+static VOID
+ConsoleListenComplete(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    PMONITOR_CONSOLE        Console = Operation->Argument;
+    PMONITOR_LISTENER       Listener;
+    HANDLE                  Pipe;
+
+    UNREFERENCED_PARAMETER(Length);
+
+    Listener = CONTAINING_RECORD(Operation, MONITOR_LISTENER, Operation);
+
+    Pipe = Listener->Pipe;
+    Listener->Pipe = NULL;
+
+    if (Error != ERROR_SUCCESS ||
+        Console->Stopping ||
+        !ConnectionCreate(Console, Pipe, Listener->History))
+        CloseHandle(Pipe);
+
+    if (!Console->Stopping)
+        ConsoleListen(Console, Listener);
+
+    --Console->Outstanding;
+    __ConsoleCheckStopped(Console);
+}
+
+static DWORD
+GetParameter(
+    IN  PCHAR           Name,
+    IN  DWORD           Default
+    )
+{
+    PMONITOR_CONTEXT    Context = &MonitorContext;
+    DWORD               Value;
+    DWORD               Length;
+    DWORD               Type;
+    HRESULT             Error;
 
-    return 1;
+    Length = sizeof(Value);
+
+    Error = RegQueryValueExA(Context->ParametersKey,
+                             Name,
+                             NULL,
+                             &Type,
+                             (LPBYTE)&Value,
+                             &Length);
+    if (Error != ERROR_SUCCESS || Type != REG_DWORD)
+        Value = Default;
+
+    Log("%s = %u", Name, Value);
+
+    return Value;
 }
 
 static BOOL
@@ -742,39 +2054,42 @@ fail1:
     return FALSE;
 }
 
-DWORD WINAPI
-ExecutableThread(
-    IN  LPVOID          Argument
+// Runs on a thread pool wait thread, so just hand over to the loop
+static VOID CALLBACK
+ConsoleExecutableCallback(
+    IN  PVOID           Argument,
+    IN  BOOLEAN         TimedOut
     )
 {
-    PMONITOR_CONSOLE    Console = (PMONITOR_CONSOLE)Argument;
-    PCHAR               Executable;
-    PROCESS_INFORMATION ProcessInfo;
-    STARTUPINFO         StartupInfo;
-    BOOL                Success;
-    HANDLE              Handle[2];
-    DWORD               Object;
-    HRESULT             Error;
+    PMONITOR_CONSOLE    Console = Argument;
 
-    Log("====> %s", Console->DeviceName);
+    UNREFERENCED_PARAMETER(TimedOut);
 
-    // If there is no executable, this thread can finish now.
-    if (!GetExecutable(Console->DeviceName,
-                       &Executable))
-        goto done;
-    if (Executable == NULL)
-        goto done;
+    if (InterlockedExchange(&Console->ExecutableFired, 1) == 0)
+        (VOID) LoopPost(&MonitorContext.Loop, &Console->Exit);
+}
+
+static VOID
+ConsoleExecute(
+    IN  PMONITOR_CONSOLE    Console
+    )
+{
+    STARTUPINFO             StartupInfo;
+    BOOL                    Success;
+    HRESULT                 Error;
 
-again:
-    ZeroMemory(&ProcessInfo, sizeof (ProcessInfo));
+    if (Console->Executable == NULL)
+        return;
+
+    ZeroMemory(&Console->ProcessInfo, sizeof (PROCESS_INFORMATION));
     ZeroMemory(&StartupInfo, sizeof (StartupInfo));
     StartupInfo.cb = sizeof (StartupInfo);
 
-    Log("Executing: %s", Executable);
+    Log("Executing: %s", Console->Executable);
 
 #pragma warning(suppress:6053) // CommandLine might not be NUL-terminated
     Success = CreateProcess(NULL,
-                            Executable,
+                            Console->Executable,
                             NULL,
                             NULL,
                             FALSE,
@@ -783,60 +2098,158 @@ again:
                             NULL,
                             NULL,
                             &StartupInfo,
-                            &ProcessInfo);
+                            &Console->ProcessInfo);
     if (!Success)
         goto fail1;
 
-    Handle[0] = Console->ExecutableEvent;
-    Handle[1] = ProcessInfo.hProcess;
-
-    Object = WaitForMultipleObjects(ARRAYSIZE(Handle),
-                                    Handle,
-                                    FALSE,
-                                    INFINITE);
-
-#define WAIT_OBJECT_1 (WAIT_OBJECT_0 + 1)
+    Console->ExecutableFired = 0;
 
-    switch (Object) {
-    case WAIT_OBJECT_0:
-        ResetEvent(Console->ExecutableEvent);
-
-        TerminateProcess(ProcessInfo.hProcess, 1);
-        CloseHandle(ProcessInfo.hProcess);
-        CloseHandle(ProcessInfo.hThread);
-        break;
-
-    case WAIT_OBJECT_1:
-        CloseHandle(ProcessInfo.hProcess);
-        CloseHandle(ProcessInfo.hThread);
-        goto again;
-
-    default:
-        break;
-    }
+    Success = RegisterWaitForSingleObject(&Console->ExecutableWait,
+                                          Console->ProcessInfo.hProcess,
+                                          ConsoleExecutableCallback,
+                                          Console,
+                                          INFINITE,
+                                          WT_EXECUTEONLYONCE);
+    if (!Success)
+        goto fail2;
 
-//#undef WAIT_OBJECT_1
+    ++Console->Outstanding;
 
-    free(Executable);
+    return;
 
-done:
-    Log("<==== %s", Console->DeviceName);
+fail2:
+    Log("fail2");
 
-    return 0;
+    TerminateProcess(Console->ProcessInfo.hProcess, 1);
+    CloseHandle(Console->ProcessInfo.hProcess);
+    CloseHandle(Console->ProcessInfo.hThread);
 
 fail1:
     Error = GetLastError();
 
-    free(Executable);
-
     {
         PTCHAR  Message;
         Message = GetErrorMessage(Error);
         Log("fail1 (%s)", Message);
         LocalFree(Message);
     }
+}
+
+static VOID
+ConsoleExitComplete(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    PMONITOR_CONSOLE        Console = Operation->Argument;
+
+    UNREFERENCED_PARAMETER(Error);
+    UNREFERENCED_PARAMETER(Length);
+
+    // Stopping may already have unregistered the wait
+    if (Console->ExecutableWait != NULL) {
+        (VOID) UnregisterWait(Console->ExecutableWait);
+        Console->ExecutableWait = NULL;
+    }
 
-    return 1;
+    CloseHandle(Console->ProcessInfo.hProcess);
+    CloseHandle(Console->ProcessInfo.hThread);
+
+    if (!Console->Stopping)
+        ConsoleExecute(Console);
+
+    --Console->Outstanding;
+    __ConsoleCheckStopped(Console);
+}
+
+static VOID
+ConsoleStartComplete(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    PMONITOR_CONTEXT        Context = &MonitorContext;
+    PMONITOR_CONSOLE        Console = Operation->Argument;
+    DWORD                   Index;
+
+    UNREFERENCED_PARAMETER(Error);
+    UNREFERENCED_PARAMETER(Length);
+
+    Log("%s", Console->Listener.PipeName);
+
+    for (Index = 0; Index < Context->ReadCount; Index++) {
+        if (!ConsoleRead(Console, &Console->Reads[Index])) {
+            Console->ReadFailed = TRUE;
+            break;
+        }
+    }
+
+    ConsoleListen(Console, &Console->Listener);
+    ConsoleListen(Console, &Console->HistoryListener);
+    ConsoleExecute(Console);
+}
+
+static VOID
+ConsoleStopComplete(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    PMONITOR_CONSOLE        Console = Operation->Argument;
+    PLIST_ENTRY             ListEntry;
+    PLIST_ENTRY             Next;
+
+    UNREFERENCED_PARAMETER(Error);
+    UNREFERENCED_PARAMETER(Length);
+
+    // Hold on to the console until everything has been cancelled
+    ++Console->Outstanding;
+    Console->Stopping = TRUE;
+
+    LoopTimerCancel(&Console->WriteTimer);
+
+    (VOID) CancelIoEx(Console->Device, NULL);
+
+    if (Console->Listener.Pipe != NULL)
+        (VOID) CancelIoEx(Console->Listener.Pipe, NULL);
+
+    if (Console->HistoryListener.Pipe != NULL)
+        (VOID) CancelIoEx(Console->HistoryListener.Pipe, NULL);
+
+    for (ListEntry = Console->ListHead.Flink;
+         ListEntry != &Console->ListHead;
+         ListEntry = Next) {
+        PMONITOR_CONNECTION Connection;
+
+        Next = ListEntry->Flink;
+
+        Connection = CONTAINING_RECORD(ListEntry,
+                                       MONITOR_CONNECTION,
+                                       ListEntry);
+
+        ConnectionClose(Connection);
+    }
+
+    if (Console->ExecutableWait != NULL) {
+        (VOID) UnregisterWaitEx(Console->ExecutableWait,
+                                INVALID_HANDLE_VALUE);
+        Console->ExecutableWait = NULL;
+
+        TerminateProcess(Console->ProcessInfo.hProcess, 1);
+
+        // If the wait never fired then no completion is coming
+        if (InterlockedExchange(&Console->ExecutableFired, 1) == 0) {
+            CloseHandle(Console->ProcessInfo.hProcess);
+            CloseHandle(Console->ProcessInfo.hThread);
+            --Console->Outstanding;
+        }
+    }
+
+    --Console->Outstanding;
+    __ConsoleCheckStopped(Console);
 }
 
 static PMONITOR_CONSOLE
@@ -849,6 +2262,7 @@ ConsoleCreate(
     DEV_BROADCAST_HANDLE    Handle;
     CHAR                    DeviceName[MAX_PATH];
     DWORD                   Bytes;
+    DWORD                   Index;
     BOOL                    Success;
     HRESULT                 Error;
 
@@ -861,7 +2275,8 @@ ConsoleCreate(
     memset(Console, 0, sizeof(MONITOR_CONSOLE));
     __InitializeListHead(&Console->ListHead);
     __InitializeListHead(&Console->ListEntry);
-    InitializeCriticalSection(&Console->CriticalSection);
+
+    Console->DirectThreshold = Context->DirectThreshold;
 
     Console->DevicePath = _wcsdup(DevicePath);
     if (Console->DevicePath == NULL)
@@ -908,87 +2323,156 @@ ConsoleCreate(
     if (Console->DeviceNotification == NULL)
         goto fail6;
 
-    Console->DeviceEvent = CreateEvent(NULL,
-                                       TRUE,
-                                       FALSE,
-                                       NULL);
-    if (Console->DeviceEvent == NULL)
+    // All I/O on behalf of clients is overlapped and completes on the
+    // loop thread
+    Console->Device = CreateFileW(DevicePath,
+                                  GENERIC_READ | GENERIC_WRITE,
+                                  FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                  NULL,
+                                  OPEN_EXISTING,
+                                  FILE_FLAG_OVERLAPPED,
+                                  NULL);
+    if (Console->Device == INVALID_HANDLE_VALUE)
         goto fail7;
 
-    Console->DeviceThread = CreateThread(NULL,
-                                         0,
-                                         DeviceThread,
-                                         Console,
-                                         0,
-                                         NULL);
-    if (Console->DeviceThread == NULL)
+    if (!LoopAssociate(Console->Device))
         goto fail8;
 
-    Console->ServerEvent = CreateEvent(NULL,
-                                       TRUE,
-                                       FALSE,
-                                       NULL);
-    if (Console->ServerEvent == NULL)
+    Error = StringCchPrintfA(Console->Listener.PipeName,
+                             MAX_PATH,
+                             "%s%s",
+                             PIPE_BASE_NAME,
+                             Console->DeviceName);
+    if (Error != S_OK && Error != STRSAFE_E_INSUFFICIENT_BUFFER)
+        goto fail9;
+
+    Error = StringCchPrintfA(Console->HistoryListener.PipeName,
+                             MAX_PATH,
+                             "%s%s%s",
+                             PIPE_BASE_NAME,
+                             Console->DeviceName,
+                             HISTORY_PIPE_SUFFIX);
+    if (Error != S_OK && Error != STRSAFE_E_INSUFFICIENT_BUFFER)
         goto fail9;
 
-    Console->ServerThread = CreateThread(NULL,
-                                         0,
-                                         ServerThread,
-                                         Console,
-                                         0,
-                                         NULL);
-    if (Console->ServerThread == NULL)
+    Console->StoppedEvent = CreateEvent(NULL,
+                                        TRUE,
+                                        FALSE,
+                                        NULL);
+    if (Console->StoppedEvent == NULL)
         goto fail10;
 
-    Console->ExecutableEvent = CreateEvent(NULL,
-                                           TRUE,
-                                           FALSE,
-                                           NULL);
-    if (Console->ExecutableEvent == NULL)
+    Console->Reads = calloc(Context->ReadCount, sizeof(MONITOR_READ));
+    if (Console->Reads == NULL)
         goto fail11;
 
-    Console->ExecutableThread = CreateThread(NULL,
-                                             0,
-                                             ExecutableThread,
-                                             Console,
-                                             0,
-                                             NULL);
-    if (Console->ExecutableThread == NULL)
+    Console->WriteBuffer[0] = malloc(Context->WriteSize);
+    if (Console->WriteBuffer[0] == NULL)
         goto fail12;
 
+    Console->WriteBuffer[1] = malloc(Context->WriteSize);
+    if (Console->WriteBuffer[1] == NULL)
+        goto fail13;
+
+    if (!HistoryInitialize(&Console->History))
+        goto fail14;
+
+    __InitializeListHead(&Console->InputList);
+
+    // Keep enough buffers for the reads and a burst of output
+    PoolInitialize(&Console->Pool,
+                   Context->ReadSize,
+                   Context->ReadCount * 2);
+
+    // If there is no executable, nothing gets run
+    if (!GetExecutable(Console->DeviceName,
+                       &Console->Executable))
+        Console->Executable = NULL;
+
+    __OperationInitialize(&Console->Start,
+                          ConsoleStartComplete,
+                          Console);
+    __OperationInitialize(&Console->Stop,
+                          ConsoleStopComplete,
+                          Console);
+    for (Index = 0; Index < Context->ReadCount; Index++)
+        __OperationInitialize(&Console->Reads[Index].Operation,
+                              ConsoleReadComplete,
+                              Console);
+    __OperationInitialize(&Console->Write,
+                          ConsoleWriteComplete,
+                          Console);
+    __OperationInitialize(&Console->WriteTimer.Operation,
+                          ConsoleWriteTimerComplete,
+                          Console);
+    __InitializeListHead(&Console->WriteTimer.ListEntry);
+    __OperationInitialize(&Console->Listener.Operation,
+                          ConsoleListenComplete,
+                          Console);
+    __OperationInitialize(&Console->HistoryListener.Operation,
+                          ConsoleListenComplete,
+                          Console);
+    Console->HistoryListener.History = TRUE;
+    __OperationInitialize(&Console->Exit,
+                          ConsoleExitComplete,
+                          Console);
+
+    // The loop starts the device reads, the pipe server and the
+    // executable
+    if (!LoopPost(&Context->Loop, &Console->Start))
+        goto fail15;
+
     Log("<==== %s", Console->DeviceName);
 
     return Console;
 
+fail15:
+    Log("fail15");
+
+    free(Console->Executable);
+    Console->Executable = NULL;
+
+    PoolTeardown(&Console->Pool);
+
+    ZeroMemory(&Console->InputList, sizeof(LIST_ENTRY));
+
+    HistoryTeardown(&Console->History);
+
+fail14:
+    Log("fail14");
+
+    free(Console->WriteBuffer[1]);
+    Console->WriteBuffer[1] = NULL;
+
+fail13:
+    Log("fail13");
+
+    free(Console->WriteBuffer[0]);
+    Console->WriteBuffer[0] = NULL;
+
 fail12:
     Log("fail12");
 
-    CloseHandle(Console->ExecutableEvent);
-    Console->ExecutableEvent = NULL;
+    free(Console->Reads);
+    Console->Reads = NULL;
 
 fail11:
     Log("fail11");
 
-    SetEvent(Console->ServerEvent);
-    WaitForSingleObject(Console->ServerThread, INFINITE);
+    CloseHandle(Console->StoppedEvent);
+    Console->StoppedEvent = NULL;
 
 fail10:
     Log("fail10");
 
-    CloseHandle(Console->ServerEvent);
-    Console->ServerEvent = NULL;
-
 fail9:
     Log("fail9");
 
-    SetEvent(Console->DeviceEvent);
-    WaitForSingleObject(Console->DeviceThread, INFINITE);
-
 fail8:
     Log("fail8");
 
-    CloseHandle(Console->DeviceEvent);
-    Console->DeviceEvent = NULL;
+    CloseHandle(Console->Device);
+    Console->Device = INVALID_HANDLE_VALUE;
 
 fail7:
     Log("fail7");
@@ -1022,7 +2506,6 @@ fail3:
 fail2:
     Log("fail2");
 
-    DeleteCriticalSection(&Console->CriticalSection);
     ZeroMemory(&Console->ListHead, sizeof(LIST_ENTRY));
     ZeroMemory(&Console->ListEntry, sizeof(LIST_ENTRY));
 
@@ -1041,52 +2524,35 @@ fail1:
     return NULL;
 }
 
-static FORCEINLINE VOID
-ConsoleWaitForPipes(
+static VOID
+ConsoleWriteStatistics(
     IN  PMONITOR_CONSOLE    Console
     )
 {
-    PLIST_ENTRY             ListEntry;
-    HANDLE                  *Events;
-    DWORD                   Count;
-    DWORD                   Index;
-
-    EnterCriticalSection(&Console->CriticalSection);
-
-    Count = Console->ListCount + 1;
-    Events = malloc(Count * sizeof(HANDLE));
-    if (Events == NULL)
-        goto fail1;
-
-    Index = 0;
-    for (ListEntry = Console->ListHead.Flink;
-         ListEntry != &Console->ListHead;
-         ListEntry = ListEntry->Flink) {
-        PMONITOR_CONNECTION Connection;
-
-        Connection = CONTAINING_RECORD(ListEntry,
-                                       MONITOR_CONNECTION,
-                                       ListEntry);
-
-#pragma warning(suppress: 6386) // Buffer overflow
-        Events[Index] = Connection->Thread;
-        ++Index;
+    DWORD                   Bucket;
+
+    Log("%s: %llu input messages in %llu writes (%llu bytes)",
+        Console->DeviceName,
+        Console->InputMessages,
+        Console->Writes,
+        Console->WriteBytes);
+
+    for (Bucket = 0; Bucket < WRITE_SIZE_BUCKETS; Bucket++) {
+        if (Console->WriteSizes[Bucket] == 0)
+            continue;
+
+        if (Bucket == WRITE_SIZE_BUCKETS - 1)
+            Log("%s: writes of %u bytes or more: %llu",
+                Console->DeviceName,
+                1u << Bucket,
+                Console->WriteSizes[Bucket]);
+        else
+            Log("%s: writes of %u-%u bytes: %llu",
+                Console->DeviceName,
+                1u << Bucket,
+                (2u << Bucket) - 1,
+                Console->WriteSizes[Bucket]);
     }
-    Events[Count - 1] = Console->ServerThread;
-
-    LeaveCriticalSection(&Console->CriticalSection);
-
-    SetEvent(Console->ServerEvent);
-    WaitForMultipleObjects(Count, Events, TRUE, INFINITE);
-
-    return;
-
-fail1:
-    LeaveCriticalSection(&Console->CriticalSection);
-
-    // set the event and wait for the server thread anyway
-    SetEvent(Console->ServerEvent);
-    WaitForSingleObject(Console->ServerThread, INFINITE);
 }
 
 static VOID
@@ -1096,22 +2562,40 @@ ConsoleDestroy(
 {
     Log("====> %s", Console->DeviceName);
 
-    SetEvent(Console->ExecutableEvent);
-    WaitForSingleObject(Console->ExecutableThread, INFINITE);
+    // Everything in flight belongs to the loop, so have it stop the
+    // console and wait for it to let go
+    (VOID) LoopPost(&MonitorContext.Loop, &Console->Stop);
+    WaitForSingleObject(Console->StoppedEvent, INFINITE);
+
+    assert(Console->Outstanding == 0);
+    assert(Console->ListCount == 0);
+
+    ConsoleWriteStatistics(Console);
+
+    CloseHandle(Console->StoppedEvent);
+    Console->StoppedEvent = NULL;
 
-    CloseHandle(Console->ExecutableEvent);
-    Console->ExecutableEvent = NULL;
+    free(Console->Executable);
+    Console->Executable = NULL;
 
-    ConsoleWaitForPipes(Console);
+    PoolTeardown(&Console->Pool);
 
-    CloseHandle(Console->ServerEvent);
-    Console->ServerEvent = NULL;
+    assert(__IsListEmpty(&Console->InputList));
+    ZeroMemory(&Console->InputList, sizeof(LIST_ENTRY));
 
-    SetEvent(Console->DeviceEvent);
-    WaitForSingleObject(Console->DeviceThread, INFINITE);
+    HistoryTeardown(&Console->History);
 
-    CloseHandle(Console->DeviceEvent);
-    Console->DeviceEvent = NULL;
+    free(Console->WriteBuffer[1]);
+    Console->WriteBuffer[1] = NULL;
+
+    free(Console->WriteBuffer[0]);
+    Console->WriteBuffer[0] = NULL;
+
+    free(Console->Reads);
+    Console->Reads = NULL;
+
+    CloseHandle(Console->Device);
+    Console->Device = INVALID_HANDLE_VALUE;
 
     UnregisterDeviceNotification(Console->DeviceNotification);
     Console->DeviceNotification = NULL;
@@ -1127,7 +2611,6 @@ ConsoleDestroy(
     free(Console->DevicePath);
     Console->DevicePath = NULL;
 
-    DeleteCriticalSection(&Console->CriticalSection);
     ZeroMemory(&Console->ListHead, sizeof(LIST_ENTRY));
     ZeroMemory(&Console->ListEntry, sizeof(LIST_ENTRY));
 
@@ -1430,6 +2913,57 @@ MonitorMain(
     if (Error != ERROR_SUCCESS)
         goto fail1;
 
+    // A threshold of 0 disables direct I/O
+    Context->DirectThreshold = GetParameter("DirectIoThreshold",
+                                            DIRECT_IO_THRESHOLD);
+
+    // One buffer may be being written while the rest are queued
+    Context->QueueDepth = GetParameter("OutputQueueDepth",
+                                       OUTPUT_QUEUE_DEPTH);
+    if (Context->QueueDepth < 2)
+        Context->QueueDepth = 2;
+
+    Context->LaggingPolicy = GetParameter("LaggingClientPolicy",
+                                          MONITOR_LAGGING_DROP);
+    if (Context->LaggingPolicy >= MONITOR_LAGGING_POLICY_COUNT)
+        Context->LaggingPolicy = MONITOR_LAGGING_DROP;
+
+    Context->ReadCount = GetParameter("DeviceReadCount",
+                                      DEVICE_READ_COUNT);
+    if (Context->ReadCount == 0)
+        Context->ReadCount = 1;
+    else if (Context->ReadCount > DEVICE_READ_MAXIMUM)
+        Context->ReadCount = DEVICE_READ_MAXIMUM;
+
+    Context->ReadSize = GetParameter("DeviceReadSize",
+                                     DEVICE_READ_SIZE);
+    if (Context->ReadSize < MAXIMUM_BUFFER_SIZE)
+        Context->ReadSize = MAXIMUM_BUFFER_SIZE;
+    else if (Context->ReadSize > DEVICE_READ_SIZE_MAXIMUM)
+        Context->ReadSize = DEVICE_READ_SIZE_MAXIMUM;
+
+    Context->WriteSize = GetParameter("DeviceWriteSize",
+                                      DEVICE_WRITE_SIZE);
+    if (Context->WriteSize < MAXIMUM_BUFFER_SIZE)
+        Context->WriteSize = MAXIMUM_BUFFER_SIZE;
+    else if (Context->WriteSize > DEVICE_WRITE_SIZE_MAXIMUM)
+        Context->WriteSize = DEVICE_WRITE_SIZE_MAXIMUM;
+
+    // A size of 0 disables the history, but not the history pipe
+    Context->HistorySize = GetParameter("HistorySize",
+                                        HISTORY_SIZE);
+    if (Context->HistorySize != 0 &&
+        Context->HistorySize < HISTORY_CHUNK_SIZE)
+        Context->HistorySize = HISTORY_CHUNK_SIZE;
+    else if (Context->HistorySize > HISTORY_SIZE_MAXIMUM)
+        Context->HistorySize = HISTORY_SIZE_MAXIMUM;
+
+    // A window of 0 only gathers input while a write is in progress
+    Context->WriteWindow = GetParameter("DeviceWriteWindow",
+                                        DEVICE_WRITE_WINDOW);
+    if (Context->WriteWindow > DEVICE_WRITE_WINDOW_MAXIMUM)
+        Context->WriteWindow = DEVICE_WRITE_WINDOW_MAXIMUM;
+
     Context->Service = RegisterServiceCtrlHandlerExA(MONITOR_NAME,
                                                     MonitorCtrlHandlerEx,
                                                     NULL);
@@ -1454,6 +2988,25 @@ MonitorMain(
     if (Context->StopEvent == NULL)
         goto fail4;
 
+    // A single thread services the I/O for every console and client
+    Context->Port = CreateIoCompletionPort(INVALID_HANDLE_VALUE,
+                                           NULL,
+                                           0,
+                                           1);
+    if (Context->Port == NULL)
+        goto fail5;
+
+    LoopInitialize(&Context->Loop, &PortBackend, Context->Port);
+
+    Context->LoopThread = CreateThread(NULL,
+                                       0,
+                                       LoopThread,
+                                       NULL,
+                                       0,
+                                       NULL);
+    if (Context->LoopThread == NULL)
+        goto fail6;
+
     ZeroMemory(&Interface, sizeof (Interface));
     Interface.dbcc_size = sizeof (Interface);
     Interface.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
@@ -1464,7 +3017,7 @@ MonitorMain(
                                    &Interface,
                                    DEVICE_NOTIFY_SERVICE_HANDLE);
     if (Context->InterfaceNotification == NULL)
-        goto fail5;
+        goto fail7;
 
     ReportStatus(SERVICE_RUNNING, NO_ERROR, 0);
 
@@ -1484,6 +3037,14 @@ MonitorMain(
 
     UnregisterDeviceNotification(Context->InterfaceNotification);
 
+    PostQueuedCompletionStatus(Context->Port, 0, 0, NULL);
+    WaitForSingleObject(Context->LoopThread, INFINITE);
+    CloseHandle(Context->LoopThread);
+
+    LoopTeardown(&Context->Loop);
+
+    CloseHandle(Context->Port);
+
     CloseHandle(Context->StopEvent);
 
     ReportStatus(SERVICE_STOPPED, NO_ERROR, 0);
@@ -1496,6 +3057,20 @@ MonitorMain(
 
     return;
 
+fail7:
+    Log("fail7");
+
+    PostQueuedCompletionStatus(Context->Port, 0, 0, NULL);
+    WaitForSingleObject(Context->LoopThread, INFINITE);
+    CloseHandle(Context->LoopThread);
+
+fail6:
+    Log("fail6");
+
+    LoopTeardown(&Context->Loop);
+
+    CloseHandle(Context->Port);
+
 fail5:
     Log("fail5");
 
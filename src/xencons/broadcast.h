@@ -0,0 +1,147 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENCONS_BROADCAST_H
+#define _XENCONS_BROADCAST_H
+
+// A broadcast buffer holds the most recent Size bytes of console input
+// for any number of subscribers, each reading at its own cursor. The
+// producer never waits for a subscriber: one that falls more than Size
+// bytes behind is lapped and skips to the oldest byte still held.
+//
+// Like spsc.h this has no dependency on the rest of the driver so that
+// it can also be built as plain C outside the kernel. Locking is left
+// to the caller.
+
+#include "spsc.h"
+
+typedef struct _XENCONS_BROADCAST {
+    ULONG   References;
+    ULONG   Size;
+    ULONG   Prod;
+    PCHAR   Data;
+} XENCONS_BROADCAST, *PXENCONS_BROADCAST;
+
+// Called with each piece of input as it is copied in, for a consumer
+// that is not subscribed. It takes what it can: the fill never waits
+// for it.
+typedef void
+(*XENCONS_BROADCAST_PUBLISH)(
+    IN  void    *Argument,
+    IN  PCHAR   Data,
+    IN  ULONG   Length
+    );
+
+// Moves everything In holds into the broadcast buffer, overwriting
+// whatever the slowest subscribers have yet to read. Publish may be
+// NULL. Returns the number of bytes taken from In.
+static FORCEINLINE ULONG
+BroadcastFill(
+    IN  PXENCONS_BROADCAST          Broadcast,
+    IN  PXENCONS_SPSC               In,
+    IN  XENCONS_BROADCAST_PUBLISH   Publish,
+    IN  void                        *Argument
+    )
+{
+    ULONG                           Total;
+
+    Total = 0;
+
+    for (;;) {
+        ULONG   Index;
+        ULONG   Read;
+
+        Index = Broadcast->Prod & (Broadcast->Size - 1);
+
+        Read = SpscRead(In,
+                        &Broadcast->Data[Index],
+                        Broadcast->Size - Index);
+        if (Read == 0)
+            break;
+
+        Broadcast->Prod += Read;
+        Total += Read;
+
+        if (Publish != NULL)
+            Publish(Argument, &Broadcast->Data[Index], Read);
+    }
+
+    return Total;
+}
+
+// Copies up to Length bytes from *Cursor onwards and advances it. Any
+// input the subscriber was lapped on is added to *Dropped.
+static FORCEINLINE ULONG
+BroadcastGet(
+    IN      PXENCONS_BROADCAST  Broadcast,
+    IN OUT  PULONG              Cursor,
+    IN OUT  PULONG              Dropped,
+    IN      PCHAR               Data,
+    IN      ULONG               Length
+    )
+{
+    ULONG                       Available;
+    ULONG                       Offset;
+
+    Available = Broadcast->Prod - *Cursor;
+    if (Available > Broadcast->Size) {
+        *Cursor += Available - Broadcast->Size;
+        *Dropped += Available - Broadcast->Size;
+
+        Available = Broadcast->Size;
+    }
+
+    if (Length > Available)
+        Length = Available;
+
+    Offset = 0;
+    while (Length != 0) {
+        ULONG   Index;
+        ULONG   CopyLength;
+
+        Index = *Cursor & (Broadcast->Size - 1);
+
+        CopyLength = Broadcast->Size - Index;
+        if (CopyLength > Length)
+            CopyLength = Length;
+
+        RtlCopyMemory(Data + Offset, &Broadcast->Data[Index], CopyLength);
+
+        Offset += CopyLength;
+        Length -= CopyLength;
+
+        *Cursor += CopyLength;
+    }
+
+    return Offset;
+}
+
+#endif  // _XENCONS_BROADCAST_H
@@ -41,12 +41,18 @@
 #include "driver.h"
 #include "console.h"
 #include "stream.h"
+#include "thread.h"
+#include "mutex.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
 
 #define CONSOLE_POOL 'SNOC'
 
+// Per-open state, hung off FileObject->FsContext. Each handle has its
+// own stream and hence its own queue of IRPs. FsContext is only set or
+// cleared with Mutex held, and a handle that has been cleaned up is
+// parked in FsContext2 until IRP_MJ_CLOSE.
 typedef struct _CONSOLE_HANDLE {
     LIST_ENTRY      ListEntry;
     PFILE_OBJECT    FileObject;
@@ -54,10 +60,13 @@ typedef struct _CONSOLE_HANDLE {
 } CONSOLE_HANDLE, *PCONSOLE_HANDLE;
 
 typedef struct _XENCONS_CONSOLE {
-    LONG            References;
-    PXENCONS_FDO    Fdo;
-    LIST_ENTRY      List;
-    KSPIN_LOCK      Lock;
+    LONG                        References;
+    PXENCONS_FDO                Fdo;
+    LIST_ENTRY                  List;
+    MUTEX                       Mutex;
+    KSPIN_LOCK                  Lock;
+    PXENCONS_THREAD             Thread;
+    XENBUS_CONSOLE_INTERFACE    ConsoleInterface;
 } XENCONS_CONSOLE, *PXENCONS_CONSOLE;
 
 static FORCEINLINE PVOID
@@ -91,7 +100,9 @@ __ConsoleCreateHandle(
     if (*Handle == NULL)
         goto fail1;
 
-    status = StreamCreate(Console->Fdo, &(*Handle)->Stream);
+    status = StreamCreate(Console->Fdo,
+                          Console->Thread,
+                          &(*Handle)->Stream);
     if (!NT_SUCCESS(status))
         goto fail2;
 
@@ -124,50 +135,33 @@ __ConsoleDestroyHandle(
     StreamDestroy(Handle->Stream);
     Handle->Stream = NULL;
 
+    ASSERT3P(Handle->FileObject->FsContext, ==, NULL);
+    ASSERT3P(Handle->FileObject->FsContext2, ==, NULL);
+
     Handle->FileObject = NULL;
 
     ASSERT(IsZeroMemory(Handle, sizeof(CONSOLE_HANDLE)));
     __ConsoleFree(Handle);
 }
 
-static PCONSOLE_HANDLE
+// Must be called with Mutex held. A handle taken off the list by
+// ConsoleD0ToD3() is no longer found.
+static FORCEINLINE PCONSOLE_HANDLE
 __ConsoleFindHandle(
     IN  PXENCONS_CONSOLE    Console,
     IN  PFILE_OBJECT        FileObject
     )
 {
-    KIRQL                   Irql;
-    PLIST_ENTRY             ListEntry;
     PCONSOLE_HANDLE         Handle;
-    NTSTATUS                status;
-
-    KeAcquireSpinLock(&Console->Lock, &Irql);
 
-    for (ListEntry = Console->List.Flink;
-         ListEntry != &Console->List;
-         ListEntry = ListEntry->Flink) {
-        Handle = CONTAINING_RECORD(ListEntry,
-                                   CONSOLE_HANDLE,
-                                   ListEntry);
-
-        if (Handle->FileObject == FileObject)
-            goto found;
-    }
-
-    status = STATUS_UNSUCCESSFUL;
-    goto fail1;
+    UNREFERENCED_PARAMETER(Console);
 
-found:
-    KeReleaseSpinLock(&Console->Lock, Irql);
+    Handle = FileObject->FsContext;
+    if (Handle == NULL)
+        return NULL;
 
+    ASSERT3P(Handle->FileObject, ==, FileObject);
     return Handle;
-
-fail1:
-    Error("fail1 (%08x)\n", status);
-
-    KeReleaseSpinLock(&Console->Lock, Irql);
-
-    return NULL;
 }
 
 static NTSTATUS
@@ -177,57 +171,99 @@ ConsoleOpen(
     )
 {
     PCONSOLE_HANDLE         Handle;
-    KIRQL                   Irql;
     NTSTATUS                status;
 
+    // The list is walked by the dispatcher thread and at D0->D3. The
+    // stream is bound to the dispatcher as it stands now, so there
+    // must be one: without it nothing would ever service the handle.
+    AcquireMutex(&Console->Mutex);
+
+    status = STATUS_DEVICE_NOT_READY;
+    if (Console->Thread == NULL)
+        goto fail1;
+
     status = __ConsoleCreateHandle(Console, FileObject, &Handle);
     if (!NT_SUCCESS(status))
-        goto fail1;
+        goto fail2;
+
+    ASSERT3P(FileObject->FsContext, ==, NULL);
+    FileObject->FsContext = Handle;
 
-    KeAcquireSpinLock(&Console->Lock, &Irql);
     InsertTailList(&Console->List, &Handle->ListEntry);
-    KeReleaseSpinLock(&Console->Lock, Irql);
+
+    ReleaseMutex(&Console->Mutex);
 
     Trace("%p\n", Handle->FileObject);
 
     return STATUS_SUCCESS;
 
+fail2:
+    Error("fail2\n");
+
 fail1:
     Error("fail1 (%08x)\n", status);
 
+    ReleaseMutex(&Console->Mutex);
+
     return status;
 }
 
+// Requests already dispatched on FileObject may still be in flight, so
+// the handle is only taken off the list and its queues cancelled here.
+// Anything that looks it up afterwards, with Mutex held, finds nothing.
 static NTSTATUS
-ConsoleClose(
+ConsoleCleanup(
     IN  PXENCONS_CONSOLE    Console,
     IN  PFILE_OBJECT        FileObject
     )
 {
     PCONSOLE_HANDLE         Handle;
-    KIRQL                   Irql;
-    NTSTATUS                status;
+
+    AcquireMutex(&Console->Mutex);
 
     Handle = __ConsoleFindHandle(Console, FileObject);
+    if (Handle != NULL) {
+        RemoveEntryList(&Handle->ListEntry);
+
+        FileObject->FsContext = NULL;
+        FileObject->FsContext2 = Handle;
+    }
 
-    status = STATUS_UNSUCCESSFUL;
+    ReleaseMutex(&Console->Mutex);
+
+    // ConsoleD0ToD3() has already destroyed it
     if (Handle == NULL)
-        goto fail1;
+        return STATUS_SUCCESS;
 
     Trace("%p\n", Handle->FileObject);
 
-    KeAcquireSpinLock(&Console->Lock, &Irql);
-    RemoveEntryList(&Handle->ListEntry);
-    KeReleaseSpinLock(&Console->Lock, Irql);
-
-    __ConsoleDestroyHandle(Console, Handle);
+    StreamCancel(Handle->Stream);
 
     return STATUS_SUCCESS;
+}
 
-fail1:
-    Error("fail1 (%08x)\n", status);
+// No request can reference FileObject by now
+static NTSTATUS
+ConsoleClose(
+    IN  PXENCONS_CONSOLE    Console,
+    IN  PFILE_OBJECT        FileObject
+    )
+{
+    PCONSOLE_HANDLE         Handle;
 
-    return status;
+    ASSERT3P(FileObject->FsContext, ==, NULL);
+
+    Handle = FileObject->FsContext2;
+    if (Handle == NULL)
+        return STATUS_SUCCESS;
+
+    Trace("%p\n", Handle->FileObject);
+
+    FileObject->FsContext2 = NULL;
+
+    __ConsoleDestroyHandle(Console, Handle);
+
+    return STATUS_SUCCESS;
 }
 
 static FORCEINLINE NTSTATUS
@@ -242,9 +278,13 @@ __ConsoleReadWrite(
 
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
 
+    // Mutex is held until the IRP is queued so the handle can neither
+    // be cleaned up nor destroyed by ConsoleD0ToD3() in the meantime
+    AcquireMutex(&Console->Mutex);
+
     Handle = __ConsoleFindHandle(Console, StackLocation->FileObject);
 
-    status = STATUS_UNSUCCESSFUL;
+    status = STATUS_FILE_CLOSED;
     if (Handle == NULL)
         goto fail1;
 
@@ -252,6 +292,8 @@ __ConsoleReadWrite(
     if (!NT_SUCCESS(status))
         goto fail2;
 
+    ReleaseMutex(&Console->Mutex);
+
     return STATUS_PENDING;
 
 fail2:
@@ -260,6 +302,8 @@ fail2:
 fail1:
     Error("fail1 (%08x)\n", status);
 
+    ReleaseMutex(&Console->Mutex);
+
     return status;
 }
 
@@ -360,6 +404,12 @@ ConsolePutQueue(
         status = __ConsoleDeviceControl(Console, Irp);
         break;
 
+    case IRP_MJ_FLUSH_BUFFERS:
+        // The XENBUS_CONSOLE interface does not say when the backend
+        // has consumed what was written
+        status = STATUS_NOT_SUPPORTED;
+        break;
+
     default:
         ASSERT(FALSE);
         status = STATUS_NOT_SUPPORTED;
@@ -369,18 +419,118 @@ ConsolePutQueue(
     return status;
 }
 
+// A single thread services the queues of every open handle, woken
+// either by the console interface or by a stream when an IRP is queued
+static NTSTATUS
+ConsoleWorker(
+    IN  PXENCONS_THREAD     Self,
+    IN  PVOID               Context
+    )
+{
+    PXENCONS_CONSOLE        Console = Context;
+    PKEVENT                 Event;
+    PXENBUS_CONSOLE_WAKEUP  Wakeup;
+    NTSTATUS                status;
+
+    Trace("====>\n");
+
+    Event = ThreadGetEvent(Self);
+
+    status = XENBUS_CONSOLE(Acquire,
+                            &Console->ConsoleInterface);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = XENBUS_CONSOLE(WakeupAdd,
+                            &Console->ConsoleInterface,
+                            Event,
+                            &Wakeup);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    for (;;) {
+        PLIST_ENTRY ListEntry;
+
+        (VOID) KeWaitForSingleObject(Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+        KeClearEvent(Event);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        AcquireMutex(&Console->Mutex);
+
+        for (ListEntry = Console->List.Flink;
+             ListEntry != &Console->List;
+             ListEntry = ListEntry->Flink) {
+            PCONSOLE_HANDLE Handle;
+
+            Handle = CONTAINING_RECORD(ListEntry,
+                                       CONSOLE_HANDLE,
+                                       ListEntry);
+
+            StreamPoll(Handle->Stream);
+        }
+
+        ReleaseMutex(&Console->Mutex);
+    }
+
+    XENBUS_CONSOLE(WakeupRemove,
+                   &Console->ConsoleInterface,
+                   Wakeup);
+
+    XENBUS_CONSOLE(Release, &Console->ConsoleInterface);
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    XENBUS_CONSOLE(Release, &Console->ConsoleInterface);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
 static NTSTATUS
 ConsoleD3ToD0(
     IN  PXENCONS_CONSOLE    Console
     )
-{ 
+{
+    PXENCONS_THREAD         Thread;
+    NTSTATUS                status;
+
     Trace("====>\n");
 
-    UNREFERENCED_PARAMETER(Console);
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    status = ThreadCreate(ConsoleWorker,
+                          Console,
+                          &Thread);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    // Opens can now be bound to the dispatcher
+    AcquireMutex(&Console->Mutex);
+    ASSERT3P(Console->Thread, ==, NULL);
+    Console->Thread = Thread;
+    ReleaseMutex(&Console->Mutex);
 
     Trace("<====\n");
 
     return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
 }
 
 static VOID
@@ -388,16 +538,36 @@ ConsoleD0ToD3(
     IN  PXENCONS_CONSOLE    Console
     )
 {
-    KIRQL                   Irql;
+    PXENCONS_THREAD         Thread;
     LIST_ENTRY              List;
     PLIST_ENTRY             ListEntry;
     PCONSOLE_HANDLE         Handle;
 
     Trace("====>\n");
 
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
     InitializeListHead(&List);
 
-    KeAcquireSpinLock(&Console->Lock, &Irql);
+    // Once the dispatcher is gone no further opens are accepted, and
+    // the handles it was servicing are taken off its list. Clearing
+    // FsContext stops ConsoleCleanup() and ConsoleClose() from finding
+    // them again.
+    AcquireMutex(&Console->Mutex);
+
+    Thread = Console->Thread;
+    Console->Thread = NULL;
+
+    for (ListEntry = Console->List.Flink;
+         ListEntry != &Console->List;
+         ListEntry = ListEntry->Flink) {
+        Handle = CONTAINING_RECORD(ListEntry,
+                                   CONSOLE_HANDLE,
+                                   ListEntry);
+
+        ASSERT3P(Handle->FileObject->FsContext, ==, Handle);
+        Handle->FileObject->FsContext = NULL;
+    }
 
     ListEntry = Console->List.Flink;
     if (!IsListEmpty(&Console->List)) {
@@ -406,7 +576,7 @@ ConsoleD0ToD3(
         AppendTailList(&List, ListEntry);
     }
 
-    KeReleaseSpinLock(&Console->Lock, Irql);
+    ReleaseMutex(&Console->Mutex);
 
     while (!IsListEmpty(&List)) {
         ListEntry = RemoveHeadList(&List);
@@ -419,6 +589,10 @@ ConsoleD0ToD3(
         __ConsoleDestroyHandle(Console, Handle);
     }
 
+    // Only now that no stream can wake it
+    ThreadAlert(Thread);
+    ThreadJoin(Thread);
+
     Trace("<====\n");
 }
 
@@ -494,6 +668,17 @@ ConsoleAbiOpen(
     return ConsoleOpen(Console, FileObject);
 }
 
+static NTSTATUS
+ConsoleAbiCleanup(
+    IN  PXENCONS_CONSOLE_ABI_CONTEXT    Context,
+    IN  PFILE_OBJECT                    FileObject
+    )
+{
+    PXENCONS_CONSOLE                    Console = (PXENCONS_CONSOLE)Context;
+
+    return ConsoleCleanup(Console, FileObject);
+}
+
 static NTSTATUS
 ConsoleAbiClose(
     IN  PXENCONS_CONSOLE_ABI_CONTEXT    Context,
@@ -523,6 +708,7 @@ static XENCONS_CONSOLE_ABI ConsoleAbi = {
     ConsoleAbiD3ToD0,
     ConsoleAbiD0ToD3,
     ConsoleAbiOpen,
+    ConsoleAbiCleanup,
     ConsoleAbiClose,
     ConsoleAbiPutQueue
 };
@@ -545,8 +731,11 @@ ConsoleCreate(
         goto fail1;
 
     InitializeListHead(&Console->List);
+    InitializeMutex(&Console->Mutex);
     KeInitializeSpinLock(&Console->Lock);
 
+    FdoGetConsoleInterface(Fdo, &Console->ConsoleInterface);
+
     Console->Fdo = Fdo;
 
     *Context = (PVOID)Console;
@@ -581,11 +770,17 @@ ConsoleDestroy(
     
     Trace("====>\n");
 
+    ASSERT3P(Console->Thread, ==, NULL);
+
     ASSERT(IsListEmpty(&Console->List));
     RtlZeroMemory(&Console->List, sizeof(LIST_ENTRY));
 
+    RtlZeroMemory(&Console->Mutex, sizeof(MUTEX));
     RtlZeroMemory(&Console->Lock, sizeof(KSPIN_LOCK));
 
+    RtlZeroMemory(&Console->ConsoleInterface,
+                  sizeof(XENBUS_CONSOLE_INTERFACE));
+
     Console->Fdo = NULL;
 
     ASSERT(IsZeroMemory(Console, sizeof(XENCONS_CONSOLE)));
@@ -64,6 +64,12 @@ typedef NTSTATUS
     IN  PFILE_OBJECT                    FileObject
     );
 
+typedef NTSTATUS
+(*XENCONS_CONSOLE_ABI_CLEANUP)(
+    IN  PXENCONS_CONSOLE_ABI_CONTEXT    Context,
+    IN  PFILE_OBJECT                    FileObject
+    );
+
 typedef NTSTATUS
 (*XENCONS_CONSOLE_ABI_CLOSE)(
     IN  PXENCONS_CONSOLE_ABI_CONTEXT    Context,
@@ -83,6 +89,7 @@ typedef struct _XENCONS_CONSOLE_ABI {
     XENCONS_CONSOLE_ABI_D3TOD0              ConsoleAbiD3ToD0;
     XENCONS_CONSOLE_ABI_D0TOD3              ConsoleAbiD0ToD3;
     XENCONS_CONSOLE_ABI_OPEN                ConsoleAbiOpen;
+    XENCONS_CONSOLE_ABI_CLEANUP             ConsoleAbiCleanup;
     XENCONS_CONSOLE_ABI_CLOSE               ConsoleAbiClose;
     XENCONS_CONSOLE_ABI_PUT_QUEUE           ConsoleAbiPutQueue;
 } XENCONS_CONSOLE_ABI, *PXENCONS_CONSOLE_ABI;
@@ -38,6 +38,7 @@
 #include "fdo.h"
 #include "pdo.h"
 #include "driver.h"
+#include "select.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -135,6 +136,8 @@ DriverUnload(
 
     RegistryTeardown();
 
+    SelectTeardown();
+
     Info("XENCONS %d.%d.%d (%d) (%02d.%02d.%04d)\n",
          MAJOR_VERSION,
          MINOR_VERSION,
@@ -258,20 +261,24 @@ DriverEntry(
          MONTH,
          YEAR);
 
-    status = RegistryInitialize(RegistryPath);
+    status = SelectInitialize();
     if (!NT_SUCCESS(status))
         goto fail1;
 
-    status = RegistryOpenServiceKey(KEY_ALL_ACCESS, &ServiceKey);
+    status = RegistryInitialize(RegistryPath);
     if (!NT_SUCCESS(status))
         goto fail2;
 
+    status = RegistryOpenServiceKey(KEY_ALL_ACCESS, &ServiceKey);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
     status = RegistryOpenSubKey(ServiceKey,
                                 "Parameters",
                                 KEY_READ,
                                 &ParametersKey);
     if (!NT_SUCCESS(status))
-        goto fail3;
+        goto fail4;
 
     __DriverSetParametersKey(ParametersKey);
 
@@ -289,15 +296,20 @@ DriverEntry(
 
     return STATUS_SUCCESS;
 
+fail4:
+    Error("fail4\n");
+
+    RegistryCloseKey(ServiceKey);
+
 fail3:
     Error("fail3\n");
 
-    RegistryCloseKey(ServiceKey);
+    RegistryTeardown();
 
 fail2:
     Error("fail2\n");
 
-    RegistryTeardown();
+    SelectTeardown();
 
 fail1:
     Error("fail1 (%08x)\n", status);
@@ -51,6 +51,7 @@ DriverGetParametersKey(
 
 typedef struct _XENCONS_FDO XENCONS_FDO, *PXENCONS_FDO;
 typedef struct _XENCONS_PDO XENCONS_PDO, *PXENCONS_PDO;
+typedef struct _XENCONS_RING XENCONS_RING, *PXENCONS_RING;
 
 #include "fdo.h"
 #include "pdo.h"
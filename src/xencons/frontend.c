@@ -45,6 +45,7 @@
 #include "driver.h"
 #include "frontend.h"
 #include "ring.h"
+#include "select.h"
 #include "thread.h"
 #include "dbg_print.h"
 #include "assert.h"
@@ -219,6 +220,22 @@ FrontendGetBackendDomain(
     return __FrontendGetBackendDomain(Frontend);
 }
 
+static FORCEINLINE PXENCONS_RING
+__FrontendGetRing(
+    IN  PXENCONS_FRONTEND   Frontend
+    )
+{
+    return Frontend->Ring;
+}
+
+PXENCONS_RING
+FrontendGetRing(
+    IN  PXENCONS_FRONTEND   Frontend
+    )
+{
+    return __FrontendGetRing(Frontend);
+}
+
 static BOOLEAN
 FrontendIsOnline(
     IN  PXENCONS_FRONTEND   Frontend
@@ -1439,6 +1456,17 @@ FrontendAbiOpen(
     return RingOpen(Frontend->Ring, FileObject);
 }
 
+static NTSTATUS
+FrontendAbiCleanup(
+    IN  PXENCONS_CONSOLE_ABI_CONTEXT    Context,
+    IN  PFILE_OBJECT                    FileObject
+    )
+{
+    PXENCONS_FRONTEND                   Frontend = (PXENCONS_FRONTEND)Context;
+
+    return RingCleanup(Frontend->Ring, FileObject);
+}
+
 static NTSTATUS
 FrontendAbiClose(
     IN  PXENCONS_CONSOLE_ABI_CONTEXT    Context,
@@ -1464,10 +1492,24 @@ FrontendAbiPutQueue(
     switch (StackLocation->MajorFunction) {
     case IRP_MJ_READ:
     case IRP_MJ_WRITE:
+    case IRP_MJ_FLUSH_BUFFERS:
         return RingPutQueue(Frontend->Ring, Irp);
 
     case IRP_MJ_DEVICE_CONTROL:
-        return FrontendGetProperty(Frontend, Irp);
+        switch (StackLocation->Parameters.DeviceIoControl.IoControlCode) {
+        case IOCTL_XENCONS_GET_INSTANCE:
+        case IOCTL_XENCONS_GET_NAME:
+        case IOCTL_XENCONS_GET_PROTOCOL:
+            return FrontendGetProperty(Frontend, Irp);
+
+        case IOCTL_XENCONS_SELECT:
+            // Not specific to this console
+            return SelectPut(Irp);
+
+        default:
+            // Anything else applies to the open handle
+            return RingPutQueue(Frontend->Ring, Irp);
+        }
 
     default:
         ASSERT(FALSE);
@@ -1482,6 +1524,7 @@ static XENCONS_CONSOLE_ABI FrontendAbi = {
     FrontendAbiD3ToD0,
     FrontendAbiD0ToD3,
     FrontendAbiOpen,
+    FrontendAbiCleanup,
     FrontendAbiClose,
     FrontendAbiPutQueue
 };
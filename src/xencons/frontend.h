@@ -76,4 +76,9 @@ FrontendGetBackendDomain(
     IN  PXENCONS_FRONTEND   Frontend
     );
 
+extern PXENCONS_RING
+FrontendGetRing(
+    IN  PXENCONS_FRONTEND   Frontend
+    );
+
 #endif  // _XENCONS_FRONTEND_H
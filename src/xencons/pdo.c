@@ -322,6 +322,18 @@ PdoIsDefault(
     return __PdoIsDefault(Pdo);
 }
 
+// The default console has no shared ring
+PXENCONS_RING
+PdoGetRing(
+    IN  PXENCONS_PDO    Pdo
+    )
+{
+    if (__PdoIsDefault(Pdo))
+        return NULL;
+
+    return FrontendGetRing((PXENCONS_FRONTEND)Pdo->Context);
+}
+
 static FORCEINLINE VOID
 __PdoSetDefault(
     IN  PXENCONS_PDO    Pdo,
@@ -1755,7 +1767,7 @@ PdoDispatchCleanup(
 
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
 
-    status = XENCONS_CONSOLE_ABI(Close,
+    status = XENCONS_CONSOLE_ABI(Cleanup,
                                  &Pdo->Abi,
                                  StackLocation->FileObject);
 
@@ -1771,11 +1783,17 @@ PdoDispatchClose(
     IN  PIRP            Irp
     )
 {
+    PIO_STACK_LOCATION  StackLocation;
     NTSTATUS            status;
 
-    UNREFERENCED_PARAMETER(Pdo);
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
 
-    status = STATUS_SUCCESS;
+    // Per-open state outlives IRP_MJ_CLEANUP, since requests already
+    // dispatched on the handle may still be using it. Nothing else can
+    // reference the file object by now.
+    status = XENCONS_CONSOLE_ABI(Close,
+                                 &Pdo->Abi,
+                                 StackLocation->FileObject);
 
     Irp->IoStatus.Status = status;
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
@@ -1791,13 +1809,14 @@ PdoDispatchReadWriteControl(
 {
     NTSTATUS            status;
 
+    // STATUS_PENDING is only returned once the IRP has been inserted
+    // into a cancel-safe queue, which marks it pending. It may already
+    // have been completed by then, so it must not be touched again.
     status = XENCONS_CONSOLE_ABI(PutQueue,
                                  &Pdo->Abi,
                                  Irp);
-    if (status == STATUS_PENDING) {
-        IoMarkIrpPending(Irp);
+    if (status == STATUS_PENDING)
         goto done;
-    }
 
     Irp->IoStatus.Status = status;
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
@@ -1856,6 +1875,7 @@ PdoDispatch(
 
     case IRP_MJ_READ:
     case IRP_MJ_WRITE:
+    case IRP_MJ_FLUSH_BUFFERS:
     case IRP_MJ_DEVICE_CONTROL:
         status = PdoDispatchReadWriteControl(Pdo, Irp);
         break;
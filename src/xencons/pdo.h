@@ -88,6 +88,11 @@ PdoIsDefault(
     IN  PXENCONS_PDO    Pdo
     );
 
+extern PXENCONS_RING
+PdoGetRing(
+    IN  PXENCONS_PDO    Pdo
+    );
+
 extern NTSTATUS
 PdoCreate(
     IN  PXENCONS_FDO    Fdo,
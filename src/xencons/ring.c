@@ -38,31 +38,111 @@
 #include <store_interface.h>
 #include <gnttab_interface.h>
 #include <evtchn_interface.h>
+#include <xencons_device.h>
 
+#include "driver.h"
+#include "registry.h"
 #include "frontend.h"
 #include "ring.h"
 #include "names.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
+#include "spsc.h"
+#include "broadcast.h"
+#include "select.h"
 
 typedef struct _XENCONS_QUEUE {
     IO_CSQ                  Csq;
     LIST_ENTRY              List;
-    KSPIN_LOCK           	Lock;
+    KSPIN_LOCK              Lock;
+    BOOLEAN                 Holding;
 } XENCONS_QUEUE, *PXENCONS_QUEUE;
 
+// Input fanned out to every handle in broadcast mode. Each subscriber
+// holds a reference and has its own cursor; the producer never waits
+// for a subscriber, one that falls a whole buffer behind loses data.
+// Per-open state, hung off FileObject->FsContext
+typedef struct _XENCONS_RING_HANDLE {
+    LIST_ENTRY              ListEntry;
+    PFILE_OBJECT            FileObject;
+    XENCONS_QUEUE           Read;
+    XENCONS_QUEUE           Write;
+    XENCONS_QUEUE           Wait;
+    XENCONS_QUEUE           Flush;
+    PXENCONS_BROADCAST      Broadcast;
+    ULONG                   Cursor;
+    ULONG                   Dropped;
+    XENCONS_READ_POLICY     Policy;
+    BOOLEAN                 Closing;
+} XENCONS_RING_HANDLE, *PXENCONS_RING_HANDLE;
+
+#define XENCONS_MAXIMUM_RING_PAGE_ORDER 4
+#define XENCONS_MAXIMUM_RING_PAGES      (1 << XENCONS_MAXIMUM_RING_PAGE_ORDER)
+
+// Flush latency is recorded in power of two buckets of microseconds,
+// the first being anything under 64us
+#define XENCONS_FLUSH_BUCKETS       16
+#define XENCONS_FLUSH_BUCKET_SHIFT  6
+
+// The shared ring is a generalization of struct xencons_interface to
+// (PAGE_SIZE << Order) bytes: the first quarter is the input ring and
+// the next half is the output ring. An order 0 ring is identical to the
+// legacy layout, with the indices at the start of the final quarter.
+// Larger rings pack the indices into the last bytes instead. Both rings
+// must be a power of two in size for the free-running indices to wrap
+// correctly, so the rest of the final quarter stays unused.
+typedef struct _XENCONS_RING_INDICES {
+    XENCONS_RING_IDX    in_cons;
+    XENCONS_RING_IDX    in_prod;
+    XENCONS_RING_IDX    out_cons;
+    XENCONS_RING_IDX    out_prod;
+} XENCONS_RING_INDICES, *PXENCONS_RING_INDICES;
+
+typedef struct _XENCONS_BUFFER {
+    PCHAR               Data;
+    ULONG               Size;
+    ULONG               Prod;
+    ULONG               Cons;
+} XENCONS_BUFFER, *PXENCONS_BUFFER;
+
+// Describes a run of the read buffer as it was taken from the shared
+// ring. The chunks in the FIFO always cover exactly the bytes in the
+// read buffer.
+typedef struct _XENCONS_CHUNK {
+    LARGE_INTEGER       Timestamp;
+    ULONGLONG           Sequence;
+    ULONG               Length;
+} XENCONS_CHUNK, *PXENCONS_CHUNK;
+
+typedef enum _XENCONS_OVERFLOW {
+    XENCONS_OVERFLOW_BLOCK = 0,
+    XENCONS_OVERFLOW_DROP_OLDEST,
+    XENCONS_OVERFLOW_DROP_NEWEST
+} XENCONS_OVERFLOW, *PXENCONS_OVERFLOW;
+
+typedef enum _XENCONS_MODE {
+    XENCONS_MODE_INTERRUPT = 0,
+    XENCONS_MODE_POLL
+} XENCONS_MODE, *PXENCONS_MODE;
+
 struct _XENCONS_RING {
     PXENCONS_FRONTEND           Frontend;
     BOOLEAN                     Connected;
     BOOLEAN                     Enabled;
     KSPIN_LOCK                  Lock;
     PXENBUS_GNTTAB_CACHE        GnttabCache;
-    struct xencons_interface    *Shared;
+    ULONG                       MaximumOrder;
+    ULONG                       Order;
+    PUCHAR                      Shared;
+    XENCONS_SPSC                In;
+    XENCONS_SPSC                Out;
+    PXENCONS_RING_INDICES       Indices;
     PMDL                        Mdl;
-    PXENBUS_GNTTAB_ENTRY        Entry;
+    PXENBUS_GNTTAB_ENTRY        Entry[XENCONS_MAXIMUM_RING_PAGES];
     KDPC                        Dpc;
     ULONG                       Dpcs;
+    LONG                        Unmasking;
     ULONG                       Events;
     PXENBUS_EVTCHN_CHANNEL      Channel;
     XENBUS_GNTTAB_INTERFACE     GnttabInterface;
@@ -70,15 +150,159 @@ struct _XENCONS_RING {
     XENBUS_EVTCHN_INTERFACE     EvtchnInterface;
     XENBUS_DEBUG_INTERFACE      DebugInterface;
     PXENBUS_DEBUG_CALLBACK      DebugCallback;
-    XENCONS_QUEUE               Read;
-    XENCONS_QUEUE               Write;
+    LIST_ENTRY                  Handles;
+    ULONG                       HandleCount;
+    LIST_ENTRY                  Selects;
+    KSPIN_LOCK                  ReadLock;
+    XENCONS_BUFFER              ReadBuffer;
+    XENCONS_OVERFLOW            ReadOverflow;
+    PXENCONS_CHUNK              Chunk;
+    ULONG                       ChunkCount;
+    ULONG                       ChunkProd;
+    ULONG                       ChunkCons;
+    ULONG                       ChunksMerged;
+    ULONGLONG                   ReadSequence;
+    LARGE_INTEGER               ClockTime;
+    LARGE_INTEGER               ClockCounter;
+    LARGE_INTEGER               ClockFrequency;
+    PXENCONS_BROADCAST          Broadcast;
+    ULONG                       BroadcastSize;
+    ULONG                       BroadcastDropped;
+    KSPIN_LOCK                  WriteLock;
+    XENCONS_BUFFER              WriteBuffer;
+    ULONG                       WriteHighWater;
     ULONG                       BytesRead;
     ULONG                       BytesWritten;
+    ULONG                       BytesBuffered;
+    ULONG                       BytesDropped;
+    ULONG                       ReadsFast;
+    ULONG                       ReadsQueued;
+    KTIMER                      ReadTimer;
+    KDPC                        ReadTimerDpc;
+    ULONGLONG                   ReadDeadline;
+    ULONG                       ReadsTimedOut;
+    ULONG                       ReadCompletions;
+    ULONGLONG                   ReadCompletionBytes;
+    ULONG                       WaitsFast;
+    ULONG                       WaitsQueued;
+    ULONG                       WritesFast;
+    ULONG                       WritesBuffered;
+    ULONG                       WritesQueued;
+    ULONG                       WritesGathered;
+    ULONG                       FlushEpoch;
+    KTIMER                      FlushTimer;
+    KDPC                        FlushTimerDpc;
+    ULONGLONG                   FlushDeadline;
+    ULONG                       FlushesFast;
+    ULONG                       FlushesQueued;
+    ULONG                       FlushesTimedOut;
+    ULONG                       FlushLatency[XENCONS_FLUSH_BUCKETS];
+    KSPIN_LOCK                  NotifyLock;
+    KTIMER                      NotifyTimer;
+    KDPC                        NotifyDpc;
+    ULONG                       NotifyBytes;
+    ULONG                       NotifyDelay;
+    ULONG                       NotifyPending;
+    ULONGLONG                   NotifyStart;
+    ULONG                       Notifies;
+    ULONG                       NotifiesCoalesced;
+    XENCONS_MODE                Mode;
+    ULONG                       PollEventRate;
+    ULONG                       PollInterval;
+    KTIMER                      PollTimer;
+    KDPC                        PollDpc;
+    ULONGLONG                   ModeStart;
+    ULONG                       ModeEvents;
+    ULONG                       PollActivity;
+    ULONG                       PollIdle;
+    ULONG                       PollEntries;
+    ULONG                       PollExits;
+    ULONG                       BudgetBytes;
+    ULONG                       BudgetIrps;
+    ULONG                       BudgetExhausted;
+    BOOLEAN                     Threaded;
+    BOOLEAN                     Affinity;
+    PROCESSOR_NUMBER            ProcessorNumber;
 };
 
 #define MAXNAMELEN          128
 #define XENCONS_RING_TAG  'GNIR'
 
+#define XENCONS_READ_BUFFER_SIZE        (16 * 1024)
+#define XENCONS_WRITE_BUFFER_SIZE       (64 * 1024)
+#define XENCONS_BROADCAST_SIZE          (16 * 1024)
+#define XENCONS_BUFFER_SIZE_MINIMUM     1024
+#define XENCONS_BUFFER_SIZE_MAXIMUM     (1024 * 1024)
+
+#define XENCONS_CHUNK_COUNT             1024
+#define XENCONS_CHUNK_COUNT_MAXIMUM     65536
+
+#define XENCONS_NOTIFY_BYTES_MAXIMUM    (1024 * 1024)
+#define XENCONS_NOTIFY_DELAY_MINIMUM    10              // us
+#define XENCONS_NOTIFY_DELAY_MAXIMUM    100000          // us
+
+#define XENCONS_POLL_INTERVAL           1000            // us
+#define XENCONS_POLL_INTERVAL_MINIMUM   100             // us
+#define XENCONS_POLL_INTERVAL_MAXIMUM   100000          // us
+#define XENCONS_POLL_RATE_MINIMUM       100             // events/s
+#define XENCONS_POLL_IDLE_LIMIT         8               // polls
+#define XENCONS_RATE_WINDOW             1000000ull      // 100ns units (100ms)
+
+#define XENCONS_BUDGET_BYTES            (64 * 1024)
+#define XENCONS_BUDGET_BYTES_MINIMUM    (4 * 1024)
+#define XENCONS_BUDGET_BYTES_MAXIMUM    (16 * 1024 * 1024)
+#define XENCONS_BUDGET_IRPS             64
+#define XENCONS_BUDGET_IRPS_MINIMUM     4
+#define XENCONS_BUDGET_IRPS_MAXIMUM     4096
+
+#define XENCONS_PROCESSOR_ANY           0xFFFFFFFF
+
+// Next processor index handed out when ProcessorSpread is set
+static LONG RingProcessorNext = -1;
+
+static const PCHAR
+RingOverflowName(
+    IN  XENCONS_OVERFLOW    Overflow
+    )
+{
+#define _OVERFLOW_NAME(_Overflow)       \
+    case XENCONS_OVERFLOW_ ## _Overflow: \
+        return #_Overflow;
+
+    switch (Overflow) {
+        _OVERFLOW_NAME(BLOCK);
+        _OVERFLOW_NAME(DROP_OLDEST);
+        _OVERFLOW_NAME(DROP_NEWEST);
+    default:
+        break;
+    }
+
+    return "INVALID";
+
+#undef  _OVERFLOW_NAME
+}
+
+static const PCHAR
+RingModeName(
+    IN  XENCONS_MODE    Mode
+    )
+{
+#define _MODE_NAME(_Mode)           \
+    case XENCONS_MODE_ ## _Mode:    \
+        return #_Mode;
+
+    switch (Mode) {
+        _MODE_NAME(INTERRUPT);
+        _MODE_NAME(POLL);
+    default:
+        break;
+    }
+
+    return "INVALID";
+
+#undef  _MODE_NAME
+}
+
 static FORCEINLINE PVOID
 __RingAllocate(
     IN  ULONG   Length
@@ -95,6 +319,88 @@ __RingFree(
     __FreePoolWithTag(Buffer, XENCONS_RING_TAG);
 }
 
+static ULONG
+RingReadParameter(
+    IN  PXENCONS_RING   Ring,
+    IN  PCHAR           Name,
+    IN  ULONG           Default
+    )
+{
+    HANDLE              ParametersKey;
+    HANDLE              ConsoleKey;
+    ULONG               Value;
+    NTSTATUS            status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    ParametersKey = DriverGetParametersKey();
+    if (ParametersKey == NULL)
+        return Default;
+
+    // A value in the console's own subkey overrides the global one
+    status = RegistryOpenSubKey(ParametersKey,
+                                PdoGetName(FrontendGetPdo(Ring->Frontend)),
+                                KEY_READ,
+                                &ConsoleKey);
+    if (NT_SUCCESS(status)) {
+        status = RegistryQueryDwordValue(ConsoleKey,
+                                         Name,
+                                         &Value);
+
+        RegistryCloseKey(ConsoleKey);
+
+        if (NT_SUCCESS(status))
+            goto done;
+    }
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     Name,
+                                     &Value);
+    if (!NT_SUCCESS(status))
+        Value = Default;
+
+done:
+    Trace("%s: %s = %u\n",
+          FrontendGetPath(Ring->Frontend),
+          Name,
+          Value);
+
+    return Value;
+}
+
+// As RingReadParameter, for values where 0 turns a feature off (or
+// lifts a limit). Any other value is clamped to [Minimum, Maximum] so
+// that a bad setting cannot, for example, leave a ring polling every
+// microsecond.
+static ULONG
+RingReadParameterRange(
+    IN  PXENCONS_RING   Ring,
+    IN  PCHAR           Name,
+    IN  ULONG           Default,
+    IN  ULONG           Minimum,
+    IN  ULONG           Maximum
+    )
+{
+    ULONG               Value;
+
+    Value = RingReadParameter(Ring, Name, Default);
+    if (Value == 0)
+        return 0;
+
+    if (Value < Minimum || Value > Maximum) {
+        Warning("%s: %s = %u out of range [%u, %u]\n",
+                FrontendGetPath(Ring->Frontend),
+                Name,
+                Value,
+                Minimum,
+                Maximum);
+
+        Value = (Value < Minimum) ? Minimum : Maximum;
+    }
+
+    return Value;
+}
+
 IO_CSQ_INSERT_IRP_EX RingCsqInsertIrpEx;
 
 NTSTATUS
@@ -148,25 +454,18 @@ RingCsqPeekNextIrp(
 
     Queue = CONTAINING_RECORD(Csq, XENCONS_QUEUE, Csq);
 
+    UNREFERENCED_PARAMETER(PeekContext);
+
     ListEntry = (Irp == NULL) ?
         Queue->List.Flink :
         Irp->Tail.Overlay.ListEntry.Flink;
 
-    while (ListEntry != &Queue->List) {
-        PIO_STACK_LOCATION  StackLocation;
+    if (ListEntry == &Queue->List)
+        return NULL;
 
-        NextIrp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
-        if (PeekContext == NULL)
-            return NextIrp;
+    NextIrp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
 
-        StackLocation = IoGetCurrentIrpStackLocation(NextIrp);
-        if (StackLocation->FileObject == (PFILE_OBJECT)PeekContext)
-            return NextIrp;
-
-        ListEntry = ListEntry->Flink;
-    }
-
-    return NULL;
+    return NextIrp;
 }
 
 #pragma warning(push)
@@ -212,48 +511,206 @@ RingCsqCompleteCanceledIrp(
     IN  PIRP            Irp
     )
 {
+    PXENCONS_QUEUE      Queue;
     PIO_STACK_LOCATION  StackLocation;
     UCHAR               MajorFunction;
 
-    UNREFERENCED_PARAMETER(Csq);
+    Queue = CONTAINING_RECORD(Csq, XENCONS_QUEUE, Csq);
 
     StackLocation = IoGetCurrentIrpStackLocation(Irp);
     MajorFunction = StackLocation->MajorFunction;
 
-    Irp->IoStatus.Information = 0;
-    Irp->IoStatus.Status = STATUS_CANCELLED;
+    // A held read has already taken its input off the ring, so it
+    // completes with that input rather than losing it
+    if (Queue->Holding && Irp->IoStatus.Information != 0) {
+        Irp->IoStatus.Status = STATUS_SUCCESS;
 
-    Trace("CANCELLED (%02x:%s)\n",
-          MajorFunction,
-          MajorFunctionName(MajorFunction));
+        Trace("CANCELLED (%02x:%s) (%u bytes held)\n",
+              MajorFunction,
+              MajorFunctionName(MajorFunction),
+              Irp->IoStatus.Information);
+    } else {
+        Irp->IoStatus.Information = 0;
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+
+        Trace("CANCELLED (%02x:%s)\n",
+              MajorFunction,
+              MajorFunctionName(MajorFunction));
+    }
 
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
 }
 
-static FORCEINLINE VOID
-__RingCancelRequests(
-    IN  PXENCONS_RING   Ring,
-    IN  PFILE_OBJECT    FileObject
+// Holding is set for queues whose requests accumulate input in
+// IoStatus.Information while they wait.
+static NTSTATUS
+RingQueueInitialize(
+    IN  PXENCONS_QUEUE  Queue,
+    IN  BOOLEAN         Holding
+    )
+{
+    KeInitializeSpinLock(&Queue->Lock);
+    InitializeListHead(&Queue->List);
+    Queue->Holding = Holding;
+
+    return IoCsqInitializeEx(&Queue->Csq,
+                             RingCsqInsertIrpEx,
+                             RingCsqRemoveIrp,
+                             RingCsqPeekNextIrp,
+                             RingCsqAcquireLock,
+                             RingCsqReleaseLock,
+                             RingCsqCompleteCanceledIrp);
+}
+
+static VOID
+RingQueueCancel(
+    IN  PXENCONS_QUEUE  Queue
     )
 {
     for (;;) {
         PIRP    Irp;
 
-        Irp = IoCsqRemoveNextIrp(&Ring->Read.Csq, FileObject);
+        Irp = IoCsqRemoveNextIrp(&Queue->Csq, NULL);
         if (Irp == NULL)
             break;
 
-        RingCsqCompleteCanceledIrp(&Ring->Read.Csq, Irp);
+        RingCsqCompleteCanceledIrp(&Queue->Csq, Irp);
     }
-    for (;;) {
-        PIRP    Irp;
+}
 
-        Irp = IoCsqRemoveNextIrp(&Ring->Write.Csq, FileObject);
-        if (Irp == NULL)
-            break;
+static VOID
+RingQueueTeardown(
+    IN  PXENCONS_QUEUE  Queue
+    )
+{
+    RingQueueCancel(Queue);
+
+    ASSERT(IsListEmpty(&Queue->List));
+
+    RtlZeroMemory(&Queue->Csq, sizeof(IO_CSQ));
+    RtlZeroMemory(&Queue->List, sizeof(LIST_ENTRY));
+    RtlZeroMemory(&Queue->Lock, sizeof(KSPIN_LOCK));
+    Queue->Holding = FALSE;
+}
+
+static VOID
+RingHandleDestroy(
+    IN  PXENCONS_RING_HANDLE    Handle
+    )
+{
+    // FsContext is cleared, under both ring locks, as the handle is
+    // taken off the ring
+    ASSERT3P(Handle->FileObject->FsContext, ==, NULL);
+    ASSERT3P(Handle->FileObject->FsContext2, ==, NULL);
+
+    RingQueueTeardown(&Handle->Flush);
+    RingQueueTeardown(&Handle->Wait);
+    RingQueueTeardown(&Handle->Write);
+    RingQueueTeardown(&Handle->Read);
+
+    RtlZeroMemory(&Handle->Policy, sizeof (XENCONS_READ_POLICY));
+
+    Handle->Closing = FALSE;
+    Handle->FileObject = NULL;
+
+    RtlZeroMemory(&Handle->ListEntry, sizeof(LIST_ENTRY));
+
+    ASSERT(IsZeroMemory(Handle, sizeof(XENCONS_RING_HANDLE)));
+    __RingFree(Handle);
+}
+
+static PXENCONS_BROADCAST
+RingBroadcastCreate(
+    IN  ULONG           Size
+    )
+{
+    PXENCONS_BROADCAST  Broadcast;
+
+    ASSERT(Size != 0 && (Size & (Size - 1)) == 0);
 
-        RingCsqCompleteCanceledIrp(&Ring->Write.Csq, Irp);
+    Broadcast = __RingAllocate(sizeof(XENCONS_BROADCAST) + Size);
+    if (Broadcast == NULL)
+        return NULL;
+
+    Broadcast->Data = (PCHAR)(Broadcast + 1);
+    Broadcast->Size = Size;
+
+    return Broadcast;
+}
+
+static VOID
+RingBroadcastDestroy(
+    IN  PXENCONS_BROADCAST  Broadcast
+    )
+{
+    ASSERT3U(Broadcast->References, ==, 0);
+
+    __RingFree(Broadcast);
+}
+
+// Must be called with ReadLock held. If the ring has no broadcast
+// buffer yet then *Spare is used (and cleared), otherwise the caller
+// remains responsible for it.
+static VOID
+RingBroadcastAttach(
+    IN      PXENCONS_RING           Ring,
+    IN      PXENCONS_RING_HANDLE    Handle,
+    IN OUT  PXENCONS_BROADCAST      *Spare
+    )
+{
+    ASSERT3P(Handle->Broadcast, ==, NULL);
+
+    if (Ring->Broadcast == NULL) {
+        ASSERT(*Spare != NULL);
+        Ring->Broadcast = *Spare;
+        *Spare = NULL;
     }
+
+    Handle->Broadcast = Ring->Broadcast;
+    Handle->Broadcast->References++;
+
+    // A new subscriber only sees input that arrives after it joins
+    Handle->Cursor = Handle->Broadcast->Prod;
+    Handle->Dropped = 0;
+}
+
+// Must be called with ReadLock held. Returns the broadcast buffer if
+// this was the last reference, in which case the caller must destroy
+// it once the lock has been dropped.
+static PXENCONS_BROADCAST
+RingBroadcastDetach(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle
+    )
+{
+    PXENCONS_BROADCAST          Broadcast = Handle->Broadcast;
+
+    if (Broadcast == NULL)
+        return NULL;
+
+    ASSERT3P(Broadcast, ==, Ring->Broadcast);
+
+    Trace("%p: dropped %u\n", Handle->FileObject, Handle->Dropped);
+
+    Handle->Dropped = 0;
+    Handle->Cursor = 0;
+    Handle->Broadcast = NULL;
+
+    ASSERT(Broadcast->References != 0);
+    if (--Broadcast->References != 0)
+        return NULL;
+
+    Ring->Broadcast = NULL;
+    return Broadcast;
+}
+
+// Must be called with ReadLock held
+static FORCEINLINE ULONG
+RingBroadcastReferences(
+    IN  PXENCONS_RING   Ring
+    )
+{
+    return (Ring->Broadcast != NULL) ? Ring->Broadcast->References : 0;
 }
 
 static VOID
@@ -279,260 +736,2970 @@ RingReleaseLock(
 
 NTSTATUS
 RingOpen(
-    IN  PXENCONS_RING   Ring,
-    IN  PFILE_OBJECT    FileObject
-    )
-{
-    UNREFERENCED_PARAMETER(Ring);
-    UNREFERENCED_PARAMETER(FileObject);
-    return STATUS_SUCCESS;
-}
-
-NTSTATUS
-RingClose(
-    IN  PXENCONS_RING   Ring,
-    IN  PFILE_OBJECT    FileObject
+    IN  PXENCONS_RING       Ring,
+    IN  PFILE_OBJECT        FileObject
     )
 {
-    __RingCancelRequests(Ring, FileObject);
-    return STATUS_SUCCESS;
-}
+    PXENCONS_RING_HANDLE    Handle;
+    KIRQL                   Irql;
+    NTSTATUS                status;
 
-NTSTATUS
-RingPutQueue(
-    IN  PXENCONS_RING   Ring,
-    IN  PIRP            Irp
-    )
-{
-    PIO_STACK_LOCATION  StackLocation;
-    NTSTATUS            status;
+    Handle = __RingAllocate(sizeof(XENCONS_RING_HANDLE));
 
-    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    status = STATUS_NO_MEMORY;
+    if (Handle == NULL)
+        goto fail1;
 
-    switch (StackLocation->MajorFunction) {
-    case IRP_MJ_READ:
-        status = IoCsqInsertIrpEx(&Ring->Read.Csq,
-                                  Irp,
-                                  NULL,
-                                  (PVOID)FALSE);
-        break;
+    status = RingQueueInitialize(&Handle->Read, TRUE);
+    if (!NT_SUCCESS(status))
+        goto fail2;
 
-    case IRP_MJ_WRITE:
-        status = IoCsqInsertIrpEx(&Ring->Write.Csq,
-                                  Irp,
-                                  NULL,
-                                  (PVOID)FALSE);
-        break;
+    status = RingQueueInitialize(&Handle->Write, FALSE);
+    if (!NT_SUCCESS(status))
+        goto fail3;
 
-    default:
-        ASSERT(FALSE);
-        status = STATUS_NOT_SUPPORTED; // Keep SDV happy
-        break;
-    }
-    if (status != STATUS_PENDING)
-        goto fail1;
+    status = RingQueueInitialize(&Handle->Wait, FALSE);
+    if (!NT_SUCCESS(status))
+        goto fail4;
 
-    KeInsertQueueDpc(&Ring->Dpc, NULL, NULL);
-    return STATUS_PENDING;
+    status = RingQueueInitialize(&Handle->Flush, FALSE);
+    if (!NT_SUCCESS(status))
+        goto fail5;
 
-fail1:
-    Error("fail1 (%08x)\n", status);
+    Handle->Policy.Minimum = 1;
 
-    return status;
-}
+    Handle->FileObject = FileObject;
 
-static ULONG
-RingCopyFromRead(
-    IN  PXENCONS_RING           Ring,
-    IN  PCHAR                   Data,
-    IN  ULONG                   Length
-    )
-{
-    struct xencons_interface    *Shared;
-    XENCONS_RING_IDX            cons;
-    XENCONS_RING_IDX            prod;
-    ULONG                       Offset;
+    ASSERT3P(FileObject->FsContext, ==, NULL);
+    FileObject->FsContext = Handle;
 
-    Shared = Ring->Shared;
+    // The handle list is walked by RingPoll under either lock
+    KeAcquireSpinLock(&Ring->ReadLock, &Irql);
+    KeAcquireSpinLockAtDpcLevel(&Ring->WriteLock);
+    InsertTailList(&Ring->Handles, &Handle->ListEntry);
+    Ring->HandleCount++;
 
-    KeMemoryBarrier();
+    // Without a read buffer a handle cannot compete with broadcast
+    // subscribers (see RingSetBroadcast()), so it joins them
+    if (Ring->ReadBuffer.Data == NULL && Ring->Broadcast != NULL) {
+        PXENCONS_BROADCAST  Spare = NULL;
 
-    cons = Shared->in_cons;
-    prod = Shared->in_prod;
+        RingBroadcastAttach(Ring, Handle, &Spare);
+    }
+    KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+    KeReleaseSpinLock(&Ring->ReadLock, Irql);
 
-    KeMemoryBarrier();
+    Trace("%p\n", FileObject);
 
-    Offset = 0;
-    while (Length != 0) {
-        ULONG   Available;
-        ULONG   Index;
-        ULONG   CopyLength;
+    return STATUS_SUCCESS;
 
-        Available = prod - cons;
+fail5:
+    Error("fail5\n");
 
-        if (Available == 0)
-            break;
+    RtlZeroMemory(&Handle->Flush, sizeof(XENCONS_QUEUE));
 
-        Index = MASK_XENCONS_IDX(cons, Shared->in);
+fail4:
+    Error("fail4\n");
 
-        CopyLength = __min(Length, Available);
-        CopyLength = __min(CopyLength, sizeof(Shared->in) - Index);
+    RtlZeroMemory(&Handle->Wait, sizeof(XENCONS_QUEUE));
 
-        RtlCopyMemory(Data + Offset, &Shared->in[Index], CopyLength);
+fail3:
+    Error("fail3\n");
 
-        Offset += CopyLength;
-        Length -= CopyLength;
+    RtlZeroMemory(&Handle->Write, sizeof(XENCONS_QUEUE));
 
-        cons += CopyLength;
-    }
+fail2:
+    Error("fail2\n");
 
-    KeMemoryBarrier();
+    RtlZeroMemory(&Handle->Read, sizeof(XENCONS_QUEUE));
 
-    Shared->in_cons = cons;
+    ASSERT(IsZeroMemory(Handle, sizeof(XENCONS_RING_HANDLE)));
+    __RingFree(Handle);
 
-    KeMemoryBarrier();
+fail1:
+    Error("fail1 (%08x)\n", status);
 
-    return Offset;
+    return status;
 }
 
-static ULONG
-RingCopyToWrite(
-    IN  PXENCONS_RING           Ring,
-    IN  PCHAR                   Data,
-    IN  ULONG                   Length
+// Requests already dispatched on FileObject may still hold the handle,
+// so it is only taken off the ring here. Closing is set under both ring
+// locks, which every path that queues a request checks, so nothing can
+// be queued behind the cancellation. The handle itself is parked in
+// FsContext2 until RingClose().
+NTSTATUS
+RingCleanup(
+    IN  PXENCONS_RING       Ring,
+    IN  PFILE_OBJECT        FileObject
     )
 {
-    struct xencons_interface    *Shared;
-    XENCONS_RING_IDX            cons;
-    XENCONS_RING_IDX            prod;
-    ULONG                       Offset;
+    PXENCONS_RING_HANDLE    Handle;
+    PXENCONS_BROADCAST      Broadcast;
+    KIRQL                   Irql;
+    NTSTATUS                status;
 
-    Shared = Ring->Shared;
+    Handle = FileObject->FsContext;
 
-    KeMemoryBarrier();
+    status = STATUS_UNSUCCESSFUL;
+    if (Handle == NULL)
+        goto fail1;
 
-    prod = Shared->out_prod;
-    cons = Shared->out_cons;
+    Trace("%p\n", FileObject);
 
-    KeMemoryBarrier();
+    KeAcquireSpinLock(&Ring->ReadLock, &Irql);
+    KeAcquireSpinLockAtDpcLevel(&Ring->WriteLock);
+    RemoveEntryList(&Handle->ListEntry);
+    --Ring->HandleCount;
+    Handle->Closing = TRUE;
+    FileObject->FsContext = NULL;
+    FileObject->FsContext2 = Handle;
+    Broadcast = RingBroadcastDetach(Ring, Handle);
+    KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+    KeReleaseSpinLock(&Ring->ReadLock, Irql);
 
-    Offset = 0;
-    while (Length != 0) {
-        ULONG   Available;
-        ULONG   Index;
-        ULONG   CopyLength;
+    if (Broadcast != NULL)
+        RingBroadcastDestroy(Broadcast);
 
-        Available = cons + sizeof(Shared->out) - prod;
+    // Any select that includes this handle must complete before the
+    // handle (and eventually the ring) goes away
+    SelectClose(Ring, FileObject);
 
-        if (Available == 0)
-            break;
+    // Only this handle's own IRPs need to be cancelled
+    RingQueueCancel(&Handle->Flush);
+    RingQueueCancel(&Handle->Wait);
+    RingQueueCancel(&Handle->Write);
+    RingQueueCancel(&Handle->Read);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
 
-        Index = MASK_XENCONS_IDX(prod, Shared->out);
+    return status;
+}
 
-        CopyLength = __min(Length, Available);
-        CopyLength = __min(CopyLength, sizeof(Shared->out) - Index);
+// No request can reference FileObject by now. The ring is not touched,
+// since a handle taken off it by RingDestroy() has already been freed.
+NTSTATUS
+RingClose(
+    IN  PXENCONS_RING       Ring,
+    IN  PFILE_OBJECT        FileObject
+    )
+{
+    PXENCONS_RING_HANDLE    Handle;
 
-        RtlCopyMemory(&Shared->out[Index], Data + Offset, CopyLength);
+    UNREFERENCED_PARAMETER(Ring);
 
-        Offset += CopyLength;
-        Length -= CopyLength;
+    ASSERT3P(FileObject->FsContext, ==, NULL);
 
-        prod += CopyLength;
-    }
+    Handle = FileObject->FsContext2;
+    if (Handle == NULL)
+        return STATUS_SUCCESS;
 
-    KeMemoryBarrier();
+    Trace("%p\n", FileObject);
 
-    Shared->out_prod = prod;
+    ASSERT(Handle->Closing);
+    FileObject->FsContext2 = NULL;
 
-    KeMemoryBarrier();
+    RingHandleDestroy(Handle);
 
-    return Offset;
+    return STATUS_SUCCESS;
 }
 
-static BOOLEAN
-RingPoll(
+// Must be called at DISPATCH_LEVEL
+static VOID
+RingNotifyAdd(
+    IN  PXENCONS_RING   Ring,
+    IN  ULONG           Length
+    )
+{
+    if (Length == 0)
+        return;
+
+    KeAcquireSpinLockAtDpcLevel(&Ring->NotifyLock);
+
+    if (Ring->NotifyPending == 0)
+        Ring->NotifyStart = KeQueryInterruptTime();
+
+    Ring->NotifyPending += Length;
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->NotifyLock);
+}
+
+// Must be called at DISPATCH_LEVEL. The backend is kicked if either
+// coalescing threshold has been reached (or Force is set), otherwise
+// the notify timer is armed to fire when the delay expires.
+static VOID
+RingNotify(
+    IN  PXENCONS_RING   Ring,
+    IN  BOOLEAN         Force
+    )
+{
+    KeAcquireSpinLockAtDpcLevel(&Ring->NotifyLock);
+
+    if (Ring->NotifyPending == 0)
+        goto done;
+
+    if (!Force &&
+        (Ring->NotifyBytes == 0 ||
+         Ring->NotifyPending < Ring->NotifyBytes)) {
+        ULONGLONG   Elapsed;
+
+        // KeQueryInterruptTime() is in 100ns units
+        Elapsed = (KeQueryInterruptTime() - Ring->NotifyStart) / 10;
+
+        if (Elapsed < Ring->NotifyDelay) {
+            LARGE_INTEGER   Timeout;
+
+            Timeout.QuadPart = -(LONGLONG)((Ring->NotifyDelay - Elapsed) * 10);
+
+            (VOID) KeSetTimer(&Ring->NotifyTimer,
+                              Timeout,
+                              &Ring->NotifyDpc);
+
+            Ring->NotifiesCoalesced++;
+            goto done;
+        }
+    }
+
+    (VOID) KeCancelTimer(&Ring->NotifyTimer);
+
+    XENBUS_EVTCHN(Send,
+                  &Ring->EvtchnInterface,
+                  Ring->Channel);
+
+    Ring->NotifyPending = 0;
+    Ring->Notifies++;
+
+done:
+    KeReleaseSpinLockFromDpcLevel(&Ring->NotifyLock);
+}
+
+__drv_functionClass(KDEFERRED_ROUTINE)
+__drv_maxIRQL(DISPATCH_LEVEL)
+__drv_minIRQL(DISPATCH_LEVEL)
+__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_sameIRQL
+static VOID
+RingNotifyDpc(
+    IN  PKDPC       Dpc,
+    IN  PVOID       Context,
+    IN  PVOID       Argument1,
+    IN  PVOID       Argument2
+    )
+{
+    PXENCONS_RING   Ring = Context;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT(Ring != NULL);
+
+    RingNotify(Ring, TRUE);
+}
+
+static ULONG
+RingCopyFromRead(
+    IN  PXENCONS_RING           Ring,
+    IN  PCHAR                   Data,
+    IN  ULONG                   Length
+    )
+{
+    ULONG                       Read;
+
+    Read = SpscRead(&Ring->In, Data, Length);
+
+    RingNotifyAdd(Ring, Read);
+
+    return Read;
+}
+
+static ULONG
+RingDiscardRead(
+    IN  PXENCONS_RING           Ring
+    )
+{
+    ULONG                       Discarded;
+
+    Discarded = SpscDiscard(&Ring->In);
+
+    RingNotifyAdd(Ring, Discarded);
+
+    return Discarded;
+}
+
+static FORCEINLINE ULONG
+__RingReadAvailable(
+    IN  PXENCONS_RING           Ring
+    )
+{
+    return SpscUsed(&Ring->In);
+}
+
+static ULONG
+RingCopyToWrite(
+    IN  PXENCONS_RING           Ring,
+    IN  PCHAR                   Data,
+    IN  ULONG                   Length
+    )
+{
+    ULONG                       Written;
+
+    Written = SpscWrite(&Ring->Out, Data, Length);
+
+    RingNotifyAdd(Ring, Written);
+
+    return Written;
+}
+
+static FORCEINLINE ULONG
+__RingBufferUsed(
+    IN  PXENCONS_BUFFER Buffer
+    )
+{
+    return Buffer->Prod - Buffer->Cons;
+}
+
+static FORCEINLINE ULONG
+__RingBufferFree(
+    IN  PXENCONS_BUFFER Buffer
+    )
+{
+    return Buffer->Size - __RingBufferUsed(Buffer);
+}
+
+static VOID
+RingBufferPut(
+    IN  PXENCONS_BUFFER Buffer,
+    IN  PCHAR           Data,
+    IN  ULONG           Length
+    )
+{
+    ULONG               Offset;
+
+    ASSERT3U(Length, <=, __RingBufferFree(Buffer));
+
+    Offset = 0;
+    while (Length != 0) {
+        ULONG   Index;
+        ULONG   CopyLength;
+
+        Index = Buffer->Prod & (Buffer->Size - 1);
+
+        CopyLength = __min(Length, Buffer->Size - Index);
+
+        RtlCopyMemory(&Buffer->Data[Index], Data + Offset, CopyLength);
+
+        Offset += CopyLength;
+        Length -= CopyLength;
+
+        Buffer->Prod += CopyLength;
+    }
+}
+
+static ULONG
+RingBufferGet(
+    IN  PXENCONS_BUFFER Buffer,
+    IN  PCHAR           Data,
+    IN  ULONG           Length
+    )
+{
+    ULONG               Offset;
+
+    Length = __min(Length, __RingBufferUsed(Buffer));
+
+    Offset = 0;
+    while (Length != 0) {
+        ULONG   Index;
+        ULONG   CopyLength;
+
+        Index = Buffer->Cons & (Buffer->Size - 1);
+
+        CopyLength = __min(Length, Buffer->Size - Index);
+
+        RtlCopyMemory(Data + Offset, &Buffer->Data[Index], CopyLength);
+
+        Offset += CopyLength;
+        Length -= CopyLength;
+
+        Buffer->Cons += CopyLength;
+    }
+
+    return Offset;
+}
+
+static NTSTATUS
+RingBufferCreate(
+    IN  PXENCONS_BUFFER Buffer,
+    IN  ULONG           Size
+    )
+{
+    NTSTATUS            status;
+
+    // Round down to a power of two so indices can be masked
+    while ((Size & (Size - 1)) != 0)
+        Size &= Size - 1;
+
+    if (Size == 0)
+        return STATUS_SUCCESS;
+
+    Buffer->Data = __RingAllocate(Size);
+
+    status = STATUS_NO_MEMORY;
+    if (Buffer->Data == NULL)
+        goto fail1;
+
+    Buffer->Size = Size;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+RingBufferDestroy(
+    IN  PXENCONS_BUFFER Buffer
+    )
+{
+    if (Buffer->Data != NULL)
+        __RingFree(Buffer->Data);
+
+    RtlZeroMemory(Buffer, sizeof(XENCONS_BUFFER));
+}
+
+// KeQuerySystemTime() only has clock tick resolution, so record
+// timestamps are the system time at which the ring was created plus
+// the performance counter ticks since then, in 100ns units
+static VOID
+RingClockStart(
+    IN  PXENCONS_RING   Ring
+    )
+{
+    KeQuerySystemTime(&Ring->ClockTime);
+    Ring->ClockCounter = KeQueryPerformanceCounter(&Ring->ClockFrequency);
+}
+
+static VOID
+RingClockQuery(
+    IN  PXENCONS_RING   Ring,
+    OUT PLARGE_INTEGER  Timestamp
+    )
+{
+    ULONGLONG           Frequency = Ring->ClockFrequency.QuadPart;
+    ULONGLONG           Ticks;
+
+    Ticks = KeQueryPerformanceCounter(NULL).QuadPart -
+            Ring->ClockCounter.QuadPart;
+
+    // Split the conversion so that it cannot overflow
+    Timestamp->QuadPart = Ring->ClockTime.QuadPart +
+                          (Ticks / Frequency) * 10000000ull +
+                          ((Ticks % Frequency) * 10000000ull) / Frequency;
+}
+
+// Must be called with ReadLock held. Records Length bytes just added to
+// the read buffer. Extend is set for data taken in the same pass over
+// the shared ring as the newest chunk, which it then extends. Anything
+// arriving while the FIFO is full also extends the newest chunk, in
+// which case it carries an earlier timestamp than it should.
+static VOID
+RingChunkAdd(
+    IN  PXENCONS_RING   Ring,
+    IN  PLARGE_INTEGER  Timestamp,
+    IN  BOOLEAN         Extend,
+    IN  ULONG           Length
+    )
+{
+    PXENCONS_CHUNK      Chunk;
+
+    if (Ring->Chunk == NULL || Length == 0)
+        return;
+
+    if (Ring->ChunkProd != Ring->ChunkCons) {
+        Chunk = &Ring->Chunk[(Ring->ChunkProd - 1) & (Ring->ChunkCount - 1)];
+
+        if (Extend) {
+            Chunk->Length += Length;
+            return;
+        }
+
+        if (Ring->ChunkProd - Ring->ChunkCons == Ring->ChunkCount) {
+            Chunk->Length += Length;
+            Ring->ChunksMerged++;
+            return;
+        }
+    }
+
+    Chunk = &Ring->Chunk[Ring->ChunkProd & (Ring->ChunkCount - 1)];
+
+    Chunk->Timestamp = *Timestamp;
+    Chunk->Sequence = Ring->ReadSequence++;
+    Chunk->Length = Length;
+
+    Ring->ChunkProd++;
+}
+
+// Must be called with ReadLock held, whenever bytes leave the read buffer
+static VOID
+RingChunkConsume(
+    IN  PXENCONS_RING   Ring,
+    IN  ULONG           Length
+    )
+{
+    if (Ring->Chunk == NULL)
+        return;
+
+    while (Length != 0) {
+        PXENCONS_CHUNK  Chunk;
+        ULONG           Consumed;
+
+        ASSERT(Ring->ChunkProd != Ring->ChunkCons);
+        Chunk = &Ring->Chunk[Ring->ChunkCons & (Ring->ChunkCount - 1)];
+
+        Consumed = __min(Length, Chunk->Length);
+
+        Chunk->Length -= Consumed;
+        Length -= Consumed;
+
+        if (Chunk->Length == 0)
+            Ring->ChunkCons++;
+    }
+}
+
+// Must be called with ReadLock held
+static ULONG
+RingReadBufferTake(
+    IN  PXENCONS_RING   Ring,
+    IN  PCHAR           Data,
+    IN  ULONG           Length
+    )
+{
+    ULONG               Read;
+
+    Read = RingBufferGet(&Ring->ReadBuffer, Data, Length);
+    RingChunkConsume(Ring, Read);
+
+    return Read;
+}
+
+// Must be called with ReadLock held. Input that has already been taken
+// from the shared ring cannot be handed back to the backend, so when
+// the read buffer is full something is always dropped. Returns the
+// number of bytes that were put in the read buffer.
+static ULONG
+RingReadBufferPublish(
+    IN  PXENCONS_RING   Ring,
+    IN  PLARGE_INTEGER  Timestamp,
+    IN  BOOLEAN         Extend,
+    IN  PCHAR           Data,
+    IN  ULONG           Length
+    )
+{
+    PXENCONS_BUFFER     Buffer = &Ring->ReadBuffer;
+    ULONG               Put;
+
+    if (Ring->ReadOverflow == XENCONS_OVERFLOW_DROP_OLDEST &&
+        Length > __RingBufferFree(Buffer)) {
+        ULONG   Dropped;
+
+        Dropped = __min(Length - __RingBufferFree(Buffer),
+                        __RingBufferUsed(Buffer));
+
+        Buffer->Cons += Dropped;
+        RingChunkConsume(Ring, Dropped);
+        Ring->BytesDropped += Dropped;
+    }
+
+    Put = __min(Length, __RingBufferFree(Buffer));
+    RingBufferPut(Buffer, Data, Put);
+
+    RingChunkAdd(Ring, Timestamp, Extend, Put);
+
+    Ring->BytesDropped += Length - Put;
+
+    return Put;
+}
+
+typedef struct _XENCONS_BROADCAST_FILL {
+    PXENCONS_RING   Ring;
+    LARGE_INTEGER   Timestamp;
+    BOOLEAN         Extend;
+} XENCONS_BROADCAST_FILL, *PXENCONS_BROADCAST_FILL;
+
+static VOID
+RingBroadcastPublish(
+    IN  PVOID               Argument,
+    IN  PCHAR               Data,
+    IN  ULONG               Length
+    )
+{
+    PXENCONS_BROADCAST_FILL Fill = Argument;
+
+    if (RingReadBufferPublish(Fill->Ring,
+                              &Fill->Timestamp,
+                              Fill->Extend,
+                              Data,
+                              Length) != 0)
+        Fill->Extend = TRUE;
+}
+
+// Must be called with ReadLock held. Everything in the shared ring is
+// copied once into the broadcast buffer. Handles that are not
+// subscribed still compete for the same input via the read buffer, but
+// only get what it has room for: holding input back for them would
+// stall every subscriber behind a reader that may never come back, so
+// XENCONS_OVERFLOW_BLOCK only applies while there are no subscribers.
+static VOID
+RingBroadcastFill(
+    IN  PXENCONS_RING       Ring
+    )
+{
+    PXENCONS_BROADCAST      Broadcast = Ring->Broadcast;
+    BOOLEAN                 Competing;
+    XENCONS_BROADCAST_FILL  Fill;
+    ULONG                   Read;
+
+    ASSERT(Broadcast != NULL);
+
+    Competing = (Ring->HandleCount > Broadcast->References) ?
+                TRUE :
+                FALSE;
+
+    // RingSetBroadcast() and RingOpen() ensure that no handle competes
+    // when there is no read buffer
+    ASSERT(!Competing || Ring->ReadBuffer.Data != NULL);
+
+    Fill.Ring = Ring;
+    RingClockQuery(Ring, &Fill.Timestamp);
+    Fill.Extend = FALSE;
+
+    Read = BroadcastFill(Broadcast,
+                         &Ring->In,
+                         (Competing) ? RingBroadcastPublish : NULL,
+                         &Fill);
+
+    RingNotifyAdd(Ring, Read);
+    Ring->BytesRead += Read;
+}
+
+// Must be called with ReadLock held
+static ULONG
+RingBroadcastGet(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PCHAR                   Data,
+    IN  ULONG                   Length
+    )
+{
+    ULONG                       Dropped;
+    ULONG                       Read;
+
+    // Lapped subscribers skip to the oldest byte still held
+    Dropped = 0;
+    Read = BroadcastGet(Handle->Broadcast,
+                        &Handle->Cursor,
+                        &Dropped,
+                        Data,
+                        Length);
+
+    Handle->Dropped += Dropped;
+    Ring->BroadcastDropped += Dropped;
+
+    return Read;
+}
+
+static FORCEINLINE BOOLEAN
+__RingQueueIsEmpty(
+    IN  PXENCONS_QUEUE  Queue
+    )
+{
+    KIRQL               Irql;
+    BOOLEAN             Empty;
+
+    KeAcquireSpinLock(&Queue->Lock, &Irql);
+    Empty = IsListEmpty(&Queue->List);
+    KeReleaseSpinLock(&Queue->Lock, Irql);
+
+    return Empty;
+}
+
+// Must be called with ReadLock held
+static VOID
+RingReadBufferFill(
+    IN  PXENCONS_RING   Ring
+    )
+{
+    PXENCONS_BUFFER     Buffer = &Ring->ReadBuffer;
+    LARGE_INTEGER       Timestamp;
+    BOOLEAN             Extend;
+
+    if (Ring->Broadcast != NULL) {
+        RingBroadcastFill(Ring);
+        return;
+    }
+
+    if (Buffer->Data == NULL)
+        return;
+
+    // Everything taken in this pass is one chunk
+    RingClockQuery(Ring, &Timestamp);
+    Extend = FALSE;
+
+    for (;;) {
+        ULONG   Available;
+        ULONG   Index;
+        ULONG   Length;
+        ULONG   Read;
+
+        Available = __RingReadAvailable(Ring);
+        if (Available == 0)
+            break;
+
+        if (__RingBufferFree(Buffer) == 0) {
+            ULONG   Dropped;
+
+            switch (Ring->ReadOverflow) {
+            case XENCONS_OVERFLOW_DROP_OLDEST:
+                Dropped = __min(Available, Buffer->Size);
+                Buffer->Cons += Dropped;
+                RingChunkConsume(Ring, Dropped);
+                break;
+
+            case XENCONS_OVERFLOW_DROP_NEWEST:
+                Dropped = RingDiscardRead(Ring);
+                break;
+
+            default:
+                // Leave the data in the shared ring so the backend
+                // sees back-pressure
+                return;
+            }
+
+            Ring->BytesDropped += Dropped;
+            continue;
+        }
+
+        Index = Buffer->Prod & (Buffer->Size - 1);
+
+        Length = __min(__RingBufferFree(Buffer), Buffer->Size - Index);
+
+        Read = RingCopyFromRead(Ring,
+                                &Buffer->Data[Index],
+                                Length);
+
+        Buffer->Prod += Read;
+        Ring->BytesRead += Read;
+
+        RingChunkAdd(Ring, &Timestamp, Extend, Read);
+        if (Read != 0)
+            Extend = TRUE;
+    }
+}
+
+// Must be called with ReadLock held
+static ULONG
+RingReadBufferGet(
+    IN  PXENCONS_RING   Ring,
+    IN  PCHAR           Data,
+    IN  ULONG           Length
+    )
+{
+    ULONG               Read;
+
+    // Buffered data is older than anything still in the shared ring
+    Read = RingReadBufferTake(Ring, Data, Length);
+    if (Read == Length)
+        return Read;
+
+    // In broadcast mode the shared ring may only be consumed via the
+    // broadcast buffer, which re-fills the read buffer
+    if (Ring->Broadcast != NULL) {
+        RingBroadcastFill(Ring);
+
+        Read += RingReadBufferTake(Ring,
+                                   Data + Read,
+                                   Length - Read);
+    } else {
+        ULONG   Copied;
+
+        Copied = RingCopyFromRead(Ring,
+                                  Data + Read,
+                                  Length - Read);
+
+        Ring->BytesRead += Copied;
+        Read += Copied;
+
+        // This chunk never went through the read buffer, but record
+        // readers can still see that it was taken
+        if (Copied != 0)
+            Ring->ReadSequence++;
+    }
+
+    return Read;
+}
+
+// Must be called with WriteLock held
+static BOOLEAN
+RingWriteBufferPut(
+    IN  PXENCONS_RING   Ring,
+    IN  PCHAR           Data,
+    IN  ULONG           Length
+    )
+{
+    PXENCONS_BUFFER     Buffer = &Ring->WriteBuffer;
+
+    if (Buffer->Data == NULL)
+        return FALSE;
+
+    // Above the high-water mark writes fall back to pending
+    if (__RingBufferUsed(Buffer) + Length > Ring->WriteHighWater)
+        return FALSE;
+
+    RingBufferPut(Buffer, Data, Length);
+
+    Ring->BytesBuffered += Length;
+    Ring->WritesBuffered++;
+
+    return TRUE;
+}
+
+// Must be called with WriteLock held
+static VOID
+RingWriteBufferDrain(
+    IN  PXENCONS_RING   Ring
+    )
+{
+    PXENCONS_BUFFER     Buffer = &Ring->WriteBuffer;
+
+    while (__RingBufferUsed(Buffer) != 0) {
+        ULONG   Index;
+        ULONG   Length;
+        ULONG   Written;
+
+        Index = Buffer->Cons & (Buffer->Size - 1);
+
+        Length = __min(__RingBufferUsed(Buffer), Buffer->Size - Index);
+
+        Written = RingCopyToWrite(Ring,
+                                  &Buffer->Data[Index],
+                                  Length);
+
+        Buffer->Cons += Written;
+        Ring->BytesWritten += Written;
+
+        if (Written < Length)
+            break;
+    }
+}
+
+// Must be called with WriteLock held. As in RingPutWrite, data goes
+// straight into the shared ring if nothing is buffered and only the
+// remainder is buffered. Returns the number of bytes accepted.
+static ULONG
+RingWriteData(
+    IN  PXENCONS_RING   Ring,
+    IN  PCHAR           Data,
+    IN  ULONG           Length
+    )
+{
+    ULONG               Written;
+
+    Written = 0;
+    if (Ring->Enabled && __RingBufferUsed(&Ring->WriteBuffer) == 0) {
+        Written = RingCopyToWrite(Ring, Data, Length);
+        Ring->BytesWritten += Written;
+    }
+
+    if (Written < Length &&
+        RingWriteBufferPut(Ring, Data + Written, Length - Written))
+        Written = Length;
+
+    return Written;
+}
+
+static FORCEINLINE BOOLEAN
+__RingIsGather(
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    return (StackLocation->MajorFunction == IRP_MJ_DEVICE_CONTROL &&
+            StackLocation->Parameters.DeviceIoControl.IoControlCode ==
+            IOCTL_XENCONS_WRITE_GATHER) ?
+           TRUE :
+           FALSE;
+}
+
+// Checks that every segment lies within the input buffer and that a
+// count for each will fit in the output buffer. Returns the combined
+// length of the segments.
+static NTSTATUS
+RingGatherValidate(
+    IN  PIRP                Irp,
+    OUT PULONG              Length
+    )
+{
+    PIO_STACK_LOCATION      StackLocation;
+    ULONG                   InputBufferLength;
+    ULONG                   OutputBufferLength;
+    PXENCONS_WRITE_GATHER   Gather;
+    ULONG                   Index;
+    NTSTATUS                status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    OutputBufferLength = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+    Gather = Irp->AssociatedIrp.SystemBuffer;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (InputBufferLength < FIELD_OFFSET(XENCONS_WRITE_GATHER, Segment))
+        goto fail1;
+
+    if (Gather->Count > (InputBufferLength -
+                         FIELD_OFFSET(XENCONS_WRITE_GATHER, Segment)) /
+                        sizeof (XENCONS_WRITE_SEGMENT))
+        goto fail2;
+
+    status = STATUS_BUFFER_TOO_SMALL;
+    if (OutputBufferLength < Gather->Count * sizeof (ULONG))
+        goto fail3;
+
+    *Length = 0;
+    for (Index = 0; Index < Gather->Count; Index++) {
+        PXENCONS_WRITE_SEGMENT  Segment = &Gather->Segment[Index];
+
+        status = STATUS_INVALID_PARAMETER;
+        if (Segment->Offset > InputBufferLength ||
+            Segment->Length > InputBufferLength - Segment->Offset)
+            goto fail4;
+
+        // Segments may overlap so the total is not otherwise bounded
+        if (Segment->Length > MAXULONG - *Length)
+            goto fail5;
+
+        *Length += Segment->Length;
+    }
+
+    return STATUS_SUCCESS;
+
+fail5:
+    Error("fail5\n");
+
+fail4:
+    Error("fail4\n");
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Must be called with WriteLock held. The segments are written in
+// order, stopping at the first that does not fit completely.
+static ULONG
+RingWriteGather(
+    IN  PXENCONS_RING       Ring,
+    IN  PIRP                Irp
+    )
+{
+    PXENCONS_WRITE_GATHER   Gather = Irp->AssociatedIrp.SystemBuffer;
+    ULONG                   Index;
+    ULONG                   Written;
+
+    Written = 0;
+    for (Index = 0; Index < Gather->Count; Index++) {
+        PXENCONS_WRITE_SEGMENT  Segment = &Gather->Segment[Index];
+        ULONG                   Copied;
+
+        Copied = RingWriteData(Ring,
+                               (PCHAR)Gather + Segment->Offset,
+                               Segment->Length);
+        Written += Copied;
+
+        if (Copied < Segment->Length)
+            break;
+    }
+
+    return Written;
+}
+
+// The per-segment counts overlay the descriptors in the system buffer
+// but each count is stored only after its own descriptor has been read,
+// and never reaches a later one.
+static VOID
+RingGatherComplete(
+    IN  PIRP                Irp,
+    IN  ULONG               Written
+    )
+{
+    PXENCONS_WRITE_GATHER   Gather = Irp->AssociatedIrp.SystemBuffer;
+    PULONG                  Count = Irp->AssociatedIrp.SystemBuffer;
+    ULONG                   Segments;
+    ULONG                   Index;
+
+    Segments = Gather->Count;
+
+    for (Index = 0; Index < Segments; Index++) {
+        ULONG   Length;
+
+        Length = __min(Gather->Segment[Index].Length, Written);
+        Written -= Length;
+
+        Count[Index] = Length;
+    }
+
+    Irp->IoStatus.Information = Segments * sizeof (ULONG);
+}
+
+static FORCEINLINE BOOLEAN
+__RingIsRecordRead(
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    return (StackLocation->MajorFunction == IRP_MJ_DEVICE_CONTROL &&
+            StackLocation->Parameters.DeviceIoControl.IoControlCode ==
+            IOCTL_XENCONS_READ_RECORDS) ?
+           TRUE :
+           FALSE;
+}
+
+// Must be called with ReadLock held. Returns as many chunks from the
+// read buffer as fit, splitting the last if need be.
+static ULONG
+RingRecordGet(
+    IN  PXENCONS_RING   Ring,
+    IN  PCHAR           Data,
+    IN  ULONG           Length
+    )
+{
+    ULONG               Offset;
+    ULONG               Aligned;
+
+    Offset = 0;
+    while (Ring->ChunkProd != Ring->ChunkCons &&
+           Length - Offset > sizeof (XENCONS_RECORD)) {
+        PXENCONS_CHUNK  Chunk;
+        PXENCONS_RECORD Record;
+
+        Chunk = &Ring->Chunk[Ring->ChunkCons & (Ring->ChunkCount - 1)];
+        Record = (PXENCONS_RECORD)(Data + Offset);
+
+        Record->Timestamp = Chunk->Timestamp;
+        Record->Sequence = Chunk->Sequence;
+        Record->Reserved = 0;
+
+        // This consumes (some of) the chunk
+        Record->Length = RingReadBufferTake(Ring,
+                                            (PCHAR)(Record + 1),
+                                            __min(Chunk->Length,
+                                                  Length - Offset -
+                                                  sizeof (XENCONS_RECORD)));
+
+        Offset += sizeof (XENCONS_RECORD) + Record->Length;
+
+        // The padding goes back to the caller too, so it must not
+        // carry whatever was in the system buffer
+        Aligned = (Offset + XENCONS_RECORD_ALIGNMENT - 1) &
+                  ~(XENCONS_RECORD_ALIGNMENT - 1);
+        Aligned = __min(Aligned, Length);
+
+        RtlZeroMemory(Data + Offset, Aligned - Offset);
+        Offset = Aligned;
+    }
+
+    return Offset;
+}
+
+// Reads and writes arrive either as IRP_MJ_READ/WRITE, with the data
+// in a system buffer, or as device controls. For the direct I/O ones
+// the MDL describes the caller's own pages and data moves straight
+// between them and the shared ring.
+static NTSTATUS
+RingGetBuffer(
+    IN  PIRP            Irp,
+    OUT PCHAR           *Buffer,
+    OUT PULONG          Length
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    switch (StackLocation->MajorFunction) {
+    case IRP_MJ_READ:
+        *Length = StackLocation->Parameters.Read.Length;
+        *Buffer = Irp->AssociatedIrp.SystemBuffer;
+        break;
+
+    case IRP_MJ_WRITE:
+        *Length = StackLocation->Parameters.Write.Length;
+        *Buffer = Irp->AssociatedIrp.SystemBuffer;
+        break;
+
+    case IRP_MJ_DEVICE_CONTROL:
+        status = STATUS_INVALID_PARAMETER;
+        if (StackLocation->Parameters.DeviceIoControl.InputBufferLength != 0)
+            goto fail1;
+
+        *Length = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+        *Buffer = NULL;
+
+        if (METHOD_FROM_CTL_CODE(StackLocation->Parameters.DeviceIoControl.IoControlCode) ==
+            METHOD_BUFFERED) {
+            *Buffer = Irp->AssociatedIrp.SystemBuffer;
+            break;
+        }
+
+        if (*Length == 0)
+            break;
+
+        // The mapping is cached in the MDL so this only fails the
+        // first time
+        *Buffer = MmGetSystemAddressForMdlSafe(Irp->MdlAddress,
+                                               NormalPagePriority);
+
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        if (*Buffer == NULL)
+            goto fail2;
+
+        break;
+
+    default:
+        ASSERT(FALSE);
+        status = STATUS_NOT_SUPPORTED;
+        goto fail1;
+    }
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Queued IRPs keep per-request state in the driver context slots that
+// the CSQ leaves free. Reads note when they were issued and when they
+// last received input (in ms of interrupt time).
+#define XENCONS_READ_ISSUED     0
+#define XENCONS_READ_INPUT      1
+
+static FORCEINLINE ULONG
+__RingGetIrpValue(
+    IN  PIRP    Irp,
+    IN  ULONG   Index
+    )
+{
+    return (ULONG)(ULONG_PTR)Irp->Tail.Overlay.DriverContext[Index];
+}
+
+static FORCEINLINE VOID
+__RingSetIrpValue(
+    IN  PIRP    Irp,
+    IN  ULONG   Index,
+    IN  ULONG   Value
+    )
+{
+    Irp->Tail.Overlay.DriverContext[Index] = (PVOID)(ULONG_PTR)Value;
+}
+
+static FORCEINLINE ULONG
+__RingNow(
+    VOID
+    )
+{
+    return (ULONG)(KeQueryInterruptTime() / 10000);
+}
+
+// Must be called with ReadLock held. The shared ring may only be
+// touched while the ring is enabled but anything already read ahead
+// can always be returned.
+static ULONG
+RingReadData(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PIRP                    Irp,
+    IN  PCHAR                   Data,
+    IN  ULONG                   Length
+    )
+{
+    // Records must go via the read buffer to be stamped
+    if (__RingIsRecordRead(Irp)) {
+        if (Ring->Enabled)
+            RingReadBufferFill(Ring);
+
+        return RingRecordGet(Ring, Data, Length);
+    }
+
+    if (Handle->Broadcast != NULL) {
+        if (Ring->Enabled)
+            RingBroadcastFill(Ring);
+
+        return RingBroadcastGet(Ring, Handle, Data, Length);
+    }
+
+    return (Ring->Enabled) ?
+           RingReadBufferGet(Ring, Data, Length) :
+           RingReadBufferTake(Ring, Data, Length);
+}
+
+// Must be called with ReadLock held, once any new input has been added
+// to the IRP. Returns TRUE if the read should be completed, otherwise
+// *Wait is the number of ms until a timeout might complete it, or 0.
+static BOOLEAN
+RingReadPolicyCheck(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PIRP                    Irp,
+    IN  ULONG                   Length,
+    OUT PULONG                  Wait
+    )
+{
+    PXENCONS_READ_POLICY        Policy = &Handle->Policy;
+    ULONG                       Minimum;
+    ULONG                       Read;
+    ULONG                       Now;
+    ULONG                       Elapsed;
+
+    *Wait = 0;
+
+    // As with VMIN = 0 and VTIME > 0, a read with no minimum but an
+    // overall timeout waits for its first byte
+    Minimum = Policy->Minimum;
+    if (Minimum == 0 && Policy->Timeout != 0)
+        Minimum = 1;
+
+    Read = (ULONG)Irp->IoStatus.Information;
+    if (Read >= __min(Minimum, Length))
+        return TRUE;
+
+    Now = __RingNow();
+
+    if (Policy->Timeout != 0) {
+        Elapsed = Now - __RingGetIrpValue(Irp, XENCONS_READ_ISSUED);
+        if (Elapsed >= Policy->Timeout)
+            goto timeout;
+
+        *Wait = Policy->Timeout - Elapsed;
+    }
+
+    // The inter-byte timer only starts with the first byte
+    if (Policy->InterByteTimeout != 0 && Read != 0) {
+        Elapsed = Now - __RingGetIrpValue(Irp, XENCONS_READ_INPUT);
+        if (Elapsed >= Policy->InterByteTimeout)
+            goto timeout;
+
+        if (*Wait == 0 || Policy->InterByteTimeout - Elapsed < *Wait)
+            *Wait = Policy->InterByteTimeout - Elapsed;
+    }
+
+    return FALSE;
+
+timeout:
+    Ring->ReadsTimedOut++;
+    return TRUE;
+}
+
+// Makes sure that RingDpc runs within Wait ms, for a held request that
+// may then time out. A poll that finds nothing to complete is harmless
+// so the timer is never cancelled early. The caller must hold whichever
+// lock covers Deadline.
+static VOID
+RingTimerSet(
+    IN  PKTIMER         Timer,
+    IN  PKDPC           Dpc,
+    IN  PULONGLONG      Deadline,
+    IN  ULONG           Wait
+    )
+{
+    ULONGLONG           Now;
+    LARGE_INTEGER       Timeout;
+
+    if (Wait == 0)
+        return;
+
+    Now = KeQueryInterruptTime();
+
+    if (*Deadline > Now && *Deadline <= Now + (ULONGLONG)Wait * 10000)
+        return;
+
+    *Deadline = Now + (ULONGLONG)Wait * 10000;
+
+    Timeout.QuadPart = -(LONGLONG)Wait * 10000;
+
+    (VOID) KeSetTimer(Timer, Timeout, Dpc);
+}
+
+// Must be called with ReadLock held. Held reads are not timed while
+// the ring is disabled; RingEnable polls them again.
+static FORCEINLINE VOID
+__RingReadTimerSet(
+    IN  PXENCONS_RING   Ring,
+    IN  ULONG           Wait
+    )
+{
+    if (!Ring->Enabled)
+        return;
+
+    RingTimerSet(&Ring->ReadTimer,
+                 &Ring->ReadTimerDpc,
+                 &Ring->ReadDeadline,
+                 Wait);
+}
+
+// Must be called with ReadLock held
+static FORCEINLINE VOID
+__RingReadComplete(
+    IN  PXENCONS_RING   Ring,
+    IN  PIRP            Irp
+    )
+{
+    Ring->ReadCompletions++;
+    Ring->ReadCompletionBytes += Irp->IoStatus.Information;
+}
+
+static NTSTATUS
+RingPutRead(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PIRP                    Irp
+    )
+{
+    ULONG               Length;
+    PCHAR               Buffer;
+    ULONG               Now;
+    ULONG               Wait;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    status = RingGetBuffer(Irp, &Buffer, &Length);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    // Information counts the input held by the read until it completes
+    Irp->IoStatus.Information = 0;
+
+    Now = __RingNow();
+    __RingSetIrpValue(Irp, XENCONS_READ_ISSUED, Now);
+    __RingSetIrpValue(Irp, XENCONS_READ_INPUT, Now);
+
+    KeAcquireSpinLock(&Ring->ReadLock, &Irql);
+
+    // RingCleanup() cancels whatever is queued once Closing is set
+    status = STATUS_FILE_CLOSED;
+    if (Handle->Closing)
+        goto fail2;
+
+    // Reads must not overtake any that are already queued
+    if (!__RingQueueIsEmpty(&Handle->Read))
+        goto queue;
+
+    Irp->IoStatus.Information = RingReadData(Ring,
+                                             Handle,
+                                             Irp,
+                                             Buffer,
+                                             Length);
+
+    if (!RingReadPolicyCheck(Ring, Handle, Irp, Length, &Wait)) {
+        __RingReadTimerSet(Ring, Wait);
+        goto queue;
+    }
+
+    Ring->ReadsFast++;
+    __RingReadComplete(Ring, Irp);
+
+    RingNotify(Ring, FALSE);
+
+    KeReleaseSpinLock(&Ring->ReadLock, Irql);
+
+    Trace("COMPLETE (READ) (%u bytes inline)\n",
+          Irp->IoStatus.Information);
+
+    return STATUS_SUCCESS;
+
+queue:
+    status = IoCsqInsertIrpEx(&Handle->Read.Csq,
+                              Irp,
+                              NULL,
+                              (PVOID)FALSE);
+    if (status == STATUS_PENDING)
+        Ring->ReadsQueued++;
+
+    // Anything already taken must be accounted for
+    RingNotify(Ring, FALSE);
+
+    KeReleaseSpinLock(&Ring->ReadLock, Irql);
+
+    return status;
+
+fail2:
+    Error("fail2\n");
+
+    KeReleaseSpinLock(&Ring->ReadLock, Irql);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+RingPutWrite(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PIRP                    Irp
+    )
+{
+    ULONG               Length;
+    PCHAR               Buffer;
+    ULONG               Written;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    status = RingGetBuffer(Irp, &Buffer, &Length);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    KeAcquireSpinLock(&Ring->WriteLock, &Irql);
+
+    // RingCleanup() cancels whatever is queued once Closing is set
+    status = STATUS_FILE_CLOSED;
+    if (Handle->Closing)
+        goto fail2;
+
+    // Writes must not overtake any that are already queued
+    if (!__RingQueueIsEmpty(&Handle->Write))
+        goto queue;
+
+    // With nothing buffered the data can go straight into the shared
+    // ring and only the remainder needs to be buffered
+    Written = 0;
+    if (Ring->Enabled && __RingBufferUsed(&Ring->WriteBuffer) == 0) {
+        Written = RingCopyToWrite(Ring, Buffer, Length);
+        Ring->BytesWritten += Written;
+
+        if (Written == Length) {
+            Ring->WritesFast++;
+            goto done;
+        }
+    }
+
+    if (RingWriteBufferPut(Ring, Buffer + Written, Length - Written)) {
+        Written = Length;
+
+        KeInsertQueueDpc(&Ring->Dpc, NULL, NULL);
+        goto done;
+    }
+
+    // As in RingPoll, a partial write is completed rather than queued
+    if (Written != 0) {
+        Ring->WritesFast++;
+        goto done;
+    }
+
+queue:
+    status = IoCsqInsertIrpEx(&Handle->Write.Csq,
+                              Irp,
+                              NULL,
+                              (PVOID)FALSE);
+    if (status == STATUS_PENDING)
+        Ring->WritesQueued++;
+
+    KeReleaseSpinLock(&Ring->WriteLock, Irql);
+
+    return status;
+
+done:
+    RingNotify(Ring, FALSE);
+
+    KeReleaseSpinLock(&Ring->WriteLock, Irql);
+
+    Irp->IoStatus.Information = Written;
+
+    Trace("COMPLETE (WRITE) (%u bytes inline)\n",
+          Irp->IoStatus.Information);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    KeReleaseSpinLock(&Ring->WriteLock, Irql);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+RingPutGather(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PIRP                    Irp
+    )
+{
+    ULONG               Length;
+    ULONG               Written;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    status = RingGatherValidate(Irp, &Length);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    KeAcquireSpinLock(&Ring->WriteLock, &Irql);
+
+    // RingCleanup() cancels whatever is queued once Closing is set
+    status = STATUS_FILE_CLOSED;
+    if (Handle->Closing)
+        goto fail2;
+
+    // Writes must not overtake any that are already queued
+    if (!__RingQueueIsEmpty(&Handle->Write))
+        goto queue;
+
+    Written = RingWriteGather(Ring, Irp);
+    if (Written == 0 && Length != 0)
+        goto queue;
+
+    if (__RingBufferUsed(&Ring->WriteBuffer) != 0)
+        KeInsertQueueDpc(&Ring->Dpc, NULL, NULL);
+
+    Ring->WritesGathered++;
+
+    RingNotify(Ring, FALSE);
+
+    KeReleaseSpinLock(&Ring->WriteLock, Irql);
+
+    RingGatherComplete(Irp, Written);
+
+    Trace("COMPLETE (GATHER) (%u bytes inline)\n", Written);
+
+    return STATUS_SUCCESS;
+
+queue:
+    status = IoCsqInsertIrpEx(&Handle->Write.Csq,
+                              Irp,
+                              NULL,
+                              (PVOID)FALSE);
+    if (status == STATUS_PENDING)
+        Ring->WritesQueued++;
+
+    KeReleaseSpinLock(&Ring->WriteLock, Irql);
+
+    return status;
+
+fail2:
+    Error("fail2\n");
+
+    KeReleaseSpinLock(&Ring->WriteLock, Irql);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+RingPutRecords(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PIRP                    Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               OutputBufferLength;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    OutputBufferLength = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+
+    status = STATUS_NOT_SUPPORTED;
+    if (Ring->Chunk == NULL)
+        goto fail1;
+
+    status = STATUS_BUFFER_TOO_SMALL;
+    if (OutputBufferLength <= sizeof (XENCONS_RECORD))
+        goto fail2;
+
+    // Subscribers see input via the broadcast buffer, which is not
+    // stamped
+    status = STATUS_INVALID_DEVICE_STATE;
+    if (Handle->Broadcast != NULL)
+        goto fail3;
+
+    return RingPutRead(Ring, Handle, Irp);
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Flushes note the position in the output stream that the backend must
+// reach, the connection epoch that position belongs to (0 if it has not
+// yet been taken) and when they were issued. The issue time is the
+// full 64-bit interrupt time, split between the last free slot and
+// IoStatus.Information, which a flush does not use until it completes.
+#define XENCONS_FLUSH_TARGET    0
+#define XENCONS_FLUSH_EPOCH     1
+#define XENCONS_FLUSH_ISSUED    2
+
+static FORCEINLINE VOID
+__RingFlushSetIssued(
+    IN  PIRP    Irp
+    )
+{
+    ULONGLONG   Now = KeQueryInterruptTime();
+
+    __RingSetIrpValue(Irp, XENCONS_FLUSH_ISSUED, (ULONG)Now);
+    Irp->IoStatus.Information = (ULONG_PTR)(ULONG)(Now >> 32);
+}
+
+// Returns the time since the flush was issued, in us
+static FORCEINLINE ULONGLONG
+__RingFlushElapsed(
+    IN  PIRP    Irp
+    )
+{
+    ULONGLONG   Issued;
+
+    Issued = ((ULONGLONG)(ULONG)Irp->IoStatus.Information << 32) |
+             __RingGetIrpValue(Irp, XENCONS_FLUSH_ISSUED);
+
+    return (KeQueryInterruptTime() - Issued) / 10;
+}
+
+static FORCEINLINE ULONG
+__RingFlushTimeout(
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    return (StackLocation->MajorFunction == IRP_MJ_DEVICE_CONTROL) ?
+           *(PULONG)Irp->AssociatedIrp.SystemBuffer :
+           0;
+}
+
+// Must be called with WriteLock held. A flush is complete once the
+// backend has consumed everything written on the handle before it.
+// Where that ends is only known once the handle has no writes queued,
+// and is a position in the shared ring so has to be taken again if the
+// ring is reconnected. Returns STATUS_PENDING if the flush should be
+// held, in which case *Wait is the number of ms until it times out (or
+// 0).
+static NTSTATUS
+RingFlushCheck(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PIRP                    Irp,
+    OUT PULONG                  Wait
+    )
+{
+    ULONG                       Timeout;
+    ULONGLONG                   Elapsed;
+
+    *Wait = 0;
+
+    if (Ring->Enabled) {
+        if (__RingGetIrpValue(Irp, XENCONS_FLUSH_EPOCH) != Ring->FlushEpoch &&
+            __RingQueueIsEmpty(&Handle->Write)) {
+            __RingSetIrpValue(Irp,
+                              XENCONS_FLUSH_TARGET,
+                              SpscProduced(&Ring->Out) +
+                              __RingBufferUsed(&Ring->WriteBuffer));
+            __RingSetIrpValue(Irp, XENCONS_FLUSH_EPOCH, Ring->FlushEpoch);
+        }
+
+        if (__RingGetIrpValue(Irp, XENCONS_FLUSH_EPOCH) == Ring->FlushEpoch &&
+            (LONG)(SpscConsumed(&Ring->Out) -
+                   __RingGetIrpValue(Irp, XENCONS_FLUSH_TARGET)) >= 0)
+            return STATUS_SUCCESS;
+    }
+
+    Timeout = __RingFlushTimeout(Irp);
+    if (Timeout == 0)
+        return STATUS_PENDING;
+
+    Elapsed = __RingFlushElapsed(Irp) / 1000;
+    if (Elapsed >= Timeout)
+        return STATUS_IO_TIMEOUT;
+
+    *Wait = Timeout - (ULONG)Elapsed;
+    return STATUS_PENDING;
+}
+
+// Must be called with WriteLock held. Held flushes are not timed while
+// the ring is disabled; RingEnable polls them again.
+static FORCEINLINE VOID
+__RingFlushTimerSet(
+    IN  PXENCONS_RING   Ring,
+    IN  ULONG           Wait
+    )
+{
+    if (!Ring->Enabled)
+        return;
+
+    RingTimerSet(&Ring->FlushTimer,
+                 &Ring->FlushTimerDpc,
+                 &Ring->FlushDeadline,
+                 Wait);
+}
+
+// Must be called with WriteLock held
+static VOID
+RingFlushComplete(
+    IN  PXENCONS_RING   Ring,
+    IN  PIRP            Irp,
+    IN  NTSTATUS        status
+    )
+{
+    ULONGLONG           Elapsed;
+    ULONG               Bucket;
+
+    if (!NT_SUCCESS(status)) {
+        Ring->FlushesTimedOut++;
+        return;
+    }
+
+    Elapsed = __RingFlushElapsed(Irp) >> XENCONS_FLUSH_BUCKET_SHIFT;
+
+    // Anything beyond the last bucket counts in it
+    Bucket = XENCONS_FLUSH_BUCKETS - 1;
+    if ((Elapsed >> (XENCONS_FLUSH_BUCKETS - 1)) == 0) {
+        ULONG   Index;
+
+        Bucket = 0;
+        if (_BitScanReverse(&Index, (ULONG)Elapsed))
+            Bucket = __min(Index + 1, XENCONS_FLUSH_BUCKETS - 1);
+    }
+
+    Ring->FlushLatency[Bucket]++;
+}
+
+static NTSTATUS
+RingPutFlush(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PIRP                    Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               Wait;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    if (StackLocation->MajorFunction == IRP_MJ_DEVICE_CONTROL) {
+        ULONG   InputBufferLength;
+        ULONG   OutputBufferLength;
+
+        InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+        OutputBufferLength = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+
+        status = STATUS_INVALID_PARAMETER;
+        if (InputBufferLength != sizeof (ULONG) || OutputBufferLength != 0)
+            goto fail1;
+
+        if (*(PULONG)Irp->AssociatedIrp.SystemBuffer >
+            XENCONS_FLUSH_TIMEOUT_MAXIMUM)
+            goto fail2;
+    }
+
+    __RingSetIrpValue(Irp, XENCONS_FLUSH_TARGET, 0);
+    __RingSetIrpValue(Irp, XENCONS_FLUSH_EPOCH, 0);
+    __RingFlushSetIssued(Irp);
+
+    KeAcquireSpinLock(&Ring->WriteLock, &Irql);
+
+    // RingCleanup() cancels whatever is queued once Closing is set
+    status = STATUS_FILE_CLOSED;
+    if (Handle->Closing)
+        goto fail3;
+
+    // Nothing can be consumed until the backend has been told about it
+    RingNotify(Ring, TRUE);
+
+    status = RingFlushCheck(Ring, Handle, Irp, &Wait);
+    if (status == STATUS_PENDING) {
+        __RingFlushTimerSet(Ring, Wait);
+
+        status = IoCsqInsertIrpEx(&Handle->Flush.Csq,
+                                  Irp,
+                                  NULL,
+                                  (PVOID)FALSE);
+        if (status == STATUS_PENDING)
+            Ring->FlushesQueued++;
+
+        KeReleaseSpinLock(&Ring->WriteLock, Irql);
+
+        return status;
+    }
+
+    Ring->FlushesFast++;
+    RingFlushComplete(Ring, Irp, status);
+
+    KeReleaseSpinLock(&Ring->WriteLock, Irql);
+
+    Irp->IoStatus.Information = 0;
+
+    Trace("COMPLETE (FLUSH) (%08x inline)\n", status);
+
+    return status;
+
+fail3:
+    Error("fail3\n");
+
+    KeReleaseSpinLock(&Ring->WriteLock, Irql);
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Must be called with WriteLock held. Completed flushes are moved to
+// List.
+static VOID
+RingFlushPoll(
+    IN  PXENCONS_RING   Ring,
+    IN  PLIST_ENTRY     List
+    )
+{
+    PLIST_ENTRY         ListEntry;
+    BOOLEAN             Held;
+
+    Held = FALSE;
+
+    for (ListEntry = Ring->Handles.Flink;
+         ListEntry != &Ring->Handles;
+         ListEntry = ListEntry->Flink) {
+        PXENCONS_RING_HANDLE    Handle;
+        LIST_ENTRY              Pending;
+
+        Handle = CONTAINING_RECORD(ListEntry,
+                                   XENCONS_RING_HANDLE,
+                                   ListEntry);
+
+        if (__RingQueueIsEmpty(&Handle->Flush))
+            continue;
+
+        InitializeListHead(&Pending);
+
+        for (;;) {
+            PIRP        Irp;
+            ULONG       Wait;
+            NTSTATUS    status;
+
+            Irp = IoCsqRemoveNextIrp(&Handle->Flush.Csq, NULL);
+            if (Irp == NULL)
+                break;
+
+            status = RingFlushCheck(Ring, Handle, Irp, &Wait);
+            if (status == STATUS_PENDING) {
+                __RingFlushTimerSet(Ring, Wait);
+
+                InsertTailList(&Pending, &Irp->Tail.Overlay.ListEntry);
+                Held = TRUE;
+                continue;
+            }
+
+            RingFlushComplete(Ring, Irp, status);
+
+            Irp->IoStatus.Information = 0;
+            Irp->IoStatus.Status = status;
+
+            InsertTailList(List, &Irp->Tail.Overlay.ListEntry);
+        }
+
+        // Put back whatever is still held, in its original order
+        while (!IsListEmpty(&Pending)) {
+            PLIST_ENTRY Entry;
+            PIRP        Irp;
+            NTSTATUS    status;
+
+            Entry = RemoveHeadList(&Pending);
+            Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+
+            status = IoCsqInsertIrpEx(&Handle->Flush.Csq,
+                                      Irp,
+                                      NULL,
+                                      (PVOID)FALSE);
+            ASSERT(status == STATUS_PENDING);
+        }
+    }
+
+    // Coalescing would only delay a held flush
+    if (Held)
+        RingNotify(Ring, TRUE);
+}
+
+static NTSTATUS
+RingSetBroadcast(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PIRP                    Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               InputBufferLength;
+    ULONG               OutputBufferLength;
+    BOOLEAN             Enable;
+    PXENCONS_BROADCAST  Broadcast;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    OutputBufferLength = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (InputBufferLength != sizeof (ULONG) || OutputBufferLength != 0)
+        goto fail1;
+
+    Enable = (*(PULONG)Irp->AssociatedIrp.SystemBuffer != 0) ? TRUE : FALSE;
+
+    status = STATUS_NOT_SUPPORTED;
+    if (Enable && Ring->BroadcastSize == 0)
+        goto fail2;
+
+    // Allocate up front in case this is the first subscriber
+    Broadcast = NULL;
+    if (Enable) {
+        Broadcast = RingBroadcastCreate(Ring->BroadcastSize);
+
+        status = STATUS_NO_MEMORY;
+        if (Broadcast == NULL)
+            goto fail3;
+    }
+
+    KeAcquireSpinLock(&Ring->ReadLock, &Irql);
+
+    // A handle taken off the ring must not pick up a new reference
+    status = STATUS_FILE_CLOSED;
+    if (Handle->Closing)
+        goto fail4;
+
+    // Without a read buffer there is nowhere to hold input for handles
+    // that compete with the subscribers, so either every handle is
+    // subscribed or none is
+    status = STATUS_INVALID_DEVICE_STATE;
+    if (Ring->ReadBuffer.Data == NULL &&
+        ((Enable && Handle->Broadcast == NULL &&
+          Ring->HandleCount > RingBroadcastReferences(Ring) + 1) ||
+         (!Enable && Handle->Broadcast != NULL &&
+          RingBroadcastReferences(Ring) > 1)))
+        goto fail5;
+
+    if (Enable && Handle->Broadcast == NULL)
+        RingBroadcastAttach(Ring, Handle, &Broadcast);
+    else if (!Enable)
+        Broadcast = RingBroadcastDetach(Ring, Handle);
+
+    KeReleaseSpinLock(&Ring->ReadLock, Irql);
+
+    if (Broadcast != NULL)
+        RingBroadcastDestroy(Broadcast);
+
+    Trace("%p: %s\n", Handle->FileObject, (Enable) ? "ON" : "OFF");
+
+    Irp->IoStatus.Information = 0;
+
+    return STATUS_SUCCESS;
+
+fail5:
+    Error("fail5\n");
+
+fail4:
+    Error("fail4\n");
+
+    KeReleaseSpinLock(&Ring->ReadLock, Irql);
+
+    if (Broadcast != NULL)
+        RingBroadcastDestroy(Broadcast);
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+RingSetReadPolicy(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PIRP                    Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               InputBufferLength;
+    ULONG               OutputBufferLength;
+    PXENCONS_READ_POLICY Policy;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    OutputBufferLength = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (InputBufferLength != sizeof (XENCONS_READ_POLICY) ||
+        OutputBufferLength != 0)
+        goto fail1;
+
+    Policy = Irp->AssociatedIrp.SystemBuffer;
+
+    // An inter-byte timeout would never run without a minimum, since
+    // the read completes on its first byte
+    if (Policy->Timeout > XENCONS_READ_TIMEOUT_MAXIMUM ||
+        Policy->InterByteTimeout > XENCONS_READ_TIMEOUT_MAXIMUM ||
+        (Policy->Minimum == 0 && Policy->InterByteTimeout != 0))
+        goto fail2;
+
+    // Reads already queued are judged by the new policy the next time
+    // the ring is polled
+    KeAcquireSpinLock(&Ring->ReadLock, &Irql);
+    Handle->Policy = *Policy;
+    KeReleaseSpinLock(&Ring->ReadLock, Irql);
+
+    // Dpcs only counts those raised by the ring itself
+    if (Ring->Enabled)
+        (VOID) KeInsertQueueDpc(&Ring->Dpc, NULL, NULL);
+
+    Trace("%p: MIN = %u INTER = %ums TOTAL = %ums\n",
+          Handle->FileObject,
+          Policy->Minimum,
+          Policy->InterByteTimeout,
+          Policy->Timeout);
+
+    Irp->IoStatus.Information = 0;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Must be called with ReadLock and WriteLock held
+static ULONG
+RingWaitEvents(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PXENCONS_WAIT           Wait
+    )
+{
+    ULONG                       Available;
+    ULONG                       Used;
+    ULONG                       Space;
+    ULONG                       Events;
+
+    Events = 0;
+
+    if (!Ring->Enabled)
+        Events |= XENCONS_WAIT_DISCONNECTED;
+
+    // Anything still in the shared ring counts, even though it has not
+    // been pulled into the read buffer yet
+    Available = (Ring->Enabled) ? __RingReadAvailable(Ring) : 0;
+
+    if (Handle->Broadcast != NULL)
+        Available += Handle->Broadcast->Prod - Handle->Cursor;
+    else
+        Available += __RingBufferUsed(&Ring->ReadBuffer);
+
+    if (Available != 0)
+        Events |= XENCONS_WAIT_READABLE;
+
+    // Count only what a write could take without pending, as in
+    // RingPutWrite: the buffer takes data up to its high-water mark and
+    // the shared ring is written directly only while the buffer is
+    // empty
+    Used = __RingBufferUsed(&Ring->WriteBuffer);
+    Space = (Ring->WriteBuffer.Data != NULL &&
+             Used < Ring->WriteHighWater) ?
+            Ring->WriteHighWater - Used :
+            0;
+    if (Ring->Enabled && Used == 0)
+        Space += SpscFree(&Ring->Out);
+
+    if (Space >= __max(Wait->WriteSpace, 1))
+        Events |= XENCONS_WAIT_WRITABLE;
+
+    return Events & Wait->Mask;
+}
+
+static NTSTATUS
+RingPutWait(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PIRP                    Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    ULONG               InputBufferLength;
+    ULONG               OutputBufferLength;
+    PXENCONS_WAIT       Wait;
+    ULONG               Events;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    OutputBufferLength = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (InputBufferLength != sizeof (XENCONS_WAIT) ||
+        OutputBufferLength < sizeof (ULONG))
+        goto fail1;
+
+    Wait = Irp->AssociatedIrp.SystemBuffer;
+
+    if (Wait->Mask == 0 || (Wait->Mask & ~XENCONS_WAIT_MASK) != 0)
+        goto fail2;
+
+    // RingWaitPoll holds both locks so no event can be missed between
+    // the check and the insertion
+    KeAcquireSpinLock(&Ring->ReadLock, &Irql);
+    KeAcquireSpinLockAtDpcLevel(&Ring->WriteLock);
+
+    // RingCleanup() cancels whatever is queued once Closing is set
+    status = STATUS_FILE_CLOSED;
+    if (Handle->Closing)
+        goto fail3;
+
+    Events = RingWaitEvents(Ring, Handle, Wait);
+    if (Events == 0) {
+        status = IoCsqInsertIrpEx(&Handle->Wait.Csq,
+                                  Irp,
+                                  NULL,
+                                  (PVOID)FALSE);
+        if (status == STATUS_PENDING)
+            Ring->WaitsQueued++;
+    } else {
+        Ring->WaitsFast++;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+    KeReleaseSpinLock(&Ring->ReadLock, Irql);
+
+    if (Events == 0)
+        return status;
+
+    // The output overlays the input
+    *(PULONG)Irp->AssociatedIrp.SystemBuffer = Events;
+    Irp->IoStatus.Information = sizeof (ULONG);
+
+    Trace("COMPLETE (WAIT) (%08x inline)\n", Events);
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+    KeReleaseSpinLock(&Ring->ReadLock, Irql);
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// Must be called at DISPATCH_LEVEL with no ring locks held
+static VOID
+RingWaitPoll(
     IN  PXENCONS_RING   Ring
     )
 {
+    PLIST_ENTRY         ListEntry;
+    PLIST_ENTRY         NextEntry;
+    LIST_ENTRY          List;
+    LIST_ENTRY          Selected;
     PIRP                Irp;
-    PIO_STACK_LOCATION  StackLocation;
-    ULONG               Length;
-    PCHAR               Buffer;
     NTSTATUS            status;
 
-    for (;;) {
-        ULONG           Read;
+    InitializeListHead(&List);
+    InitializeListHead(&Selected);
 
-        Irp = IoCsqRemoveNextIrp(&Ring->Read.Csq, NULL);
-        if (Irp == NULL)
-            break;
+    KeAcquireSpinLockAtDpcLevel(&Ring->ReadLock);
+    KeAcquireSpinLockAtDpcLevel(&Ring->WriteLock);
 
-        StackLocation = IoGetCurrentIrpStackLocation(Irp);
-        ASSERT(StackLocation->MajorFunction == IRP_MJ_READ);
+    for (ListEntry = Ring->Handles.Flink;
+         ListEntry != &Ring->Handles;
+         ListEntry = ListEntry->Flink) {
+        PXENCONS_RING_HANDLE    Handle;
+        LIST_ENTRY              Pending;
 
-        Length = StackLocation->Parameters.Read.Length;
-        Buffer = Irp->AssociatedIrp.SystemBuffer;
+        Handle = CONTAINING_RECORD(ListEntry,
+                                   XENCONS_RING_HANDLE,
+                                   ListEntry);
 
-        Read = RingCopyFromRead(Ring,
-                                Buffer,
-                                Length);
-        if (Read == 0) {
-            status = IoCsqInsertIrpEx(&Ring->Read.Csq,
+        if (__RingQueueIsEmpty(&Handle->Wait))
+            continue;
+
+        InitializeListHead(&Pending);
+
+        for (;;) {
+            ULONG   Events;
+
+            Irp = IoCsqRemoveNextIrp(&Handle->Wait.Csq, NULL);
+            if (Irp == NULL)
+                break;
+
+            Events = RingWaitEvents(Ring,
+                                    Handle,
+                                    Irp->AssociatedIrp.SystemBuffer);
+            if (Events == 0) {
+                InsertTailList(&Pending, &Irp->Tail.Overlay.ListEntry);
+                continue;
+            }
+
+            *(PULONG)Irp->AssociatedIrp.SystemBuffer = Events;
+            Irp->IoStatus.Information = sizeof (ULONG);
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+
+            InsertTailList(&List, &Irp->Tail.Overlay.ListEntry);
+        }
+
+        // Put back whatever is still waiting, in its original order
+        while (!IsListEmpty(&Pending)) {
+            PLIST_ENTRY Entry;
+
+            Entry = RemoveHeadList(&Pending);
+            Irp = CONTAINING_RECORD(Entry, IRP, Tail.Overlay.ListEntry);
+
+            status = IoCsqInsertIrpEx(&Handle->Wait.Csq,
                                       Irp,
                                       NULL,
-                                      (PVOID)TRUE);
+                                      (PVOID)FALSE);
             ASSERT(status == STATUS_PENDING);
-            break;
         }
+    }
+
+    // Only selects waiting on this ring are looked at. A target stays
+    // on the list until its request is claimed, here or elsewhere.
+    for (ListEntry = Ring->Selects.Flink;
+         ListEntry != &Ring->Selects;
+         ListEntry = NextEntry) {
+        PXENCONS_SELECT_TARGET  Target;
+        PXENCONS_RING_HANDLE    Handle;
+        ULONG                   Events;
+
+        NextEntry = ListEntry->Flink;
+
+        Target = CONTAINING_RECORD(ListEntry,
+                                   XENCONS_SELECT_TARGET,
+                                   ListEntry);
+
+        // A handle that is closing is dealt with by SelectClose()
+        Handle = Target->FileObject->FsContext;
+        if (Handle == NULL)
+            continue;
+
+        Events = RingWaitEvents(Ring, Handle, &Target->Wait);
+        if (Events == 0 || !SelectClaim(Target))
+            continue;
+
+        RemoveEntryList(&Target->ListEntry);
+        Target->Ring = NULL;
+        Target->Events = Events;
+
+        InsertTailList(&Selected, &Target->ListEntry);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+    KeReleaseSpinLockFromDpcLevel(&Ring->ReadLock);
+
+    while (!IsListEmpty(&List)) {
+        ListEntry = RemoveHeadList(&List);
+        ASSERT3P(ListEntry, !=, &List);
+
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        Trace("COMPLETE (WAIT) (%08x)\n",
+              *(PULONG)Irp->AssociatedIrp.SystemBuffer);
+
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+
+    while (!IsListEmpty(&Selected)) {
+        PXENCONS_SELECT_TARGET  Target;
+
+        ListEntry = RemoveHeadList(&Selected);
+        ASSERT3P(ListEntry, !=, &Selected);
+
+        Target = CONTAINING_RECORD(ListEntry,
+                                   XENCONS_SELECT_TARGET,
+                                   ListEntry);
+
+        SelectComplete(Target);
+    }
+}
+
+// A handle that is no longer open on the ring is reported as
+// disconnected. FsContext is only cleared under both ring locks.
+ULONG
+RingGetEvents(
+    IN  PXENCONS_RING           Ring,
+    IN  PFILE_OBJECT            FileObject,
+    IN  PXENCONS_WAIT           Wait
+    )
+{
+    PXENCONS_RING_HANDLE        Handle;
+    ULONG                       Events;
+    KIRQL                       Irql;
+
+    KeAcquireSpinLock(&Ring->ReadLock, &Irql);
+    KeAcquireSpinLockAtDpcLevel(&Ring->WriteLock);
+
+    Handle = FileObject->FsContext;
+    Events = (Handle != NULL) ?
+             RingWaitEvents(Ring, Handle, Wait) :
+             XENCONS_WAIT_DISCONNECTED;
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+    KeReleaseSpinLock(&Ring->ReadLock, Irql);
+
+    return Events;
+}
+
+// Called with the select lock held, at DISPATCH_LEVEL. Puts Target on
+// the ring's select list and evaluates it, unless the handle is no
+// longer open.
+BOOLEAN
+RingSelectLink(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_SELECT_TARGET  Target
+    )
+{
+    PXENCONS_RING_HANDLE        Handle;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+    ASSERT3P(Target->Ring, ==, NULL);
+
+    KeAcquireSpinLockAtDpcLevel(&Ring->ReadLock);
+    KeAcquireSpinLockAtDpcLevel(&Ring->WriteLock);
+
+    Handle = Target->FileObject->FsContext;
+    if (Handle != NULL) {
+        InsertTailList(&Ring->Selects, &Target->ListEntry);
+        Target->Ring = Ring;
+        Target->Events = RingWaitEvents(Ring, Handle, &Target->Wait);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+    KeReleaseSpinLockFromDpcLevel(&Ring->ReadLock);
+
+    return (Handle != NULL) ? TRUE : FALSE;
+}
+
+// Called with the select lock held, at DISPATCH_LEVEL, by the owner of
+// the request. Takes Target off the ring's select list and evaluates
+// it one last time.
+VOID
+RingSelectUnlink(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_SELECT_TARGET  Target
+    )
+{
+    PXENCONS_RING_HANDLE        Handle;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+    ASSERT3P(Target->Ring, ==, Ring);
+
+    KeAcquireSpinLockAtDpcLevel(&Ring->ReadLock);
+    KeAcquireSpinLockAtDpcLevel(&Ring->WriteLock);
+
+    RemoveEntryList(&Target->ListEntry);
+    Target->Ring = NULL;
+
+    Handle = Target->FileObject->FsContext;
+    Target->Events = (Handle != NULL) ?
+                     RingWaitEvents(Ring, Handle, &Target->Wait) :
+                     XENCONS_WAIT_DISCONNECTED;
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+    KeReleaseSpinLockFromDpcLevel(&Ring->ReadLock);
+}
+
+// Called with the select lock held, at DISPATCH_LEVEL, once the handle
+// on FileObject has been taken off the ring. Every target on it is
+// unlinked and reported as disconnected. Those whose request could be
+// claimed are added to List for the caller to complete.
+VOID
+RingSelectDetach(
+    IN  PXENCONS_RING           Ring,
+    IN  PFILE_OBJECT            FileObject,
+    IN  PLIST_ENTRY             List
+    )
+{
+    PLIST_ENTRY                 ListEntry;
+    PLIST_ENTRY                 NextEntry;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+    ASSERT3P(FileObject->FsContext, ==, NULL);
+
+    KeAcquireSpinLockAtDpcLevel(&Ring->ReadLock);
+    KeAcquireSpinLockAtDpcLevel(&Ring->WriteLock);
+
+    for (ListEntry = Ring->Selects.Flink;
+         ListEntry != &Ring->Selects;
+         ListEntry = NextEntry) {
+        PXENCONS_SELECT_TARGET  Target;
+
+        NextEntry = ListEntry->Flink;
+
+        Target = CONTAINING_RECORD(ListEntry,
+                                   XENCONS_SELECT_TARGET,
+                                   ListEntry);
+
+        if (Target->FileObject != FileObject)
+            continue;
+
+        RemoveEntryList(&Target->ListEntry);
+        Target->Ring = NULL;
+        Target->Events = XENCONS_WAIT_DISCONNECTED;
+
+        if (SelectClaim(Target))
+            InsertTailList(List, &Target->ListEntry);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+    KeReleaseSpinLockFromDpcLevel(&Ring->ReadLock);
+}
+
+static NTSTATUS
+RingDeviceControl(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_RING_HANDLE    Handle,
+    IN  PIRP                    Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    switch (StackLocation->Parameters.DeviceIoControl.IoControlCode) {
+    case IOCTL_XENCONS_SET_BROADCAST:
+        status = RingSetBroadcast(Ring, Handle, Irp);
+        break;
+
+    case IOCTL_XENCONS_READ_DIRECT:
+        status = RingPutRead(Ring, Handle, Irp);
+        break;
+
+    case IOCTL_XENCONS_WRITE_DIRECT:
+        status = RingPutWrite(Ring, Handle, Irp);
+        break;
+
+    case IOCTL_XENCONS_WRITE_GATHER:
+        status = RingPutGather(Ring, Handle, Irp);
+        break;
+
+    case IOCTL_XENCONS_READ_RECORDS:
+        status = RingPutRecords(Ring, Handle, Irp);
+        break;
+
+    case IOCTL_XENCONS_SET_READ_POLICY:
+        status = RingSetReadPolicy(Ring, Handle, Irp);
+        break;
+
+    case IOCTL_XENCONS_WAIT:
+        status = RingPutWait(Ring, Handle, Irp);
+        break;
+
+    case IOCTL_XENCONS_FLUSH:
+        status = RingPutFlush(Ring, Handle, Irp);
+        break;
+
+    default:
+        status = STATUS_NOT_SUPPORTED;
+        break;
+    }
+
+    return status;
+}
+
+NTSTATUS
+RingPutQueue(
+    IN  PXENCONS_RING   Ring,
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION      StackLocation;
+    PXENCONS_RING_HANDLE    Handle;
+    NTSTATUS                status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    // This races with RingCleanup() but the handle stays allocated until
+    // RingClose(), and Closing is checked again under the ring lock
+    Handle = StackLocation->FileObject->FsContext;
+
+    status = STATUS_INVALID_HANDLE;
+    if (Handle == NULL)
+        goto fail1;
+
+    switch (StackLocation->MajorFunction) {
+    case IRP_MJ_READ:
+        status = RingPutRead(Ring, Handle, Irp);
+        break;
+
+    case IRP_MJ_WRITE:
+        status = RingPutWrite(Ring, Handle, Irp);
+        break;
+
+    case IRP_MJ_FLUSH_BUFFERS:
+        status = RingPutFlush(Ring, Handle, Irp);
+        break;
+
+    case IRP_MJ_DEVICE_CONTROL:
+        status = RingDeviceControl(Ring, Handle, Irp);
+        break;
+
+    default:
+        ASSERT(FALSE);
+        status = STATUS_NOT_SUPPORTED; // Keep SDV happy
+        break;
+    }
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    if (status == STATUS_PENDING)
+        KeInsertQueueDpc(&Ring->Dpc, NULL, NULL);
+
+    return status;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+// A budget of 0 is unlimited
+static FORCEINLINE BOOLEAN
+__RingBudgetExhausted(
+    IN  PXENCONS_RING   Ring,
+    IN  ULONG           Irps,
+    IN  ULONG           Bytes
+    )
+{
+    return (Ring->BudgetIrps != 0 && Irps >= Ring->BudgetIrps) ||
+           (Ring->BudgetBytes != 0 && Bytes >= Ring->BudgetBytes);
+}
+
+// Returns TRUE if either half of the pass ran out of budget, in which
+// case the caller should come back later rather than loop.
+static BOOLEAN
+RingPoll(
+    IN  PXENCONS_RING   Ring
+    )
+{
+    PXENCONS_RING_HANDLE    Handle;
+    PLIST_ENTRY             ListEntry;
+    PIRP                    Irp;
+    ULONG                   Length;
+    PCHAR                   Buffer;
+    LIST_ENTRY              List;
+    LIST_ENTRY              Flushes;
+    ULONG                   Irps;
+    ULONG                   Bytes;
+    ULONG                   Wait;
+    BOOLEAN                 Progress;
+    BOOLEAN                 Stop;
+    BOOLEAN                 Retry;
+    NTSTATUS                status;
+
+    InitializeListHead(&List);
+    Retry = FALSE;
+
+    KeAcquireSpinLockAtDpcLevel(&Ring->ReadLock);
+
+    // The ring may have been disabled since RingDpc sampled Enabled
+    if (!Ring->Enabled) {
+        KeReleaseSpinLockFromDpcLevel(&Ring->ReadLock);
+        return FALSE;
+    }
+
+    RingReadBufferFill(Ring);
+
+    // Service the handles round-robin, one IRP each per round. A read
+    // that its handle's policy says is not yet complete keeps whatever
+    // it has taken and goes back to the head of its queue.
+    Irps = Bytes = 0;
+    Stop = FALSE;
+    do {
+        Progress = FALSE;
+
+        for (ListEntry = Ring->Handles.Flink;
+             ListEntry != &Ring->Handles && !Stop;
+             ListEntry = ListEntry->Flink) {
+            ULONG           Offset;
+            ULONG           Read;
+
+            Handle = CONTAINING_RECORD(ListEntry,
+                                       XENCONS_RING_HANDLE,
+                                       ListEntry);
+
+            if (__RingBudgetExhausted(Ring, Irps, Bytes)) {
+                Retry = Stop = TRUE;
+                break;
+            }
+
+            Irp = IoCsqRemoveNextIrp(&Handle->Read.Csq, NULL);
+            if (Irp == NULL)
+                continue;
+
+            // Any mapping was made when the IRP was queued
+            status = RingGetBuffer(Irp, &Buffer, &Length);
+            ASSERT(NT_SUCCESS(status));
+
+            Offset = (ULONG)Irp->IoStatus.Information;
+            ASSERT3U(Offset, <=, Length);
+
+            Read = RingReadData(Ring,
+                                Handle,
+                                Irp,
+                                Buffer + Offset,
+                                Length - Offset);
+            if (Read != 0) {
+                Irp->IoStatus.Information += Read;
+                __RingSetIrpValue(Irp, XENCONS_READ_INPUT, __RingNow());
+            }
+
+            Bytes += Read;
+
+            if (!RingReadPolicyCheck(Ring, Handle, Irp, Length, &Wait)) {
+                status = IoCsqInsertIrpEx(&Handle->Read.Csq,
+                                          Irp,
+                                          NULL,
+                                          (PVOID)TRUE);
+                ASSERT(status == STATUS_PENDING);
+
+                __RingReadTimerSet(Ring, Wait);
+                continue;
+            }
+
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+            __RingReadComplete(Ring, Irp);
+
+            InsertTailList(&List, &Irp->Tail.Overlay.ListEntry);
+
+            Irps++;
+            Progress = TRUE;
+        }
+    } while (Progress && !Stop);
+
+    // Pull in whatever the readers left behind so the backend is
+    // never throttled by the size of the shared ring
+    RingReadBufferFill(Ring);
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->ReadLock);
+
+    while (!IsListEmpty(&List)) {
+        PLIST_ENTRY     ListEntry;
+
+        ListEntry = RemoveHeadList(&List);
+        ASSERT3P(ListEntry, !=, &List);
+
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        Trace("COMPLETE (READ) (%u bytes)\n",
+              Irp->IoStatus.Information);
+
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+
+    InitializeListHead(&List);
+
+    KeAcquireSpinLockAtDpcLevel(&Ring->WriteLock);
+
+    // Writes get their own budget so a read flood cannot starve them
+    // The write buffer is always drained first, even if no handle
+    // has a write queued
+    if (Ring->Enabled)
+        RingWriteBufferDrain(Ring);
+
+    Irps = Bytes = 0;
+    Stop = !Ring->Enabled;
+    do {
+        Progress = FALSE;
+
+        for (ListEntry = Ring->Handles.Flink;
+             ListEntry != &Ring->Handles && !Stop;
+             ListEntry = ListEntry->Flink) {
+            ULONG           Written;
+
+            Handle = CONTAINING_RECORD(ListEntry,
+                                       XENCONS_RING_HANDLE,
+                                       ListEntry);
+
+            if (__RingBudgetExhausted(Ring, Irps, Bytes)) {
+                Retry = Stop = TRUE;
+                break;
+            }
+
+            Irp = IoCsqRemoveNextIrp(&Handle->Write.Csq, NULL);
+            if (Irp == NULL)
+                continue;
+
+            RingWriteBufferDrain(Ring);
+
+            if (__RingIsGather(Irp)) {
+                status = RingGatherValidate(Irp, &Length);
+                ASSERT(NT_SUCCESS(status));
+
+                Written = RingWriteGather(Ring, Irp);
+            } else {
+                status = RingGetBuffer(Irp, &Buffer, &Length);
+                ASSERT(NT_SUCCESS(status));
+
+                // Anything already buffered must reach the ring first
+                // so a write may only bypass the buffer once it has
+                // drained
+                if (RingWriteBufferPut(Ring, Buffer, Length)) {
+                    Written = Length;
+                } else if (__RingBufferUsed(&Ring->WriteBuffer) == 0) {
+                    Written = RingCopyToWrite(Ring,
+                                              Buffer,
+                                              Length);
+                    Ring->BytesWritten += Written;
+                } else {
+                    Written = 0;
+                }
+            }
+
+            if (Written == 0 && Length != 0) {
+                // No room for anyone
+                status = IoCsqInsertIrpEx(&Handle->Write.Csq,
+                                          Irp,
+                                          NULL,
+                                          (PVOID)TRUE);
+                ASSERT(status == STATUS_PENDING);
+                Stop = TRUE;
+                break;
+            }
+
+            if (__RingIsGather(Irp)) {
+                RingGatherComplete(Irp, Written);
+                Ring->WritesGathered++;
+            } else {
+                Irp->IoStatus.Information = Written;
+            }
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+
+            InsertTailList(&List, &Irp->Tail.Overlay.ListEntry);
+
+            Irps++;
+            Bytes += Written;
+            Progress = TRUE;
+        }
+    } while (Progress && !Stop);
+
+    // Checked after the writes so that a flush on a handle whose writes
+    // have just gone can take its target straight away
+    InitializeListHead(&Flushes);
+    RingFlushPoll(Ring, &Flushes);
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+
+    while (!IsListEmpty(&List)) {
+        PLIST_ENTRY     ListEntry;
+
+        ListEntry = RemoveHeadList(&List);
+        ASSERT3P(ListEntry, !=, &List);
+
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        Trace("COMPLETE (WRITE) (%u bytes)\n",
+              Irp->IoStatus.Information);
+
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+
+    while (!IsListEmpty(&Flushes)) {
+        PLIST_ENTRY     ListEntry;
+
+        ListEntry = RemoveHeadList(&Flushes);
+        ASSERT3P(ListEntry, !=, &Flushes);
+
+        Irp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+
+        Trace("COMPLETE (FLUSH) (%08x)\n",
+              Irp->IoStatus.Status);
+
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+
+    // Kick the backend once for everything copied in this pass
+    RingNotify(Ring, FALSE);
+
+    RingWaitPoll(Ring);
+
+    if (Retry) {
+        Ring->BudgetExhausted++;
+
+        // Start the next pass with a different handle
+        KeAcquireSpinLockAtDpcLevel(&Ring->ReadLock);
+        KeAcquireSpinLockAtDpcLevel(&Ring->WriteLock);
+        if (!IsListEmpty(&Ring->Handles)) {
+            ListEntry = RemoveHeadList(&Ring->Handles);
+            InsertTailList(&Ring->Handles, ListEntry);
+        }
+        KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+        KeReleaseSpinLockFromDpcLevel(&Ring->ReadLock);
+    }
+
+    return Retry;
+}
+
+// Must be called from RingDpc, holding Unmasking. Returns TRUE if the
+// ring should stay in poll mode, in which case the event channel is
+// left masked and the poll timer has been armed.
+static BOOLEAN
+RingUpdateMode(
+    IN  PXENCONS_RING   Ring
+    )
+{
+    ULONGLONG           Now;
+    ULONG               Activity;
+    LARGE_INTEGER       Timeout;
+
+    if (!Ring->Enabled || Ring->PollEventRate == 0) {
+        Ring->Mode = XENCONS_MODE_INTERRUPT;
+        return FALSE;
+    }
+
+    Now = KeQueryInterruptTime();
 
-        Ring->BytesRead += Read;
+    switch (Ring->Mode) {
+    case XENCONS_MODE_INTERRUPT: {
+        ULONGLONG   Elapsed;
+        ULONGLONG   Rate;
 
-        Irp->IoStatus.Information = Read;
-        Irp->IoStatus.Status = STATUS_SUCCESS;
+        Elapsed = Now - Ring->ModeStart;
+        if (Elapsed < XENCONS_RATE_WINDOW)
+            return FALSE;
 
-        Trace("COMPLETE (READ) (%u bytes)\n",
-              Irp->IoStatus.Information);
+        // Events per second over the last window
+        Rate = ((ULONGLONG)(Ring->Events - Ring->ModeEvents) * 10000000ull) /
+               Elapsed;
 
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-    }
+        Ring->ModeStart = Now;
+        Ring->ModeEvents = Ring->Events;
 
-    for (;;) {
-        ULONG           Written;
+        if (Rate < Ring->PollEventRate)
+            return FALSE;
 
-        Irp = IoCsqRemoveNextIrp(&Ring->Write.Csq, NULL);
-        if (Irp == NULL)
-            break;
+        Ring->Mode = XENCONS_MODE_POLL;
+        Ring->PollActivity = Ring->BytesRead + Ring->BytesWritten;
+        Ring->PollIdle = 0;
+        Ring->PollEntries++;
+        break;
+    }
+    case XENCONS_MODE_POLL:
+        // Drop back to interrupt mode once a number of consecutive
+        // polls have found nothing to move
+        Activity = Ring->BytesRead + Ring->BytesWritten;
+        if (Activity != Ring->PollActivity) {
+            Ring->PollActivity = Activity;
+            Ring->PollIdle = 0;
+        } else if (++Ring->PollIdle >= XENCONS_POLL_IDLE_LIMIT) {
+            Ring->Mode = XENCONS_MODE_INTERRUPT;
+            Ring->ModeStart = Now;
+            Ring->ModeEvents = Ring->Events;
+            Ring->PollExits++;
+            return FALSE;
+        }
+        break;
 
-        StackLocation = IoGetCurrentIrpStackLocation(Irp);
-        ASSERT(StackLocation->MajorFunction == IRP_MJ_WRITE);
+    default:
+        ASSERT(FALSE);
+        return FALSE;
+    }
 
-        Length = StackLocation->Parameters.Write.Length;
-        Buffer = Irp->AssociatedIrp.SystemBuffer;
+    Timeout.QuadPart = -(LONGLONG)Ring->PollInterval * 10;
 
-        Written = RingCopyToWrite(Ring,
-                                  Buffer,
-                                  Length);
-        if (Written == 0) {
-            status = IoCsqInsertIrpEx(&Ring->Write.Csq,
-                                      Irp,
-                                      NULL,
-                                      (PVOID)TRUE);
-            ASSERT(status == STATUS_PENDING);
-            break;
-        }
+    (VOID) KeSetTimer(&Ring->PollTimer,
+                      Timeout,
+                      &Ring->PollDpc);
 
-        Ring->BytesWritten += Written;
+    return TRUE;
+}
 
-        Irp->IoStatus.Information = Written;
-        Irp->IoStatus.Status = STATUS_SUCCESS;
+__drv_functionClass(KDEFERRED_ROUTINE)
+__drv_maxIRQL(DISPATCH_LEVEL)
+__drv_minIRQL(DISPATCH_LEVEL)
+__drv_requiresIRQL(DISPATCH_LEVEL)
+__drv_sameIRQL
+static VOID
+RingPollDpc(
+    IN  PKDPC       Dpc,
+    IN  PVOID       Context,
+    IN  PVOID       Argument1,
+    IN  PVOID       Argument2
+    )
+{
+    PXENCONS_RING   Ring = Context;
 
-        Trace("COMPLETE (WRITE) (%u bytes)\n",
-              Irp->IoStatus.Information);
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
 
-        IoCompleteRequest(Irp, IO_NO_INCREMENT);
-    }
+    ASSERT(Ring != NULL);
 
-    return FALSE;
+    if (KeInsertQueueDpc(&Ring->Dpc, NULL, NULL))
+        Ring->Dpcs++;
 }
 
 __drv_functionClass(KDEFERRED_ROUTINE)
@@ -548,6 +3715,9 @@ RingDpc(
     )
 {
     PXENCONS_RING       Ring = Context;
+    BOOLEAN             Enabled;
+    BOOLEAN             Poll;
+    KIRQL               Irql;
 
     UNREFERENCED_PARAMETER(Dpc);
     UNREFERENCED_PARAMETER(Argument1);
@@ -555,31 +3725,59 @@ RingDpc(
 
     ASSERT(Ring != NULL);
 
-    for (;;) {
-        BOOLEAN Enabled;
-        BOOLEAN Retry;
-        KIRQL   Irql;
+    // Enabled only changes with every ring lock held and RingPoll
+    // re-checks it under those locks, so a lock-free sample is enough
+    Enabled = ReadUCharAcquire((PUCHAR)&Ring->Enabled);
 
-        KeAcquireSpinLock(&Ring->Lock, &Irql);
-        Enabled = Ring->Enabled;
-        KeReleaseSpinLock(&Ring->Lock, Irql);
-
-        if (!Enabled)
-            break;
+    if (Enabled) {
+        BOOLEAN Retry;
 
         KeRaiseIrql(DISPATCH_LEVEL, &Irql);
         Retry = RingPoll(Ring);
         KeLowerIrql(Irql);
 
-        if (!Retry)
-            break;
+        // Out of budget: requeue rather than loop so that other
+        // consoles (and the rest of the system) get a turn. The
+        // channel stays masked until we are done.
+        if (Retry) {
+            if (KeInsertQueueDpc(&Ring->Dpc, NULL, NULL))
+                Ring->Dpcs++;
+
+            return;
+        }
     }
 
+    // Unmasking is only ever tried, never waited for. If another
+    // instance of the DPC holds it then that instance will leave the
+    // channel in the right state. RingDisable clears Enabled and then
+    // waits for Unmasking to drop, so once Enabled has been seen here
+    // the channel stays open until we are done. The section runs at
+    // DISPATCH_LEVEL so a threaded DPC cannot be preempted inside it.
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    if (InterlockedCompareExchange(&Ring->Unmasking, 1, 0) != 0)
+        goto done;
+
+    if (!ReadUCharAcquire((PUCHAR)&Ring->Enabled))
+        goto release;
+
+    // In poll mode the channel stays masked and the poll timer will
+    // bring us back here
+    Poll = RingUpdateMode(Ring);
+    if (Poll)
+        goto release;
+
     (VOID) XENBUS_EVTCHN(Unmask,
                          &Ring->EvtchnInterface,
                          Ring->Channel,
                          FALSE,
                          FALSE);
+
+release:
+    (VOID) InterlockedExchange(&Ring->Unmasking, 0);
+
+done:
+    KeLowerIrql(Irql);
 }
 
 KSERVICE_ROUTINE    RingEvtchnCallback;
@@ -611,6 +3809,7 @@ RingDebugCallback(
     )
 {
     PXENCONS_RING   Ring = Argument;
+    ULONG           Index;
 
     UNREFERENCED_PARAMETER(Crashing);
 
@@ -621,19 +3820,151 @@ RingDebugCallback(
                  (Ring->Enabled) ? "ENABLED" : "DISABLED");
 
     // Dump shared ring
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "SHARED: order = %u in_size = %u out_size = %u\n",
+                 Ring->Order,
+                 Ring->In.Size,
+                 Ring->Out.Size);
+
     XENBUS_DEBUG(Printf,
                  &Ring->DebugInterface,
                  "SHARED: in_cons = %u in_prod = %u out_cons = %u out_prod = %u\n",
-                 Ring->Shared->in_cons,
-                 Ring->Shared->in_prod,
-                 Ring->Shared->out_cons,
-                 Ring->Shared->out_prod);
+                 Ring->Indices->in_cons,
+                 Ring->Indices->in_prod,
+                 Ring->Indices->out_cons,
+                 Ring->Indices->out_prod);
 
     XENBUS_DEBUG(Printf,
                  &Ring->DebugInterface,
-                 "BYTES: read = %u written = %u\n",
+                 "BYTES: read = %u written = %u buffered = %u\n",
                  Ring->BytesRead,
-                 Ring->BytesWritten);
+                 Ring->BytesWritten,
+                 Ring->BytesBuffered);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "READ BUFFER: used = %u size = %u overflow = %s (dropped = %u)\n",
+                 __RingBufferUsed(&Ring->ReadBuffer),
+                 Ring->ReadBuffer.Size,
+                 RingOverflowName(Ring->ReadOverflow),
+                 Ring->BytesDropped);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "WRITE BUFFER: used = %u size = %u high_water = %u (buffered = %u queued = %u)\n",
+                 __RingBufferUsed(&Ring->WriteBuffer),
+                 Ring->WriteBuffer.Size,
+                 Ring->WriteHighWater,
+                 Ring->WritesBuffered,
+                 Ring->WritesQueued);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "HANDLES: %u\n",
+                 Ring->HandleCount);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "CHUNKS: %u/%u sequence = %llu (merged = %u)\n",
+                 Ring->ChunkProd - Ring->ChunkCons,
+                 Ring->ChunkCount,
+                 Ring->ReadSequence,
+                 Ring->ChunksMerged);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "BROADCAST: %s size = %u (dropped = %u)\n",
+                 (Ring->Broadcast != NULL) ? "ACTIVE" : "INACTIVE",
+                 Ring->BroadcastSize,
+                 Ring->BroadcastDropped);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "FAST PATH: reads = %u/%u writes = %u/%u\n",
+                 Ring->ReadsFast,
+                 Ring->ReadsFast + Ring->ReadsQueued,
+                 Ring->WritesFast + Ring->WritesBuffered,
+                 Ring->WritesFast + Ring->WritesBuffered + Ring->WritesQueued);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "READS: completed = %u timed out = %u (%llu bytes/completion)\n",
+                 Ring->ReadCompletions,
+                 Ring->ReadsTimedOut,
+                 (Ring->ReadCompletions != 0) ?
+                 Ring->ReadCompletionBytes / Ring->ReadCompletions :
+                 0ull);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "WAITS: %u/%u\n",
+                 Ring->WaitsFast,
+                 Ring->WaitsFast + Ring->WaitsQueued);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "FLUSH: %u/%u timed out = %u\n",
+                 Ring->FlushesFast,
+                 Ring->FlushesFast + Ring->FlushesQueued,
+                 Ring->FlushesTimedOut);
+
+    for (Index = 0; Index < XENCONS_FLUSH_BUCKETS; Index++) {
+        if (Ring->FlushLatency[Index] == 0)
+            continue;
+
+        XENBUS_DEBUG(Printf,
+                     &Ring->DebugInterface,
+                     "FLUSH LATENCY: %s %u us: %u\n",
+                     (Index < XENCONS_FLUSH_BUCKETS - 1) ? "<" : ">=",
+                     (Index < XENCONS_FLUSH_BUCKETS - 1) ?
+                     1u << (Index + XENCONS_FLUSH_BUCKET_SHIFT) :
+                     1u << (Index - 1 + XENCONS_FLUSH_BUCKET_SHIFT),
+                     Ring->FlushLatency[Index]);
+    }
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "GATHER: writes = %u\n",
+                 Ring->WritesGathered);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "NOTIFY: sent = %u coalesced = %u pending = %u (threshold = %u bytes / %u us)\n",
+                 Ring->Notifies,
+                 Ring->NotifiesCoalesced,
+                 Ring->NotifyPending,
+                 Ring->NotifyBytes,
+                 Ring->NotifyDelay);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "MODE: %s (entries = %u exits = %u threshold = %u events/s interval = %u us)\n",
+                 RingModeName(Ring->Mode),
+                 Ring->PollEntries,
+                 Ring->PollExits,
+                 Ring->PollEventRate,
+                 Ring->PollInterval);
+
+    XENBUS_DEBUG(Printf,
+                 &Ring->DebugInterface,
+                 "BUDGET: %u bytes / %u irps per pass (exhausted = %u)\n",
+                 Ring->BudgetBytes,
+                 Ring->BudgetIrps,
+                 Ring->BudgetExhausted);
+
+    if (Ring->Affinity)
+        XENBUS_DEBUG(Printf,
+                     &Ring->DebugInterface,
+                     "AFFINITY: %s DPC on %u:%u\n",
+                     (Ring->Threaded) ? "THREADED" : "NORMAL",
+                     Ring->ProcessorNumber.Group,
+                     Ring->ProcessorNumber.Number);
+    else
+        XENBUS_DEBUG(Printf,
+                     &Ring->DebugInterface,
+                     "AFFINITY: %s DPC on any processor\n",
+                     (Ring->Threaded) ? "THREADED" : "NORMAL");
 }
 
 NTSTATUS
@@ -644,7 +3975,17 @@ RingEnable(
     Trace("====>\n");
 
     KeAcquireSpinLockAtDpcLevel(&Ring->Lock);
+    KeAcquireSpinLockAtDpcLevel(&Ring->ReadLock);
+    KeAcquireSpinLockAtDpcLevel(&Ring->WriteLock);
+    Ring->Mode = XENCONS_MODE_INTERRUPT;
+    Ring->ModeStart = KeQueryInterruptTime();
+    Ring->ModeEvents = Ring->Events;
+    // Flush targets taken on any previous connection are now stale
+    if (++Ring->FlushEpoch == 0)
+        Ring->FlushEpoch = 1;
     Ring->Enabled = TRUE;
+    KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+    KeReleaseSpinLockFromDpcLevel(&Ring->ReadLock);
     KeReleaseSpinLockFromDpcLevel(&Ring->Lock);
 
     (VOID)KeInsertQueueDpc(&Ring->Dpc, NULL, NULL);
@@ -663,19 +4004,124 @@ RingDisable(
 
     ASSERT3U(KeGetCurrentIrql(), == , DISPATCH_LEVEL);
 
+    // Taking the read and write locks synchronizes with the inline
+    // paths in RingPutQueue, which touch the shared ring directly
     KeAcquireSpinLockAtDpcLevel(&Ring->Lock);
+    KeAcquireSpinLockAtDpcLevel(&Ring->ReadLock);
+    KeAcquireSpinLockAtDpcLevel(&Ring->WriteLock);
     Ring->Enabled = FALSE;
+    KeMemoryBarrier();
+
+    // KeFlushQueuedDpcs() cannot be used at DISPATCH_LEVEL. Instead,
+    // wait out any RingDpc that saw the ring enabled and may still be
+    // about to unmask the channel or re-arm the poll timer. Any later
+    // one sees the ring disabled and leaves both alone.
+    while (ReadAcquire(&Ring->Unmasking) != 0)
+        YieldProcessor();
+
+    Ring->Mode = XENCONS_MODE_INTERRUPT;
+
+    // None of the timers may bring RingDpc back to a channel that is
+    // about to be closed. A timer DPC that is already queued finds the
+    // ring disabled.
+    (VOID) KeCancelTimer(&Ring->PollTimer);
+    (VOID) KeCancelTimer(&Ring->ReadTimer);
+    Ring->ReadDeadline = 0;
+    (VOID) KeCancelTimer(&Ring->FlushTimer);
+    Ring->FlushDeadline = 0;
+
+    KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+    KeReleaseSpinLockFromDpcLevel(&Ring->ReadLock);
     KeReleaseSpinLockFromDpcLevel(&Ring->Lock);
 
+    // Nothing more can be copied now so flush any coalesced
+    // notification while the event channel is still open
+    RingNotify(Ring, TRUE);
+
+    // Let anyone waiting for the disconnect know about it
+    RingWaitPoll(Ring);
+
     Trace("<====\n");
 }
 
+static VOID
+RingSetLayout(
+    IN  PXENCONS_RING   Ring
+    )
+{
+    ULONG               Size;
+    ULONG               Offset;
+
+    Size = PAGE_SIZE << Ring->Order;
+
+    Offset = (Ring->Order == 0) ?
+             (Size / 4) * 3 :
+             Size - sizeof (XENCONS_RING_INDICES);
+
+    Ring->Indices = (PXENCONS_RING_INDICES)(Ring->Shared + Offset);
+
+    // We consume the input ring and produce into the output ring
+    SpscInitialize(&Ring->In,
+                   (PCHAR)Ring->Shared,
+                   Size / 4,
+                   (volatile ULONG *)&Ring->Indices->in_prod,
+                   (volatile ULONG *)&Ring->Indices->in_cons);
+
+    SpscInitialize(&Ring->Out,
+                   (PCHAR)Ring->Shared + Size / 4,
+                   Size / 2,
+                   (volatile ULONG *)&Ring->Indices->out_prod,
+                   (volatile ULONG *)&Ring->Indices->out_cons);
+}
+
+static VOID
+RingClearLayout(
+    IN  PXENCONS_RING   Ring
+    )
+{
+    SpscTeardown(&Ring->Out);
+    SpscTeardown(&Ring->In);
+
+    Ring->Indices = NULL;
+}
+
+static ULONG
+RingGetBackendMaximumOrder(
+    IN  PXENCONS_RING   Ring
+    )
+{
+    PCHAR               Buffer;
+    ULONG               Order;
+    NTSTATUS            status;
+
+    // Backends that do not advertise a maximum only understand the
+    // legacy single page ring
+    status = XENBUS_STORE(Read,
+                          &Ring->StoreInterface,
+                          NULL,
+                          FrontendGetBackendPath(Ring->Frontend),
+                          "max-ring-page-order",
+                          &Buffer);
+    if (!NT_SUCCESS(status)) {
+        Order = 0;
+    } else {
+        Order = (ULONG)strtoul(Buffer, NULL, 10);
+
+        XENBUS_STORE(Free,
+                     &Ring->StoreInterface,
+                     Buffer);
+    }
+
+    return Order;
+}
+
 NTSTATUS
 RingConnect(
     IN  PXENCONS_RING   Ring
     )
 {
     CHAR                Name[MAXNAMELEN];
+    LONG                Index;
     NTSTATUS            status;
 
     Trace("====>\n");
@@ -716,7 +4162,14 @@ RingConnect(
     if (!NT_SUCCESS(status))
         goto fail6;
 
-    Ring->Mdl = __AllocatePage();
+    Ring->Order = __min(Ring->MaximumOrder,
+                        RingGetBackendMaximumOrder(Ring));
+
+    Info("%s: order %u\n",
+         FrontendGetPath(Ring->Frontend),
+         Ring->Order);
+
+    Ring->Mdl = __AllocatePages(1 << Ring->Order);
 
     status = STATUS_NO_MEMORY;
     if (Ring->Mdl == NULL)
@@ -726,16 +4179,20 @@ RingConnect(
     Ring->Shared = Ring->Mdl->MappedSystemVa;
     ASSERT(Ring->Shared != NULL);
 
-    status = XENBUS_GNTTAB(PermitForeignAccess,
-                           &Ring->GnttabInterface,
-                           Ring->GnttabCache,
-                           TRUE,
-                           FrontendGetBackendDomain(Ring->Frontend),
-                           MmGetMdlPfnArray(Ring->Mdl)[0],
-                           FALSE,
-                           &Ring->Entry);
-    if (!NT_SUCCESS(status))
-        goto fail8;
+    RingSetLayout(Ring);
+
+    for (Index = 0; Index < (1 << Ring->Order); Index++) {
+        status = XENBUS_GNTTAB(PermitForeignAccess,
+                               &Ring->GnttabInterface,
+                               Ring->GnttabCache,
+                               TRUE,
+                               FrontendGetBackendDomain(Ring->Frontend),
+                               MmGetMdlPfnArray(Ring->Mdl)[Index],
+                               FALSE,
+                               &Ring->Entry[Index]);
+        if (!NT_SUCCESS(status))
+            goto fail8;
+    }
 
     Ring->Channel = XENBUS_EVTCHN(Open,
                                   &Ring->EvtchnInterface,
@@ -749,6 +4206,21 @@ RingConnect(
     if (Ring->Channel == NULL)
         goto fail9;
 
+    if (Ring->Affinity) {
+        // Not fatal: events are simply delivered wherever Xen chooses
+        status = XENBUS_EVTCHN(Bind,
+                               &Ring->EvtchnInterface,
+                               Ring->Channel,
+                               Ring->ProcessorNumber.Group,
+                               Ring->ProcessorNumber.Number);
+        if (!NT_SUCCESS(status))
+            Warning("%s: failed to bind event channel to %u:%u (%08x)\n",
+                    FrontendGetPath(Ring->Frontend),
+                    Ring->ProcessorNumber.Group,
+                    Ring->ProcessorNumber.Number,
+                    status);
+    }
+
     (VOID)XENBUS_EVTCHN(Unmask,
                         &Ring->EvtchnInterface,
                         Ring->Channel,
@@ -782,25 +4254,33 @@ fail10:
 fail9:
     Error("fail9\n");
 
-    (VOID)XENBUS_GNTTAB(RevokeForeignAccess,
-                        &Ring->GnttabInterface,
-                        Ring->GnttabCache,
-                        TRUE,
-                        Ring->Entry);
-    Ring->Entry = NULL;
+    Index = 1 << Ring->Order;
 
 fail8:
     Error("fail8\n");
 
-    RtlZeroMemory(Ring->Shared, PAGE_SIZE);
+    while (--Index >= 0) {
+        (VOID)XENBUS_GNTTAB(RevokeForeignAccess,
+                            &Ring->GnttabInterface,
+                            Ring->GnttabCache,
+                            TRUE,
+                            Ring->Entry[Index]);
+        Ring->Entry[Index] = NULL;
+    }
+
+    RingClearLayout(Ring);
+
+    RtlZeroMemory(Ring->Shared, PAGE_SIZE << Ring->Order);
 
     Ring->Shared = NULL;
-    __FreePage(Ring->Mdl);
+    __FreePages(Ring->Mdl);
     Ring->Mdl = NULL;
 
 fail7:
     Error("fail7\n");
 
+    Ring->Order = 0;
+
     XENBUS_GNTTAB(DestroyCache,
                   &Ring->GnttabInterface,
                   Ring->GnttabCache);
@@ -835,6 +4315,47 @@ fail1:
     return status;
 }
 
+// Removes whatever ring keys an earlier connection left behind, which
+// may have been at a different order. Keys that do not exist are not
+// an error.
+static VOID
+RingStoreClean(
+    IN  PXENCONS_RING   Ring,
+    IN  PVOID           Transaction
+    )
+{
+    ULONG               Index;
+
+    (VOID) XENBUS_STORE(Remove,
+                        &Ring->StoreInterface,
+                        Transaction,
+                        FrontendGetPath(Ring->Frontend),
+                        "ring-ref");
+
+    (VOID) XENBUS_STORE(Remove,
+                        &Ring->StoreInterface,
+                        Transaction,
+                        FrontendGetPath(Ring->Frontend),
+                        "ring-page-order");
+
+    for (Index = 0; Index < XENCONS_MAXIMUM_RING_PAGES; Index++) {
+        CHAR        Name[MAXNAMELEN];
+        NTSTATUS    status;
+
+        status = RtlStringCbPrintfA(Name,
+                                    sizeof(Name),
+                                    "ring-ref%u",
+                                    Index);
+        ASSERT(NT_SUCCESS(status));
+
+        (VOID) XENBUS_STORE(Remove,
+                            &Ring->StoreInterface,
+                            Transaction,
+                            FrontendGetPath(Ring->Frontend),
+                            Name);
+    }
+}
+
 NTSTATUS
 RingStoreWrite(
     IN  PXENCONS_RING   Ring,
@@ -843,6 +4364,7 @@ RingStoreWrite(
 {
     ULONG               Port;
     ULONG               GrantRef;
+    ULONG               Index;
     NTSTATUS            status;
 
     Port = XENBUS_EVTCHN(GetPort,
@@ -859,22 +4381,72 @@ RingStoreWrite(
     if (!NT_SUCCESS(status))
         goto fail1;
 
-    GrantRef = XENBUS_GNTTAB(GetReference,
-                             &Ring->GnttabInterface,
-                             Ring->Entry);
+    RingStoreClean(Ring, Transaction);
+
+    if (Ring->Order == 0) {
+        GrantRef = XENBUS_GNTTAB(GetReference,
+                                 &Ring->GnttabInterface,
+                                 Ring->Entry[0]);
+
+        status = XENBUS_STORE(Printf,
+                              &Ring->StoreInterface,
+                              Transaction,
+                              FrontendGetPath(Ring->Frontend),
+                              "ring-ref",
+                              "%u",
+                              GrantRef);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+
+        return STATUS_SUCCESS;
+    }
 
     status = XENBUS_STORE(Printf,
                           &Ring->StoreInterface,
                           Transaction,
                           FrontendGetPath(Ring->Frontend),
-                          "ring-ref",
+                          "ring-page-order",
                           "%u",
-                          GrantRef);
+                          Ring->Order);
     if (!NT_SUCCESS(status))
-        goto fail2;
+        goto fail3;
+
+    for (Index = 0; Index < (1ul << Ring->Order); Index++) {
+        CHAR    Name[MAXNAMELEN];
+
+        status = RtlStringCbPrintfA(Name,
+                                    sizeof(Name),
+                                    "ring-ref%u",
+                                    Index);
+        if (!NT_SUCCESS(status))
+            goto fail4;
+
+        GrantRef = XENBUS_GNTTAB(GetReference,
+                                 &Ring->GnttabInterface,
+                                 Ring->Entry[Index]);
+
+        status = XENBUS_STORE(Printf,
+                              &Ring->StoreInterface,
+                              Transaction,
+                              FrontendGetPath(Ring->Frontend),
+                              Name,
+                              "%u",
+                              GrantRef);
+        if (!NT_SUCCESS(status))
+            goto fail5;
+    }
 
     return STATUS_SUCCESS;
 
+fail5:
+    Error("fail5\n");
+
+fail4:
+    Error("fail4\n");
+
+fail3:
+    Error("fail3\n");
+
 fail2:
     Error("fail2\n");
 
@@ -884,14 +4456,57 @@ fail1:
     return status;
 }
 
+// Handles stay open across a disconnect and their reads and writes are
+// still counted while the ring is down, so this is also done when the
+// ring is destroyed.
+static VOID
+RingResetStatistics(
+    IN  PXENCONS_RING   Ring
+    )
+{
+    Ring->Dpcs = 0;
+    Ring->Events = 0;
+    Ring->BytesRead = 0;
+    Ring->BytesWritten = 0;
+    Ring->BytesBuffered = 0;
+    Ring->BytesDropped = 0;
+    Ring->ReadsFast = 0;
+    Ring->ReadsQueued = 0;
+    Ring->ReadsTimedOut = 0;
+    Ring->ReadCompletions = 0;
+    Ring->ReadCompletionBytes = 0;
+    Ring->WaitsFast = 0;
+    Ring->WaitsQueued = 0;
+    Ring->WritesFast = 0;
+    Ring->WritesBuffered = 0;
+    Ring->WritesQueued = 0;
+    Ring->WritesGathered = 0;
+    Ring->FlushesFast = 0;
+    Ring->FlushesQueued = 0;
+    Ring->FlushesTimedOut = 0;
+    RtlZeroMemory(Ring->FlushLatency, sizeof (Ring->FlushLatency));
+    Ring->Notifies = 0;
+    Ring->NotifiesCoalesced = 0;
+    Ring->ModeStart = 0;
+    Ring->ModeEvents = 0;
+    Ring->PollActivity = 0;
+    Ring->PollIdle = 0;
+    Ring->PollEntries = 0;
+    Ring->PollExits = 0;
+    Ring->BudgetExhausted = 0;
+}
+
 VOID
 RingDisconnect(
     IN  PXENCONS_RING   Ring
     )
 {
+    LONG                Index;
+
     Trace("====>\n");
 
     ASSERT(Ring->Connected);
+    ASSERT(!Ring->Enabled);
     Ring->Connected = FALSE;
 
     XENBUS_DEBUG(Deregister,
@@ -899,29 +4514,33 @@ RingDisconnect(
                  Ring->DebugCallback);
     Ring->DebugCallback = NULL;
 
-    Ring->Dpcs = 0;
-    Ring->Events = 0;
-    Ring->BytesRead = 0;
-    Ring->BytesWritten = 0;
+    RingResetStatistics(Ring);
 
     XENBUS_EVTCHN(Close,
                   &Ring->EvtchnInterface,
                   Ring->Channel);
     Ring->Channel = NULL;
 
-    (VOID)XENBUS_GNTTAB(RevokeForeignAccess,
-                        &Ring->GnttabInterface,
-                        Ring->GnttabCache,
-                        TRUE,
-                        Ring->Entry);
-    Ring->Entry = NULL;
+    Index = 1 << Ring->Order;
+    while (--Index >= 0) {
+        (VOID)XENBUS_GNTTAB(RevokeForeignAccess,
+                            &Ring->GnttabInterface,
+                            Ring->GnttabCache,
+                            TRUE,
+                            Ring->Entry[Index]);
+        Ring->Entry[Index] = NULL;
+    }
+
+    RingClearLayout(Ring);
 
-    RtlZeroMemory(Ring->Shared, PAGE_SIZE);
+    RtlZeroMemory(Ring->Shared, PAGE_SIZE << Ring->Order);
 
     Ring->Shared = NULL;
-    __FreePage(Ring->Mdl);
+    __FreePages(Ring->Mdl);
     Ring->Mdl = NULL;
 
+    Ring->Order = 0;
+
     XENBUS_GNTTAB(DestroyCache,
                   &Ring->GnttabInterface,
                   Ring->GnttabCache);
@@ -938,6 +4557,47 @@ RingDisconnect(
     Trace("<====\n");
 }
 
+// Pick the processor that the DPCs and event channel should be bound
+// to: an explicit Processor index takes precedence, otherwise rings are
+// dealt round-robin across the active processors if ProcessorSpread is
+// set. Returns FALSE if the ring should not be bound at all.
+static BOOLEAN
+RingGetProcessor(
+    IN  PXENCONS_RING       Ring,
+    OUT PPROCESSOR_NUMBER   ProcessorNumber
+    )
+{
+    ULONG                   Count;
+    ULONG                   Index;
+    NTSTATUS                status;
+
+    Count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    Index = RingReadParameter(Ring,
+                              "Processor",
+                              XENCONS_PROCESSOR_ANY);
+    if (Index == XENCONS_PROCESSOR_ANY) {
+        if (RingReadParameter(Ring, "ProcessorSpread", 0) == 0)
+            return FALSE;
+
+        Index = (ULONG)InterlockedIncrement(&RingProcessorNext) % Count;
+    }
+
+    if (Index >= Count) {
+        Warning("%s: processor %u out of range (%u active)\n",
+                FrontendGetPath(Ring->Frontend),
+                Index,
+                Count);
+        return FALSE;
+    }
+
+    status = KeGetProcessorNumberFromIndex(Index, ProcessorNumber);
+    if (!NT_SUCCESS(status))
+        return FALSE;
+
+    return TRUE;
+}
+
 NTSTATUS
 RingCreate(
     IN  PXENCONS_FRONTEND   Frontend,
@@ -966,51 +4626,191 @@ RingCreate(
     FdoGetStoreInterface(PdoGetFdo(FrontendGetPdo(Frontend)),
                          &(*Ring)->StoreInterface);
 
+    (*Ring)->MaximumOrder = RingReadParameter(*Ring,
+                                              "RingPageOrder",
+                                              XENCONS_MAXIMUM_RING_PAGE_ORDER);
+    (*Ring)->MaximumOrder = __min((*Ring)->MaximumOrder,
+                                  XENCONS_MAXIMUM_RING_PAGE_ORDER);
+
     KeInitializeSpinLock(&(*Ring)->Lock);
 
-    KeInitializeThreadedDpc(&(*Ring)->Dpc, RingDpc, *Ring);
+    (*Ring)->Threaded = (RingReadParameter(*Ring, "ThreadedDpc", 1) != 0) ?
+                        TRUE :
+                        FALSE;
 
-    KeInitializeSpinLock(&(*Ring)->Read.Lock);
-    InitializeListHead(&(*Ring)->Read.List);
+    if ((*Ring)->Threaded)
+        KeInitializeThreadedDpc(&(*Ring)->Dpc, RingDpc, *Ring);
+    else
+        KeInitializeDpc(&(*Ring)->Dpc, RingDpc, *Ring);
 
-    status = IoCsqInitializeEx(&(*Ring)->Read.Csq,
-                               RingCsqInsertIrpEx,
-                               RingCsqRemoveIrp,
-                               RingCsqPeekNextIrp,
-                               RingCsqAcquireLock,
-                               RingCsqReleaseLock,
-                               RingCsqCompleteCanceledIrp);
+    (*Ring)->Affinity = RingGetProcessor(*Ring, &(*Ring)->ProcessorNumber);
+    if ((*Ring)->Affinity)
+        (VOID) KeSetTargetProcessorDpcEx(&(*Ring)->Dpc,
+                                         &(*Ring)->ProcessorNumber);
+
+    InitializeListHead(&(*Ring)->Handles);
+    InitializeListHead(&(*Ring)->Selects);
+
+    KeInitializeSpinLock(&(*Ring)->ReadLock);
+
+    status = RingBufferCreate(&(*Ring)->ReadBuffer,
+                              RingReadParameterRange(*Ring,
+                                                     "ReadBufferSize",
+                                                     XENCONS_READ_BUFFER_SIZE,
+                                                     XENCONS_BUFFER_SIZE_MINIMUM,
+                                                     XENCONS_BUFFER_SIZE_MAXIMUM));
     if (!NT_SUCCESS(status))
         goto fail2;
 
-    KeInitializeSpinLock(&(*Ring)->Write.Lock);
-    InitializeListHead(&(*Ring)->Write.List);
+    (*Ring)->ReadOverflow = (XENCONS_OVERFLOW)RingReadParameter(*Ring,
+                                                                "ReadBufferOverflow",
+                                                                XENCONS_OVERFLOW_BLOCK);
+    if ((*Ring)->ReadOverflow > XENCONS_OVERFLOW_DROP_NEWEST)
+        (*Ring)->ReadOverflow = XENCONS_OVERFLOW_BLOCK;
+
+    // Record reads need a read buffer to stamp; a count of 0 disables them
+    (*Ring)->ChunkCount = ((*Ring)->ReadBuffer.Data != NULL) ?
+                          RingReadParameterRange(*Ring,
+                                                 "ReadChunkCount",
+                                                 XENCONS_CHUNK_COUNT,
+                                                 1,
+                                                 XENCONS_CHUNK_COUNT_MAXIMUM) :
+                          0;
+    while (((*Ring)->ChunkCount & ((*Ring)->ChunkCount - 1)) != 0)
+        (*Ring)->ChunkCount &= (*Ring)->ChunkCount - 1;
+
+    if ((*Ring)->ChunkCount != 0) {
+        (*Ring)->Chunk = __RingAllocate(sizeof (XENCONS_CHUNK) *
+                                        (*Ring)->ChunkCount);
+
+        status = STATUS_NO_MEMORY;
+        if ((*Ring)->Chunk == NULL)
+            goto fail3;
+    }
 
-    status = IoCsqInitializeEx(&(*Ring)->Write.Csq,
-                               RingCsqInsertIrpEx,
-                               RingCsqRemoveIrp,
-                               RingCsqPeekNextIrp,
-                               RingCsqAcquireLock,
-                               RingCsqReleaseLock,
-                               RingCsqCompleteCanceledIrp);
+    RingClockStart(*Ring);
+
+    // A size of 0 disables broadcast mode
+    (*Ring)->BroadcastSize = RingReadParameterRange(*Ring,
+                                                    "BroadcastBufferSize",
+                                                    XENCONS_BROADCAST_SIZE,
+                                                    XENCONS_BUFFER_SIZE_MINIMUM,
+                                                    XENCONS_BUFFER_SIZE_MAXIMUM);
+    while (((*Ring)->BroadcastSize & ((*Ring)->BroadcastSize - 1)) != 0)
+        (*Ring)->BroadcastSize &= (*Ring)->BroadcastSize - 1;
+
+    KeInitializeSpinLock(&(*Ring)->WriteLock);
+
+    status = RingBufferCreate(&(*Ring)->WriteBuffer,
+                              RingReadParameterRange(*Ring,
+                                                     "WriteBufferSize",
+                                                     XENCONS_WRITE_BUFFER_SIZE,
+                                                     XENCONS_BUFFER_SIZE_MINIMUM,
+                                                     XENCONS_BUFFER_SIZE_MAXIMUM));
     if (!NT_SUCCESS(status))
-        goto fail3;
+        goto fail4;
+
+    (*Ring)->WriteHighWater = RingReadParameter(*Ring,
+                                                "WriteBufferHighWater",
+                                                (*Ring)->WriteBuffer.Size);
+    (*Ring)->WriteHighWater = __min((*Ring)->WriteHighWater,
+                                    (*Ring)->WriteBuffer.Size);
+
+    KeInitializeSpinLock(&(*Ring)->NotifyLock);
+    KeInitializeTimer(&(*Ring)->NotifyTimer);
+    KeInitializeDpc(&(*Ring)->NotifyDpc, RingNotifyDpc, *Ring);
+    if ((*Ring)->Affinity)
+        (VOID) KeSetTargetProcessorDpcEx(&(*Ring)->NotifyDpc,
+                                         &(*Ring)->ProcessorNumber);
+
+    (*Ring)->NotifyBytes = RingReadParameterRange(*Ring,
+                                                  "NotifyCoalesceBytes",
+                                                  0,
+                                                  1,
+                                                  XENCONS_NOTIFY_BYTES_MAXIMUM);
+    (*Ring)->NotifyDelay = RingReadParameterRange(*Ring,
+                                                  "NotifyCoalesceDelay",
+                                                  0,
+                                                  XENCONS_NOTIFY_DELAY_MINIMUM,
+                                                  XENCONS_NOTIFY_DELAY_MAXIMUM);
+
+    KeInitializeTimer(&(*Ring)->PollTimer);
+    KeInitializeDpc(&(*Ring)->PollDpc, RingPollDpc, *Ring);
+    if ((*Ring)->Affinity)
+        (VOID) KeSetTargetProcessorDpcEx(&(*Ring)->PollDpc,
+                                         &(*Ring)->ProcessorNumber);
+
+    // Read and flush timeouts only need to bring RingDpc back round
+    KeInitializeTimer(&(*Ring)->ReadTimer);
+    KeInitializeDpc(&(*Ring)->ReadTimerDpc, RingPollDpc, *Ring);
+    if ((*Ring)->Affinity)
+        (VOID) KeSetTargetProcessorDpcEx(&(*Ring)->ReadTimerDpc,
+                                         &(*Ring)->ProcessorNumber);
+
+    KeInitializeTimer(&(*Ring)->FlushTimer);
+    KeInitializeDpc(&(*Ring)->FlushTimerDpc, RingPollDpc, *Ring);
+    if ((*Ring)->Affinity)
+        (VOID) KeSetTargetProcessorDpcEx(&(*Ring)->FlushTimerDpc,
+                                         &(*Ring)->ProcessorNumber);
+
+    (*Ring)->PollEventRate = RingReadParameterRange(*Ring,
+                                                    "PollEventRate",
+                                                    0,
+                                                    XENCONS_POLL_RATE_MINIMUM,
+                                                    MAXULONG);
+    (*Ring)->PollInterval = RingReadParameterRange(*Ring,
+                                                   "PollInterval",
+                                                   XENCONS_POLL_INTERVAL,
+                                                   XENCONS_POLL_INTERVAL_MINIMUM,
+                                                   XENCONS_POLL_INTERVAL_MAXIMUM);
+    if ((*Ring)->PollInterval == 0)
+        (*Ring)->PollInterval = XENCONS_POLL_INTERVAL;
+
+    (*Ring)->BudgetBytes = RingReadParameterRange(*Ring,
+                                                  "PollByteBudget",
+                                                  XENCONS_BUDGET_BYTES,
+                                                  XENCONS_BUDGET_BYTES_MINIMUM,
+                                                  XENCONS_BUDGET_BYTES_MAXIMUM);
+    (*Ring)->BudgetIrps = RingReadParameterRange(*Ring,
+                                                 "PollIrpBudget",
+                                                 XENCONS_BUDGET_IRPS,
+                                                 XENCONS_BUDGET_IRPS_MINIMUM,
+                                                 XENCONS_BUDGET_IRPS_MAXIMUM);
 
     return STATUS_SUCCESS;
 
+fail4:
+    Error("fail4\n");
+
+    RtlZeroMemory(&(*Ring)->WriteLock, sizeof(KSPIN_LOCK));
+
+    (*Ring)->BroadcastSize = 0;
+
+    RtlZeroMemory(&(*Ring)->ClockFrequency, sizeof (LARGE_INTEGER));
+    RtlZeroMemory(&(*Ring)->ClockCounter, sizeof (LARGE_INTEGER));
+    RtlZeroMemory(&(*Ring)->ClockTime, sizeof (LARGE_INTEGER));
+
+    if ((*Ring)->Chunk != NULL) {
+        __RingFree((*Ring)->Chunk);
+        (*Ring)->Chunk = NULL;
+    }
+
 fail3:
     Error("fail3\n");
 
-    RtlZeroMemory(&(*Ring)->Write.List, sizeof(LIST_ENTRY));
-    RtlZeroMemory(&(*Ring)->Write.Lock, sizeof(KSPIN_LOCK));
+    (*Ring)->ChunkCount = 0;
+
+    (*Ring)->ReadOverflow = XENCONS_OVERFLOW_BLOCK;
 
-    RtlZeroMemory(&(*Ring)->Read.Csq, sizeof(IO_CSQ));
+    RingBufferDestroy(&(*Ring)->ReadBuffer);
 
 fail2:
     Error("fail2\n");
 
-    RtlZeroMemory(&(*Ring)->Read.List, sizeof(LIST_ENTRY));
-    RtlZeroMemory(&(*Ring)->Read.Lock, sizeof(KSPIN_LOCK));
+    RtlZeroMemory(&(*Ring)->ReadLock, sizeof(KSPIN_LOCK));
+
+    RtlZeroMemory(&(*Ring)->Selects, sizeof(LIST_ENTRY));
+    RtlZeroMemory(&(*Ring)->Handles, sizeof(LIST_ENTRY));
 
 fail1:
     Error("fail1 (%08x)\n", status);
@@ -1025,26 +4825,124 @@ RingDestroy(
 {
     ASSERT3U(KeGetCurrentIrql(), == , PASSIVE_LEVEL);
     
-    // Cancel all outstanding IRPs
-    __RingCancelRequests(Ring, NULL);
+    // Cancel all outstanding IRPs on any handle that is still open
+    while (!IsListEmpty(&Ring->Handles)) {
+        PLIST_ENTRY             ListEntry;
+        PXENCONS_RING_HANDLE    Handle;
+        PXENCONS_BROADCAST      Broadcast;
+        KIRQL                   Irql;
+
+        KeAcquireSpinLock(&Ring->ReadLock, &Irql);
+        KeAcquireSpinLockAtDpcLevel(&Ring->WriteLock);
+
+        ListEntry = RemoveHeadList(&Ring->Handles);
+        ASSERT3P(ListEntry, !=, &Ring->Handles);
+
+        Handle = CONTAINING_RECORD(ListEntry,
+                                   XENCONS_RING_HANDLE,
+                                   ListEntry);
+        --Ring->HandleCount;
+        Handle->FileObject->FsContext = NULL;
+        Broadcast = RingBroadcastDetach(Ring, Handle);
+
+        KeReleaseSpinLockFromDpcLevel(&Ring->WriteLock);
+        KeReleaseSpinLock(&Ring->ReadLock, Irql);
+
+        if (Broadcast != NULL)
+            RingBroadcastDestroy(Broadcast);
+
+        SelectClose(Ring, Handle->FileObject);
+
+        RingHandleDestroy(Handle);
+    }
+    ASSERT3U(Ring->HandleCount, ==, 0);
+    ASSERT(IsListEmpty(&Ring->Selects));
+    ASSERT3P(Ring->Broadcast, ==, NULL);
+
+    RingResetStatistics(Ring);
+
+    Ring->BudgetIrps = 0;
+    Ring->BudgetBytes = 0;
+
+    ASSERT3U(Ring->Mode, ==, XENCONS_MODE_INTERRUPT);
+
+    Ring->PollInterval = 0;
+    Ring->PollEventRate = 0;
+
+    (VOID) KeCancelTimer(&Ring->PollTimer);
+
+    (VOID) KeCancelTimer(&Ring->ReadTimer);
+    Ring->ReadDeadline = 0;
+
+    (VOID) KeCancelTimer(&Ring->FlushTimer);
+    Ring->FlushDeadline = 0;
+    Ring->FlushEpoch = 0;
 
-    ASSERT(IsListEmpty(&Ring->Read.List));
-    ASSERT(IsListEmpty(&Ring->Write.List));
+    ASSERT3U(Ring->NotifyPending, ==, 0);
+    Ring->NotifyStart = 0;
 
-    RtlZeroMemory(&Ring->Write.Csq, sizeof(IO_CSQ));
+    Ring->NotifyDelay = 0;
+    Ring->NotifyBytes = 0;
 
-    RtlZeroMemory(&Ring->Write.List, sizeof(LIST_ENTRY));
-    RtlZeroMemory(&Ring->Write.Lock, sizeof(KSPIN_LOCK));
+    (VOID) KeCancelTimer(&Ring->NotifyTimer);
+    KeFlushQueuedDpcs();
 
-    RtlZeroMemory(&Ring->Read.Csq, sizeof(IO_CSQ));
+    RtlZeroMemory(&Ring->FlushTimerDpc, sizeof(KDPC));
+    RtlZeroMemory(&Ring->FlushTimer, sizeof(KTIMER));
 
-    RtlZeroMemory(&Ring->Read.List, sizeof(LIST_ENTRY));
-    RtlZeroMemory(&Ring->Read.Lock, sizeof(KSPIN_LOCK));
+    RtlZeroMemory(&Ring->ReadTimerDpc, sizeof(KDPC));
+    RtlZeroMemory(&Ring->ReadTimer, sizeof(KTIMER));
+
+    RtlZeroMemory(&Ring->PollDpc, sizeof(KDPC));
+    RtlZeroMemory(&Ring->PollTimer, sizeof(KTIMER));
+
+    RtlZeroMemory(&Ring->NotifyDpc, sizeof(KDPC));
+    RtlZeroMemory(&Ring->NotifyTimer, sizeof(KTIMER));
+    RtlZeroMemory(&Ring->NotifyLock, sizeof(KSPIN_LOCK));
+
+    Ring->WriteHighWater = 0;
+
+    RingBufferDestroy(&Ring->WriteBuffer);
+
+    RtlZeroMemory(&Ring->WriteLock, sizeof(KSPIN_LOCK));
+
+    Ring->BroadcastDropped = 0;
+    Ring->BroadcastSize = 0;
+
+    RtlZeroMemory(&Ring->ClockFrequency, sizeof (LARGE_INTEGER));
+    RtlZeroMemory(&Ring->ClockCounter, sizeof (LARGE_INTEGER));
+    RtlZeroMemory(&Ring->ClockTime, sizeof (LARGE_INTEGER));
+
+    if (Ring->Chunk != NULL) {
+        __RingFree(Ring->Chunk);
+        Ring->Chunk = NULL;
+    }
+
+    Ring->ReadSequence = 0;
+    Ring->ChunksMerged = 0;
+    Ring->ChunkCons = 0;
+    Ring->ChunkProd = 0;
+    Ring->ChunkCount = 0;
+
+    Ring->ReadOverflow = XENCONS_OVERFLOW_BLOCK;
+
+    RingBufferDestroy(&Ring->ReadBuffer);
+
+    RtlZeroMemory(&Ring->ReadLock, sizeof(KSPIN_LOCK));
+
+    RtlZeroMemory(&Ring->Selects, sizeof(LIST_ENTRY));
+    RtlZeroMemory(&Ring->Handles, sizeof(LIST_ENTRY));
 
     RtlZeroMemory(&Ring->Dpc, sizeof(KDPC));
 
+    RtlZeroMemory(&Ring->ProcessorNumber, sizeof(PROCESSOR_NUMBER));
+    Ring->Affinity = FALSE;
+    Ring->Threaded = FALSE;
+
     RtlZeroMemory(&Ring->Lock, sizeof(KSPIN_LOCK));
 
+    Ring->MaximumOrder = 0;
+
     RtlZeroMemory(&Ring->StoreInterface,
                   sizeof(XENBUS_STORE_INTERFACE));
 
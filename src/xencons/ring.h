@@ -33,10 +33,10 @@
 #define _XENCONS_RING_H
 
 #include <ntddk.h>
+#include <xencons_device.h>
 
 #include "frontend.h"
-
-typedef struct _XENCONS_RING XENCONS_RING, *PXENCONS_RING;
+#include "select.h"
 
 extern NTSTATUS
 RingCreate(
@@ -81,6 +81,12 @@ RingOpen(
     IN  PFILE_OBJECT    FileObject
     );
 
+extern NTSTATUS
+RingCleanup(
+    IN  PXENCONS_RING   Ring,
+    IN  PFILE_OBJECT    FileObject
+    );
+
 extern NTSTATUS
 RingClose(
     IN  PXENCONS_RING   Ring,
@@ -93,4 +99,30 @@ RingPutQueue(
     IN  PIRP            Irp
     );
 
+extern ULONG
+RingGetEvents(
+    IN  PXENCONS_RING   Ring,
+    IN  PFILE_OBJECT    FileObject,
+    IN  PXENCONS_WAIT   Wait
+    );
+
+extern BOOLEAN
+RingSelectLink(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_SELECT_TARGET  Target
+    );
+
+extern VOID
+RingSelectUnlink(
+    IN  PXENCONS_RING           Ring,
+    IN  PXENCONS_SELECT_TARGET  Target
+    );
+
+extern VOID
+RingSelectDetach(
+    IN  PXENCONS_RING           Ring,
+    IN  PFILE_OBJECT            FileObject,
+    IN  PLIST_ENTRY             List
+    );
+
 #endif  // _XENCONS_RING_H
@@ -0,0 +1,621 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <xencons_device.h>
+
+#include "driver.h"
+#include "pdo.h"
+#include "ring.h"
+#include "select.h"
+#include "dbg_print.h"
+#include "assert.h"
+#include "util.h"
+
+#define SELECT_POOL 'CLES'
+
+// Per-request state, hung off DriverContext[0]. The CSQ uses the last
+// slot. The IRP and SelectPut each hold a reference. Done is set, with
+// Lock held, once every target has been unlinked for completion.
+typedef struct _XENCONS_SELECT_REQUEST {
+    IO_CSQ_IRP_CONTEXT      Context;
+    PIRP                    Irp;
+    LONG                    References;
+    BOOLEAN                 Done;
+    ULONG                   Count;
+    XENCONS_SELECT_TARGET   Target[1];
+} XENCONS_SELECT_REQUEST, *PXENCONS_SELECT_REQUEST;
+
+// A request is claimed for completion by removing its IRP from the
+// queue, which can only succeed once. Rings claim requests from their
+// own select lists without taking Lock; Lock is only taken to unlink a
+// claimed request from its other rings, and is always taken before any
+// ring lock. Requests counts live requests.
+typedef struct _XENCONS_SELECTOR {
+    KSPIN_LOCK      Lock;
+    IO_CSQ          Csq;
+    KSPIN_LOCK      QueueLock;
+    LIST_ENTRY      List;
+    LONG            Requests;
+} XENCONS_SELECTOR, *PXENCONS_SELECTOR;
+
+static XENCONS_SELECTOR Selector;
+
+static FORCEINLINE PVOID
+__SelectAllocate(
+    IN  ULONG   Length
+    )
+{
+    return __AllocatePoolWithTag(NonPagedPool, Length, SELECT_POOL);
+}
+
+static FORCEINLINE VOID
+__SelectFree(
+    IN  PVOID   Buffer
+    )
+{
+    __FreePoolWithTag(Buffer, SELECT_POOL);
+}
+
+static FORCEINLINE PXENCONS_SELECT_REQUEST
+__SelectGetRequest(
+    IN  PIRP    Irp
+    )
+{
+    return Irp->Tail.Overlay.DriverContext[0];
+}
+
+static FORCEINLINE VOID
+__SelectSetRequest(
+    IN  PIRP                    Irp,
+    IN  PXENCONS_SELECT_REQUEST Request
+    )
+{
+    Irp->Tail.Overlay.DriverContext[0] = Request;
+}
+
+static VOID
+SelectRequestRelease(
+    IN  PXENCONS_SELECT_REQUEST Request
+    )
+{
+    ULONG                       Index;
+
+    ASSERT(Request->References != 0);
+    if (InterlockedDecrement(&Request->References) != 0)
+        return;
+
+    for (Index = 0; Index < Request->Count; Index++) {
+        PXENCONS_SELECT_TARGET  Target = &Request->Target[Index];
+
+        ASSERT3P(Target->Ring, ==, NULL);
+        ObDereferenceObject(Target->FileObject);
+    }
+
+    __SelectFree(Request);
+
+    ASSERT(Selector.Requests != 0);
+    (VOID) InterlockedDecrement(&Selector.Requests);
+}
+
+// Must be called with Lock held, by whoever claimed the request. Every
+// target still on a ring is unlinked and evaluated one last time.
+static VOID
+SelectRequestFinish(
+    IN  PXENCONS_SELECT_REQUEST Request
+    )
+{
+    ULONG                       Index;
+
+    for (Index = 0; Index < Request->Count; Index++) {
+        PXENCONS_SELECT_TARGET  Target = &Request->Target[Index];
+
+        if (Target->Ring != NULL)
+            RingSelectUnlink(Target->Ring, Target);
+    }
+
+    Request->Done = TRUE;
+}
+
+static VOID
+SelectRequestComplete(
+    IN  PXENCONS_SELECT_REQUEST Request
+    )
+{
+    PIRP                        Irp = Request->Irp;
+    PULONG                      Events = Irp->AssociatedIrp.SystemBuffer;
+    ULONG                       Index;
+
+    ASSERT(Request->Done);
+
+    for (Index = 0; Index < Request->Count; Index++)
+        Events[Index] = Request->Target[Index].Events;
+
+    Irp->IoStatus.Information = Request->Count * sizeof (ULONG);
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+
+    __SelectSetRequest(Irp, NULL);
+    SelectRequestRelease(Request);
+
+    Trace("COMPLETE (SELECT)\n");
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+IO_CSQ_INSERT_IRP SelectCsqInsertIrp;
+
+VOID
+SelectCsqInsertIrp(
+    IN  PIO_CSQ Csq,
+    IN  PIRP    Irp
+    )
+{
+    UNREFERENCED_PARAMETER(Csq);
+
+    InsertTailList(&Selector.List, &Irp->Tail.Overlay.ListEntry);
+}
+
+IO_CSQ_REMOVE_IRP SelectCsqRemoveIrp;
+
+VOID
+SelectCsqRemoveIrp(
+    IN  PIO_CSQ Csq,
+    IN  PIRP    Irp
+    )
+{
+    UNREFERENCED_PARAMETER(Csq);
+
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+}
+
+IO_CSQ_PEEK_NEXT_IRP SelectCsqPeekNextIrp;
+
+PIRP
+SelectCsqPeekNextIrp(
+    IN  PIO_CSQ Csq,
+    IN  PIRP    Irp,
+    IN  PVOID   PeekContext OPTIONAL
+    )
+{
+    PLIST_ENTRY ListEntry;
+
+    UNREFERENCED_PARAMETER(Csq);
+    UNREFERENCED_PARAMETER(PeekContext);
+
+    ListEntry = (Irp == NULL) ?
+        Selector.List.Flink :
+        Irp->Tail.Overlay.ListEntry.Flink;
+
+    if (ListEntry == &Selector.List)
+        return NULL;
+
+    return CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
+}
+
+#pragma warning(push)
+#pragma warning(disable:28167) // function changes IRQL
+
+IO_CSQ_ACQUIRE_LOCK SelectCsqAcquireLock;
+
+VOID
+SelectCsqAcquireLock(
+    IN  PIO_CSQ Csq,
+    OUT PKIRQL  Irql
+    )
+{
+    UNREFERENCED_PARAMETER(Csq);
+
+    KeAcquireSpinLock(&Selector.QueueLock, Irql);
+}
+
+IO_CSQ_RELEASE_LOCK SelectCsqReleaseLock;
+
+VOID
+SelectCsqReleaseLock(
+    IN  PIO_CSQ Csq,
+    IN  KIRQL   Irql
+    )
+{
+    UNREFERENCED_PARAMETER(Csq);
+
+    KeReleaseSpinLock(&Selector.QueueLock, Irql);
+}
+
+#pragma warning(pop)
+
+IO_CSQ_COMPLETE_CANCELED_IRP SelectCsqCompleteCanceledIrp;
+
+VOID
+SelectCsqCompleteCanceledIrp(
+    IN  PIO_CSQ                 Csq,
+    IN  PIRP                    Irp
+    )
+{
+    PXENCONS_SELECT_REQUEST     Request;
+    KIRQL                       Irql;
+
+    UNREFERENCED_PARAMETER(Csq);
+
+    Request = __SelectGetRequest(Irp);
+    __SelectSetRequest(Irp, NULL);
+
+    // Removal from the queue was the claim
+    KeAcquireSpinLock(&Selector.Lock, &Irql);
+    SelectRequestFinish(Request);
+    KeReleaseSpinLock(&Selector.Lock, Irql);
+
+    SelectRequestRelease(Request);
+
+    Irp->IoStatus.Information = 0;
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+
+    Trace("CANCELLED\n");
+
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+// Only handles that are still open on a PV console are accepted
+static PXENCONS_RING
+SelectGetRing(
+    IN  PFILE_OBJECT    FileObject
+    )
+{
+    PDEVICE_OBJECT      DeviceObject = FileObject->DeviceObject;
+    PXENCONS_DX         Dx;
+
+    if (DeviceObject->DriverObject != DriverGetDriverObject())
+        return NULL;
+
+    Dx = (PXENCONS_DX)DeviceObject->DeviceExtension;
+    if (Dx->Type != PHYSICAL_DEVICE_OBJECT)
+        return NULL;
+
+    if (FileObject->FsContext == NULL)
+        return NULL;
+
+    return PdoGetRing(Dx->Pdo);
+}
+
+// Called by a ring, with both of its locks held, for a target on its
+// select list whose events have become true. Returns TRUE if the
+// caller now owns the request, in which case it must take the target
+// off its list and then pass it to SelectComplete() once it has
+// dropped its locks. Otherwise the request is already being completed
+// by someone else, who will unlink the target.
+BOOLEAN
+SelectClaim(
+    IN  PXENCONS_SELECT_TARGET  Target
+    )
+{
+    PXENCONS_SELECT_REQUEST     Request = Target->Request;
+
+    return (IoCsqRemoveIrp(&Selector.Csq, &Request->Context) != NULL) ?
+           TRUE :
+           FALSE;
+}
+
+// Must be called with no ring locks held
+VOID
+SelectComplete(
+    IN  PXENCONS_SELECT_TARGET  Target
+    )
+{
+    PXENCONS_SELECT_REQUEST     Request = Target->Request;
+    KIRQL                       Irql;
+
+    ASSERT3P(Target->Ring, ==, NULL);
+
+    KeAcquireSpinLock(&Selector.Lock, &Irql);
+    SelectRequestFinish(Request);
+    KeReleaseSpinLock(&Selector.Lock, Irql);
+
+    SelectRequestComplete(Request);
+}
+
+// Must be called once FileObject->FsContext has been cleared and before
+// the handle state is freed. Any select that includes the handle sees
+// it as disconnected and completes.
+VOID
+SelectClose(
+    IN  PXENCONS_RING       Ring,
+    IN  PFILE_OBJECT        FileObject
+    )
+{
+    LIST_ENTRY              List;
+    PLIST_ENTRY             ListEntry;
+    KIRQL                   Irql;
+
+    InitializeListHead(&List);
+
+    KeAcquireSpinLock(&Selector.Lock, &Irql);
+
+    RingSelectDetach(Ring, FileObject, &List);
+
+    for (ListEntry = List.Flink;
+         ListEntry != &List;
+         ListEntry = ListEntry->Flink) {
+        PXENCONS_SELECT_TARGET  Target;
+
+        Target = CONTAINING_RECORD(ListEntry,
+                                   XENCONS_SELECT_TARGET,
+                                   ListEntry);
+
+        SelectRequestFinish(Target->Request);
+    }
+
+    KeReleaseSpinLock(&Selector.Lock, Irql);
+
+    while (!IsListEmpty(&List)) {
+        PXENCONS_SELECT_TARGET  Target;
+
+        ListEntry = RemoveHeadList(&List);
+        ASSERT3P(ListEntry, !=, &List);
+
+        Target = CONTAINING_RECORD(ListEntry,
+                                   XENCONS_SELECT_TARGET,
+                                   ListEntry);
+
+        SelectRequestComplete(Target->Request);
+    }
+}
+
+NTSTATUS
+SelectPut(
+    IN  PIRP                Irp
+    )
+{
+    PIO_STACK_LOCATION      StackLocation;
+    ULONG                   InputBufferLength;
+    ULONG                   OutputBufferLength;
+    PXENCONS_SELECT         Select;
+    ULONG                   Count;
+    PXENCONS_SELECT_REQUEST Request;
+    ULONG                   Index;
+    BOOLEAN                 Ready;
+    BOOLEAN                 Claimed;
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+    InputBufferLength = StackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    OutputBufferLength = StackLocation->Parameters.DeviceIoControl.OutputBufferLength;
+
+    Select = Irp->AssociatedIrp.SystemBuffer;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (InputBufferLength < FIELD_OFFSET(XENCONS_SELECT, Entry))
+        goto fail1;
+
+    Count = Select->Count;
+    if (Count == 0 || Count > XENCONS_SELECT_MAXIMUM)
+        goto fail2;
+
+    if (InputBufferLength < FIELD_OFFSET(XENCONS_SELECT, Entry) +
+                            Count * sizeof (XENCONS_SELECT_ENTRY) ||
+        OutputBufferLength < Count * sizeof (ULONG))
+        goto fail3;
+
+    Request = __SelectAllocate(FIELD_OFFSET(XENCONS_SELECT_REQUEST,
+                                            Target) +
+                               Count * sizeof (XENCONS_SELECT_TARGET));
+
+    status = STATUS_NO_MEMORY;
+    if (Request == NULL)
+        goto fail4;
+
+    Request->References = 1;
+    (VOID) InterlockedIncrement(&Selector.Requests);
+
+    // The output overlays the input so everything needed is copied
+    // out first. Request->Count only covers referenced targets.
+    for (Index = 0; Index < Count; Index++) {
+        PXENCONS_SELECT_ENTRY   Entry = &Select->Entry[Index];
+        PXENCONS_SELECT_TARGET  Target = &Request->Target[Index];
+
+        status = STATUS_INVALID_PARAMETER;
+        if (Entry->Wait.Mask == 0 ||
+            (Entry->Wait.Mask & ~XENCONS_WAIT_MASK) != 0)
+            goto fail5;
+
+        status = ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)Entry->Handle,
+                                           0,
+                                           *IoFileObjectType,
+                                           Irp->RequestorMode,
+                                           (PVOID *)&Target->FileObject,
+                                           NULL);
+        if (!NT_SUCCESS(status))
+            goto fail5;
+
+        Request->Count++;
+
+        Target->Request = Request;
+        Target->Wait = Entry->Wait;
+    }
+
+    // Anything that is already true completes the request inline
+    Ready = FALSE;
+    for (Index = 0; Index < Count; Index++) {
+        PXENCONS_SELECT_TARGET  Target = &Request->Target[Index];
+        PXENCONS_RING           Ring;
+
+        Ring = SelectGetRing(Target->FileObject);
+
+        status = STATUS_INVALID_HANDLE;
+        if (Ring == NULL)
+            goto fail6;
+
+        Target->Events = RingGetEvents(Ring,
+                                       Target->FileObject,
+                                       &Target->Wait);
+        if (Target->Events != 0)
+            Ready = TRUE;
+    }
+
+    if (Ready) {
+        PULONG  Events = Irp->AssociatedIrp.SystemBuffer;
+
+        for (Index = 0; Index < Count; Index++)
+            Events[Index] = Request->Target[Index].Events;
+
+        SelectRequestRelease(Request);
+
+        Irp->IoStatus.Information = Count * sizeof (ULONG);
+
+        Trace("COMPLETE (SELECT) (inline)\n");
+
+        return STATUS_SUCCESS;
+    }
+
+    // Once queued the IRP may be cancelled at any time, in which case
+    // the request is finished before it can be linked
+    Request->Irp = Irp;
+    Request->References++;
+
+    __SelectSetRequest(Irp, Request);
+    IoCsqInsertIrp(&Selector.Csq, Irp, &Request->Context);
+
+    Ready = Claimed = FALSE;
+
+    KeAcquireSpinLock(&Selector.Lock, &Irql);
+
+    if (!Request->Done) {
+        // Each target is evaluated again as it is linked, so nothing
+        // that became true since the inline check can be missed
+        for (Index = 0; Index < Count; Index++) {
+            PXENCONS_SELECT_TARGET  Target = &Request->Target[Index];
+            PXENCONS_RING           Ring;
+
+            Ring = SelectGetRing(Target->FileObject);
+            if (Ring == NULL ||
+                !RingSelectLink(Ring, Target))
+                Target->Events = XENCONS_WAIT_DISCONNECTED;
+
+            if (Target->Events != 0)
+                Ready = TRUE;
+        }
+
+        if (Ready &&
+            IoCsqRemoveIrp(&Selector.Csq, &Request->Context) != NULL) {
+            SelectRequestFinish(Request);
+            Claimed = TRUE;
+        }
+    }
+
+    KeReleaseSpinLock(&Selector.Lock, Irql);
+
+    if (Claimed)
+        SelectRequestComplete(Request);
+
+    SelectRequestRelease(Request);
+
+    return STATUS_PENDING;
+
+fail6:
+    Error("fail6\n");
+
+fail5:
+    Error("fail5\n");
+
+    SelectRequestRelease(Request);
+
+fail4:
+    Error("fail4\n");
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+NTSTATUS
+SelectInitialize(
+    VOID
+    )
+{
+    NTSTATUS    status;
+
+    Trace("====>\n");
+
+    KeInitializeSpinLock(&Selector.Lock);
+    KeInitializeSpinLock(&Selector.QueueLock);
+    InitializeListHead(&Selector.List);
+
+    status = IoCsqInitialize(&Selector.Csq,
+                             SelectCsqInsertIrp,
+                             SelectCsqRemoveIrp,
+                             SelectCsqPeekNextIrp,
+                             SelectCsqAcquireLock,
+                             SelectCsqReleaseLock,
+                             SelectCsqCompleteCanceledIrp);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    RtlZeroMemory(&Selector, sizeof (XENCONS_SELECTOR));
+
+    return status;
+}
+
+VOID
+SelectTeardown(
+    VOID
+    )
+{
+    Trace("====>\n");
+
+    // Every request holds a reference on a console file object, so
+    // none can remain by the time the driver unloads
+    ASSERT(IsListEmpty(&Selector.List));
+    ASSERT3U(Selector.Requests, ==, 0);
+
+    RtlZeroMemory(&Selector.Csq, sizeof (IO_CSQ));
+    RtlZeroMemory(&Selector.List, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Selector.QueueLock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(&Selector.Lock, sizeof (KSPIN_LOCK));
+
+    ASSERT(IsZeroMemory(&Selector, sizeof (XENCONS_SELECTOR)));
+
+    Trace("<====\n");
+}
@@ -0,0 +1,82 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENCONS_SELECT_H
+#define _XENCONS_SELECT_H
+
+#include <ntddk.h>
+#include <xencons_device.h>
+
+#include "driver.h"
+
+// One handle in a select request. While Ring is set the target is on
+// that ring's select list, which is protected by both of its locks.
+typedef struct _XENCONS_SELECT_TARGET {
+    LIST_ENTRY                      ListEntry;
+    struct _XENCONS_SELECT_REQUEST  *Request;
+    PFILE_OBJECT                    FileObject;
+    PXENCONS_RING                   Ring;
+    XENCONS_WAIT                    Wait;
+    ULONG                           Events;
+} XENCONS_SELECT_TARGET, *PXENCONS_SELECT_TARGET;
+
+extern NTSTATUS
+SelectInitialize(
+    VOID
+    );
+
+extern VOID
+SelectTeardown(
+    VOID
+    );
+
+extern NTSTATUS
+SelectPut(
+    IN  PIRP        Irp
+    );
+
+extern BOOLEAN
+SelectClaim(
+    IN  PXENCONS_SELECT_TARGET  Target
+    );
+
+extern VOID
+SelectComplete(
+    IN  PXENCONS_SELECT_TARGET  Target
+    );
+
+extern VOID
+SelectClose(
+    IN  PXENCONS_RING   Ring,
+    IN  PFILE_OBJECT    FileObject
+    );
+
+#endif  // _XENCONS_SELECT_H
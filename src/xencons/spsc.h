@@ -0,0 +1,266 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENCONS_SPSC_H
+#define _XENCONS_SPSC_H
+
+// A single-producer/single-consumer byte ring over a power-of-two
+// sized data area with free-running 32-bit indices. Each side only
+// ever writes its own index: the other side's index is loaded with
+// acquire semantics and our own is published with release semantics,
+// which is all the ordering the protocol needs.
+//
+// This header has no dependency on the rest of the driver so that it
+// can also be built as plain C outside the kernel.
+
+#if defined(_KERNEL_MODE)
+
+#include <ntddk.h>
+
+#define __SpscLoadAcquire(_Index)           \
+        ReadULongAcquire((_Index))
+
+#define __SpscStoreRelease(_Index, _Value)  \
+        WriteULongRelease((_Index), (_Value))
+
+#else   // _KERNEL_MODE
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef IN
+#define IN
+#define OUT
+#endif
+
+#ifndef FORCEINLINE
+#define FORCEINLINE inline __attribute__((always_inline))
+#endif
+
+typedef uint32_t    ULONG, *PULONG;
+typedef char        CHAR, *PCHAR;
+
+#define RtlCopyMemory(_Destination, _Source, _Length)   \
+        memcpy((_Destination), (_Source), (_Length))
+
+#define __SpscLoadAcquire(_Index)           \
+        __atomic_load_n((_Index), __ATOMIC_ACQUIRE)
+
+#define __SpscStoreRelease(_Index, _Value)  \
+        __atomic_store_n((_Index), (_Value), __ATOMIC_RELEASE)
+
+#endif  // _KERNEL_MODE
+
+typedef struct _XENCONS_SPSC {
+    PCHAR           Data;
+    ULONG           Size;
+    volatile ULONG  *Prod;
+    volatile ULONG  *Cons;
+} XENCONS_SPSC, *PXENCONS_SPSC;
+
+static FORCEINLINE void
+SpscInitialize(
+    OUT PXENCONS_SPSC   Spsc,
+    IN  PCHAR           Data,
+    IN  ULONG           Size,
+    IN  volatile ULONG  *Prod,
+    IN  volatile ULONG  *Cons
+    )
+{
+    // Size must be a power of two
+    Spsc->Data = Data;
+    Spsc->Size = Size;
+    Spsc->Prod = Prod;
+    Spsc->Cons = Cons;
+}
+
+// The peer controls its own index, so a distance larger than the data
+// area can only mean a corrupt ring: treat it as full rather than let
+// it size a copy
+static FORCEINLINE ULONG
+__SpscUsed(
+    IN  PXENCONS_SPSC   Spsc,
+    IN  ULONG           prod,
+    IN  ULONG           cons
+    )
+{
+    ULONG               Used = prod - cons;
+
+    return (Used > Spsc->Size) ? Spsc->Size : Used;
+}
+
+static FORCEINLINE void
+SpscTeardown(
+    IN  PXENCONS_SPSC   Spsc
+    )
+{
+    Spsc->Cons = NULL;
+    Spsc->Prod = NULL;
+    Spsc->Size = 0;
+    Spsc->Data = NULL;
+}
+
+// Consumer side
+
+static FORCEINLINE ULONG
+SpscUsed(
+    IN  PXENCONS_SPSC   Spsc
+    )
+{
+    ULONG               cons = *Spsc->Cons;
+    ULONG               prod = __SpscLoadAcquire(Spsc->Prod);
+
+    return __SpscUsed(Spsc, prod, cons);
+}
+
+static FORCEINLINE ULONG
+SpscRead(
+    IN  PXENCONS_SPSC   Spsc,
+    IN  PCHAR           Data,
+    IN  ULONG           Length
+    )
+{
+    ULONG               cons = *Spsc->Cons;
+    ULONG               prod = __SpscLoadAcquire(Spsc->Prod);
+    ULONG               Index;
+    ULONG               First;
+    ULONG               Second;
+
+    if (Length > __SpscUsed(Spsc, prod, cons))
+        Length = __SpscUsed(Spsc, prod, cons);
+
+    if (Length == 0)
+        return 0;
+
+    // At most two copies: up to the end of the data area and then
+    // from its start, which can never pass Index
+    Index = cons & (Spsc->Size - 1);
+    First = Spsc->Size - Index;
+    if (First > Length)
+        First = Length;
+
+    Second = Length - First;
+    if (Second > Index)
+        Second = Index;
+
+    RtlCopyMemory(Data, &Spsc->Data[Index], First);
+    RtlCopyMemory(Data + First, &Spsc->Data[0], Second);
+
+    Length = First + Second;
+
+    __SpscStoreRelease(Spsc->Cons, cons + Length);
+
+    return Length;
+}
+
+static FORCEINLINE ULONG
+SpscDiscard(
+    IN  PXENCONS_SPSC   Spsc
+    )
+{
+    ULONG               cons = *Spsc->Cons;
+    ULONG               prod = __SpscLoadAcquire(Spsc->Prod);
+
+    __SpscStoreRelease(Spsc->Cons, prod);
+
+    return __SpscUsed(Spsc, prod, cons);
+}
+
+// Producer side
+
+static FORCEINLINE ULONG
+SpscFree(
+    IN  PXENCONS_SPSC   Spsc
+    )
+{
+    ULONG               prod = *Spsc->Prod;
+    ULONG               cons = __SpscLoadAcquire(Spsc->Cons);
+
+    return Spsc->Size - __SpscUsed(Spsc, prod, cons);
+}
+
+// Positions in the byte stream: the consumer has taken everything up
+// to a position once SpscConsumed() is no longer behind it
+static FORCEINLINE ULONG
+SpscProduced(
+    IN  PXENCONS_SPSC   Spsc
+    )
+{
+    return *Spsc->Prod;
+}
+
+static FORCEINLINE ULONG
+SpscConsumed(
+    IN  PXENCONS_SPSC   Spsc
+    )
+{
+    return __SpscLoadAcquire(Spsc->Cons);
+}
+
+static FORCEINLINE ULONG
+SpscWrite(
+    IN  PXENCONS_SPSC   Spsc,
+    IN  PCHAR           Data,
+    IN  ULONG           Length
+    )
+{
+    ULONG               prod = *Spsc->Prod;
+    ULONG               cons = __SpscLoadAcquire(Spsc->Cons);
+    ULONG               Index;
+    ULONG               First;
+    ULONG               Second;
+
+    if (Length > Spsc->Size - __SpscUsed(Spsc, prod, cons))
+        Length = Spsc->Size - __SpscUsed(Spsc, prod, cons);
+
+    if (Length == 0)
+        return 0;
+
+    Index = prod & (Spsc->Size - 1);
+    First = Spsc->Size - Index;
+    if (First > Length)
+        First = Length;
+
+    Second = Length - First;
+    if (Second > Index)
+        Second = Index;
+
+    RtlCopyMemory(&Spsc->Data[Index], Data, First);
+    RtlCopyMemory(&Spsc->Data[0], Data + First, Second);
+
+    Length = First + Second;
+
+    __SpscStoreRelease(Spsc->Prod, prod + Length);
+
+    return Length;
+}
+
+#endif  // _XENCONS_SPSC_H
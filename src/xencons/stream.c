@@ -41,13 +41,27 @@
 
 #define STREAM_POOL 'ETRS'
 
+// Reads and writes are queued separately so that a read waiting for
+// input never holds up output, and vice versa
+typedef struct _STREAM_QUEUE {
+    PXENCONS_STREAM             Stream;
+    UCHAR                       MajorFunction;
+    IO_CSQ                      Csq;
+    LIST_ENTRY                  List;
+    KSPIN_LOCK                  Lock;
+    ULONGLONG                   BlockedSince;
+    ULONGLONG                   BlockedTime;
+    ULONG                       Blocked;
+} STREAM_QUEUE, *PSTREAM_QUEUE;
+
 struct _XENCONS_STREAM {
-    PXENCONS_FDO            	Fdo;
-    PXENCONS_THREAD         	Thread;
-    IO_CSQ                  	Csq;
-    LIST_ENTRY              	List;
-    KSPIN_LOCK           	Lock;
-    XENBUS_CONSOLE_INTERFACE 	ConsoleInterface;
+    PXENCONS_FDO                Fdo;
+    PXENCONS_THREAD             Thread;
+    STREAM_QUEUE                Read;
+    STREAM_QUEUE                Write;
+    XENBUS_CONSOLE_INTERFACE    ConsoleInterface;
+    XENBUS_DEBUG_INTERFACE      DebugInterface;
+    PXENBUS_DEBUG_CALLBACK      DebugCallback;
 };
 
 static FORCEINLINE PVOID
@@ -76,17 +90,20 @@ StreamCsqInsertIrpEx(
     )
 {
     BOOLEAN             ReInsert = (BOOLEAN)(ULONG_PTR)InsertContext;
+    PSTREAM_QUEUE       Queue;
     PXENCONS_STREAM     Stream;
 
-    Stream = CONTAINING_RECORD(Csq, XENCONS_STREAM, Csq);
+    Queue = CONTAINING_RECORD(Csq, STREAM_QUEUE, Csq);
+    Stream = Queue->Stream;
 
     if (ReInsert) {
-        // This only occurs if the worker thread de-queued the IRP but
+        // This only occurs if the dispatcher de-queued the IRP but
         // then found the console to be blocked.
-        InsertHeadList(&Stream->List, &Irp->Tail.Overlay.ListEntry);
+        InsertHeadList(&Queue->List, &Irp->Tail.Overlay.ListEntry);
     } else {
-        InsertTailList(&Stream->List, &Irp->Tail.Overlay.ListEntry);
-        ThreadWake(Stream->Thread);
+        InsertTailList(&Queue->List, &Irp->Tail.Overlay.ListEntry);
+        if (Stream->Thread != NULL)
+            ThreadWake(Stream->Thread);
     }
 
     return STATUS_SUCCESS;
@@ -114,19 +131,19 @@ StreamCsqPeekNextIrp(
     IN  PVOID       PeekContext OPTIONAL
     )
 {
-    PXENCONS_STREAM Stream;
+    PSTREAM_QUEUE   Queue;
     PLIST_ENTRY     ListEntry;
     PIRP            NextIrp;
 
     UNREFERENCED_PARAMETER(PeekContext);
 
-    Stream = CONTAINING_RECORD(Csq, XENCONS_STREAM, Csq);
+    Queue = CONTAINING_RECORD(Csq, STREAM_QUEUE, Csq);
 
     ListEntry = (Irp == NULL) ?
-                Stream->List.Flink :
+                Queue->List.Flink :
                 Irp->Tail.Overlay.ListEntry.Flink;
 
-    if (ListEntry == &Stream->List)
+    if (ListEntry == &Queue->List)
         return NULL;
 
     NextIrp = CONTAINING_RECORD(ListEntry, IRP, Tail.Overlay.ListEntry);
@@ -145,11 +162,11 @@ StreamCsqAcquireLock(
     OUT PKIRQL  Irql
     )
 {
-    PXENCONS_STREAM Stream;
+    PSTREAM_QUEUE   Queue;
 
-    Stream = CONTAINING_RECORD(Csq, XENCONS_STREAM, Csq);
+    Queue = CONTAINING_RECORD(Csq, STREAM_QUEUE, Csq);
 
-    KeAcquireSpinLock(&Stream->Lock, Irql);
+    KeAcquireSpinLock(&Queue->Lock, Irql);
 }
 
 IO_CSQ_RELEASE_LOCK StreamCsqReleaseLock;
@@ -160,11 +177,11 @@ StreamCsqReleaseLock(
     IN  KIRQL   Irql
     )
 {
-    PXENCONS_STREAM Stream;
+    PSTREAM_QUEUE   Queue;
 
-    Stream = CONTAINING_RECORD(Csq, XENCONS_STREAM, Csq);
+    Queue = CONTAINING_RECORD(Csq, STREAM_QUEUE, Csq);
 
-    KeReleaseSpinLock(&Stream->Lock, Irql);
+    KeReleaseSpinLock(&Queue->Lock, Irql);
 }
 
 #pragma warning(pop)
@@ -195,159 +212,249 @@ StreamCsqCompleteCanceledIrp(
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
 }
 
-static NTSTATUS
-StreamWorker(
-    IN  PXENCONS_THREAD     Self,
-    IN  PVOID               Context
+static FORCEINLINE BOOLEAN
+__StreamCanTransfer(
+    IN  PXENCONS_STREAM Stream,
+    IN  UCHAR           MajorFunction
     )
 {
-    PXENCONS_STREAM         Stream = Context;
-    PKEVENT                 Event;
-    PXENBUS_CONSOLE_WAKEUP  Wakeup;
-    NTSTATUS                status;
+    switch (MajorFunction) {
+    case IRP_MJ_READ:
+        return XENBUS_CONSOLE(CanRead, &Stream->ConsoleInterface);
 
-    Trace("====>\n");
+    case IRP_MJ_WRITE:
+        return XENBUS_CONSOLE(CanWrite, &Stream->ConsoleInterface);
 
-    Event = ThreadGetEvent(Self);
+    default:
+        ASSERT(FALSE);
+        return FALSE;
+    }
+}
 
-    status = XENBUS_CONSOLE(Acquire,
-                            &Stream->ConsoleInterface);
-    if (!NT_SUCCESS(status))
-        goto fail1;
+static VOID
+StreamPollQueue(
+    IN  PXENCONS_STREAM Stream,
+    IN  PSTREAM_QUEUE   Queue
+    )
+{
+    PIRP                Irp;
+    NTSTATUS            status;
 
-    status = XENBUS_CONSOLE(WakeupAdd,
-                            &Stream->ConsoleInterface,
-                            Event,
-                            &Wakeup);
-    if (!NT_SUCCESS(status))
-        goto fail2;
+    for (Irp = IoCsqRemoveNextIrp(&Queue->Csq, NULL);
+         Irp != NULL;
+         Irp = IoCsqRemoveNextIrp(&Queue->Csq, NULL)) {
+        PIO_STACK_LOCATION  StackLocation;
+        UCHAR               MajorFunction;
+        ULONG               Length;
+        PCHAR               Buffer;
+
+        StackLocation = IoGetCurrentIrpStackLocation(Irp);
+        MajorFunction = StackLocation->MajorFunction;
+        ASSERT3U(MajorFunction, ==, Queue->MajorFunction);
+
+        if (!__StreamCanTransfer(Stream, MajorFunction)) {
+            // Park the IRP; only this direction is held up
+            status = IoCsqInsertIrpEx(&Queue->Csq,
+                                      Irp,
+                                      NULL,
+                                      (PVOID)TRUE);
+            ASSERT(NT_SUCCESS(status));
+
+            if (Queue->BlockedSince == 0) {
+                Queue->BlockedSince = KeQueryInterruptTime();
+                Queue->Blocked++;
+            }
 
-    for (;;) {
-        PIRP    Irp;
+            break;
+        }
+
+        if (Queue->BlockedSince != 0) {
+            Queue->BlockedTime += KeQueryInterruptTime() -
+                                  Queue->BlockedSince;
+            Queue->BlockedSince = 0;
+        }
+
+        Buffer = Irp->AssociatedIrp.SystemBuffer;
 
-        (VOID) KeWaitForSingleObject(Event,
-                                     Executive,
-                                     KernelMode,
-                                     FALSE,
-                                     NULL);
-        KeClearEvent(Event);
+        switch (MajorFunction) {
+        case IRP_MJ_READ:
+            Length = StackLocation->Parameters.Read.Length;
 
-        if (ThreadIsAlerted(Self))
+            Irp->IoStatus.Information = XENBUS_CONSOLE(Read,
+                                                       &Stream->ConsoleInterface,
+                                                       Buffer,
+                                                       Length);
+            Irp->IoStatus.Status = STATUS_SUCCESS;
             break;
 
-        for (Irp = IoCsqRemoveNextIrp(&Stream->Csq, NULL);
-             Irp != NULL;
-             Irp = IoCsqRemoveNextIrp(&Stream->Csq, NULL)) {
-            PIO_STACK_LOCATION  StackLocation;
-            UCHAR               MajorFunction;
-            BOOLEAN             Blocked;
+        case IRP_MJ_WRITE:
+            Length = StackLocation->Parameters.Write.Length;
 
-            StackLocation = IoGetCurrentIrpStackLocation(Irp);
-            MajorFunction = StackLocation->MajorFunction;
+            Irp->IoStatus.Information = XENBUS_CONSOLE(Write,
+                                                       &Stream->ConsoleInterface,
+                                                       Buffer,
+                                                       Length);
+            Irp->IoStatus.Status = STATUS_SUCCESS;
+            break;
 
-            switch (MajorFunction) {
-            case IRP_MJ_READ:
-                Blocked = !XENBUS_CONSOLE(CanRead,
-                                          &Stream->ConsoleInterface);
-                break;
+        default:
+            ASSERT(FALSE);
 
-            case IRP_MJ_WRITE:
-                Blocked = !XENBUS_CONSOLE(CanWrite,
-                                          &Stream->ConsoleInterface);
-                break;
+            Irp->IoStatus.Status = STATUS_UNSUCCESSFUL;
+            break;
+        }
 
-            default:
-                ASSERT(FALSE);
+        Trace("COMPLETE (%02x:%s) (%u bytes)\n",
+              MajorFunction,
+              MajorFunctionName(MajorFunction),
+              Irp->IoStatus.Information);
 
-                Blocked = TRUE;
-                break;
-            }
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
+}
 
-            if (Blocked) {
-                status = IoCsqInsertIrpEx(&Stream->Csq,
-                                          Irp,
-                                          NULL,
-                                          (PVOID)TRUE);
-                ASSERT(NT_SUCCESS(status));
+VOID
+StreamPoll(
+    IN  PXENCONS_STREAM Stream
+    )
+{
+    StreamPollQueue(Stream, &Stream->Write);
+    StreamPollQueue(Stream, &Stream->Read);
+}
 
-                break;
-            }
+static NTSTATUS
+StreamQueueInitialize(
+    IN  PXENCONS_STREAM Stream,
+    IN  PSTREAM_QUEUE   Queue,
+    IN  UCHAR           MajorFunction
+    )
+{
+    NTSTATUS            status;
 
-            switch (MajorFunction) {
-            case IRP_MJ_READ: {
-                ULONG   Length;
-                PCHAR   Buffer;
-                ULONG   Read;
+    KeInitializeSpinLock(&Queue->Lock);
+    InitializeListHead(&Queue->List);
 
-                Length = StackLocation->Parameters.Read.Length;
-                Buffer = Irp->AssociatedIrp.SystemBuffer;
+    status = IoCsqInitializeEx(&Queue->Csq,
+                               StreamCsqInsertIrpEx,
+                               StreamCsqRemoveIrp,
+                               StreamCsqPeekNextIrp,
+                               StreamCsqAcquireLock,
+                               StreamCsqReleaseLock,
+                               StreamCsqCompleteCanceledIrp);
+    if (!NT_SUCCESS(status))
+        goto fail1;
 
-                Read = XENBUS_CONSOLE(Read,
-                                      &Stream->ConsoleInterface,
-                                      Buffer,
-                                      Length);
+    Queue->MajorFunction = MajorFunction;
+    Queue->Stream = Stream;
 
-                Irp->IoStatus.Information = Read;
-                Irp->IoStatus.Status = STATUS_SUCCESS;
-                break;
-            }
-            case IRP_MJ_WRITE: {
-                ULONG   Length;
-                PCHAR   Buffer;
-                ULONG   Written;
-
-                Length = StackLocation->Parameters.Write.Length;
-                Buffer = Irp->AssociatedIrp.SystemBuffer;
-
-                Written = XENBUS_CONSOLE(Write,
-                                         &Stream->ConsoleInterface,
-                                         Buffer,
-                                         Length);
-
-                Irp->IoStatus.Information = Written;
-                Irp->IoStatus.Status = STATUS_SUCCESS;
-                break;
-            }
-            default:
-                ASSERT(FALSE);
+    return STATUS_SUCCESS;
 
-                Irp->IoStatus.Status = STATUS_UNSUCCESSFUL;
-                break;
-            }
+fail1:
+    Error("fail1 (%08x)\n", status);
 
-            Trace("COMPLETE (%02x:%s) (%u bytes)\n",
-                  MajorFunction,
-                  MajorFunctionName(MajorFunction),
-                  Irp->IoStatus.Information);
+    RtlZeroMemory(&Queue->List, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Queue->Lock, sizeof (KSPIN_LOCK));
 
-            IoCompleteRequest(Irp, IO_NO_INCREMENT);
-        }
+    return status;
+}
+
+static VOID
+StreamQueueCancel(
+    IN  PSTREAM_QUEUE   Queue
+    )
+{
+    for (;;) {
+        PIRP    Irp;
+
+        Irp = IoCsqRemoveNextIrp(&Queue->Csq, NULL);
+        if (Irp == NULL)
+            break;
+
+        StreamCsqCompleteCanceledIrp(&Queue->Csq,
+                                     Irp);
     }
+}
 
-    XENBUS_CONSOLE(WakeupRemove,
-                   &Stream->ConsoleInterface,
-                   Wakeup);
+static VOID
+StreamQueueTeardown(
+    IN  PSTREAM_QUEUE   Queue
+    )
+{
+    StreamQueueCancel(Queue);
+    ASSERT(IsListEmpty(&Queue->List));
 
-    XENBUS_CONSOLE(Release, &Stream->ConsoleInterface);
+    if (Queue->BlockedSince != 0)
+        Queue->BlockedTime += KeQueryInterruptTime() - Queue->BlockedSince;
 
-    Trace("<====\n");
+    Info("%02x:%s: blocked %u times for %llu ms\n",
+         Queue->MajorFunction,
+         MajorFunctionName(Queue->MajorFunction),
+         Queue->Blocked,
+         Queue->BlockedTime / 10000);
 
-    return STATUS_SUCCESS;
+    Queue->Stream = NULL;
+    Queue->MajorFunction = 0;
 
-fail2:
-    Error("fail2\n");
+    RtlZeroMemory(&Queue->Csq, sizeof (IO_CSQ));
 
-    XENBUS_CONSOLE(Release, &Stream->ConsoleInterface);
+    RtlZeroMemory(&Queue->List, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Queue->Lock, sizeof (KSPIN_LOCK));
+}
 
-fail1:
-    Error("fail1 (%08x)\n", status);
+static VOID
+StreamResetStatistics(
+    IN  PXENCONS_STREAM Stream
+    )
+{
+    Stream->Read.Blocked = 0;
+    Stream->Read.BlockedTime = 0;
+    Stream->Read.BlockedSince = 0;
 
-    return status;
+    Stream->Write.Blocked = 0;
+    Stream->Write.BlockedTime = 0;
+    Stream->Write.BlockedSince = 0;
+}
+
+static VOID
+StreamDebugQueue(
+    IN  PXENCONS_STREAM Stream,
+    IN  PSTREAM_QUEUE   Queue
+    )
+{
+    ULONGLONG           BlockedSince = Queue->BlockedSince;
+    ULONGLONG           BlockedTime = Queue->BlockedTime;
+
+    // Include the time spent in a stall that has not ended yet
+    if (BlockedSince != 0)
+        BlockedTime += KeQueryInterruptTime() - BlockedSince;
+
+    XENBUS_DEBUG(Printf,
+                 &Stream->DebugInterface,
+                 "%s: blocked = %u (%llu ms)%s\n",
+                 MajorFunctionName(Queue->MajorFunction),
+                 Queue->Blocked,
+                 BlockedTime / 10000,
+                 (BlockedSince != 0) ? " [BLOCKED]" : "");
+}
+
+static VOID
+StreamDebugCallback(
+    IN  PVOID       Argument,
+    IN  BOOLEAN     Crashing
+    )
+{
+    PXENCONS_STREAM Stream = Argument;
+
+    UNREFERENCED_PARAMETER(Crashing);
+
+    StreamDebugQueue(Stream, &Stream->Read);
+    StreamDebugQueue(Stream, &Stream->Write);
 }
 
 NTSTATUS
 StreamCreate(
     IN  PXENCONS_FDO    Fdo,
+    IN  PXENCONS_THREAD Thread,
     OUT PXENCONS_STREAM *Stream
     )
 {
@@ -361,40 +468,61 @@ StreamCreate(
 
     FdoGetConsoleInterface(Fdo, &(*Stream)->ConsoleInterface);
 
-    KeInitializeSpinLock(&(*Stream)->Lock);
-    InitializeListHead(&(*Stream)->List);
-
-    status = IoCsqInitializeEx(&(*Stream)->Csq,
-                               StreamCsqInsertIrpEx,
-                               StreamCsqRemoveIrp,
-                               StreamCsqPeekNextIrp,
-                               StreamCsqAcquireLock,
-                               StreamCsqReleaseLock,
-                               StreamCsqCompleteCanceledIrp);
+    status = StreamQueueInitialize(*Stream,
+                                   &(*Stream)->Read,
+                                   IRP_MJ_READ);
     if (!NT_SUCCESS(status))
         goto fail2;
 
-    status = ThreadCreate(StreamWorker,
-                          *Stream,
-                          &(*Stream)->Thread);
+    status = StreamQueueInitialize(*Stream,
+                                   &(*Stream)->Write,
+                                   IRP_MJ_WRITE);
     if (!NT_SUCCESS(status))
         goto fail3;
 
+    FdoGetDebugInterface(Fdo, &(*Stream)->DebugInterface);
+
+    status = XENBUS_DEBUG(Acquire, &(*Stream)->DebugInterface);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    status = XENBUS_DEBUG(Register,
+                          &(*Stream)->DebugInterface,
+                          __MODULE__ "|STREAM",
+                          StreamDebugCallback,
+                          *Stream,
+                          &(*Stream)->DebugCallback);
+    if (!NT_SUCCESS(status))
+        goto fail5;
+
+    // The thread is shared by all streams and is only woken from here
+    (*Stream)->Thread = Thread;
+
     (*Stream)->Fdo = Fdo;
 
     return STATUS_SUCCESS;
 
+fail5:
+    Error("fail5\n");
+
+    XENBUS_DEBUG(Release, &(*Stream)->DebugInterface);
+
+fail4:
+    Error("fail4\n");
+
+    RtlZeroMemory(&(*Stream)->DebugInterface,
+                  sizeof (XENBUS_DEBUG_INTERFACE));
+
+    StreamQueueTeardown(&(*Stream)->Write);
+
 fail3:
     Error("fail3\n");
 
-    RtlZeroMemory(&(*Stream)->Csq, sizeof (IO_CSQ));
+    StreamQueueTeardown(&(*Stream)->Read);
 
 fail2:
     Error("fail2\n");
 
-    RtlZeroMemory(&(*Stream)->List, sizeof (LIST_ENTRY));
-    RtlZeroMemory(&(*Stream)->Lock, sizeof (KSPIN_LOCK));
-
     RtlZeroMemory(&(*Stream)->ConsoleInterface,
                   sizeof (XENBUS_CONSOLE_INTERFACE));
 
@@ -414,26 +542,22 @@ StreamDestroy(
 {
     Stream->Fdo = NULL;
 
-    ThreadAlert(Stream->Thread);
-    ThreadJoin(Stream->Thread);
     Stream->Thread = NULL;
 
-    for (;;) {
-        PIRP    Irp;
+    XENBUS_DEBUG(Deregister,
+                 &Stream->DebugInterface,
+                 Stream->DebugCallback);
+    Stream->DebugCallback = NULL;
 
-        Irp = IoCsqRemoveNextIrp(&Stream->Csq, NULL);
-        if (Irp == NULL)
-            break;
+    XENBUS_DEBUG(Release, &Stream->DebugInterface);
 
-        StreamCsqCompleteCanceledIrp(&Stream->Csq,
-                                     Irp);
-    }
-    ASSERT(IsListEmpty(&Stream->List));
+    RtlZeroMemory(&Stream->DebugInterface,
+                  sizeof (XENBUS_DEBUG_INTERFACE));
 
-    RtlZeroMemory(&Stream->Csq, sizeof (IO_CSQ));
+    StreamQueueTeardown(&Stream->Write);
+    StreamQueueTeardown(&Stream->Read);
 
-    RtlZeroMemory(&Stream->List, sizeof (LIST_ENTRY));
-    RtlZeroMemory(&Stream->Lock, sizeof (KSPIN_LOCK));
+    StreamResetStatistics(Stream);
 
     RtlZeroMemory(&Stream->ConsoleInterface,
                   sizeof (XENBUS_CONSOLE_INTERFACE));
@@ -442,11 +566,40 @@ StreamDestroy(
     __StreamFree(Stream);
 }
 
+// The caller must make sure nothing more is queued on Stream
+VOID
+StreamCancel(
+    IN  PXENCONS_STREAM Stream
+    )
+{
+    StreamQueueCancel(&Stream->Write);
+    StreamQueueCancel(&Stream->Read);
+}
+
 NTSTATUS
 StreamPutQueue(
     IN  PXENCONS_STREAM Stream,
     IN  PIRP            Irp
     )
 {
-    return IoCsqInsertIrpEx(&Stream->Csq, Irp, NULL, (PVOID)FALSE);
+    PIO_STACK_LOCATION  StackLocation;
+    PSTREAM_QUEUE       Queue;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    switch (StackLocation->MajorFunction) {
+    case IRP_MJ_READ:
+        Queue = &Stream->Read;
+        break;
+
+    case IRP_MJ_WRITE:
+        Queue = &Stream->Write;
+        break;
+
+    default:
+        ASSERT(FALSE);
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    return IoCsqInsertIrpEx(&Queue->Csq, Irp, NULL, (PVOID)FALSE);
 }
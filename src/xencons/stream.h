@@ -35,12 +35,14 @@
 #include <ntddk.h>
 
 #include "fdo.h"
+#include "thread.h"
 
 typedef struct _XENCONS_STREAM XENCONS_STREAM, *PXENCONS_STREAM;
 
 extern NTSTATUS
 StreamCreate(
     IN  PXENCONS_FDO    Fdo,
+    IN  PXENCONS_THREAD Thread,
     OUT PXENCONS_STREAM *Stream
     );
 
@@ -49,6 +51,16 @@ StreamDestroy(
     IN  PXENCONS_STREAM Stream
     );
 
+extern VOID
+StreamCancel(
+    IN  PXENCONS_STREAM Stream
+    );
+
+extern VOID
+StreamPoll(
+    IN  PXENCONS_STREAM Stream
+    );
+
 extern NTSTATUS
 StreamPutQueue(
     IN  PXENCONS_STREAM Stream,
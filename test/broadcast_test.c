@@ -0,0 +1,228 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+// Host harness for src/xencons/broadcast.h.
+//
+// Input is fed through an SPSC ring, standing in for the shared input
+// ring, and moved into the broadcast buffer by BroadcastFill() as
+// RingBroadcastFill() does. Alongside the subscribers there is a
+// competing reader that is never scheduled: its read buffer is filled
+// through the publish callback and never drained, as the read buffer
+// of a handle that is open but idle would be.
+//
+// The test checks that the idle reader holds up nobody: every fill
+// empties the input ring, a subscriber that keeps up sees every byte in
+// order, one that never reads until the end is lapped and sees only the
+// most recent input, and the idle reader keeps what fitted and drops
+// the rest.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/xencons/broadcast.h"
+
+#define IN_SIZE         256
+#define BROADCAST_SIZE  1024
+#define READ_SIZE       512
+#define TOTAL           (64 * 1024)
+
+typedef struct _RING_INDICES {
+    volatile ULONG  cons;
+    volatile ULONG  prod;
+} RING_INDICES;
+
+typedef struct _READ_BUFFER {
+    char            Data[READ_SIZE];
+    ULONG           Used;
+    ULONG           Dropped;
+} READ_BUFFER;
+
+typedef struct _SUBSCRIBER {
+    ULONG           Cursor;
+    ULONG           Dropped;
+    size_t          Received;
+} SUBSCRIBER;
+
+static inline unsigned char
+__Pattern(
+    size_t  Position
+    )
+{
+    return (unsigned char)((Position * 2654435761u) >> 13);
+}
+
+// As RingReadBufferPublish() does when the read buffer is full
+static void
+Publish(
+    void    *Argument,
+    PCHAR   Data,
+    ULONG   Length
+    )
+{
+    READ_BUFFER *Buffer = Argument;
+    ULONG       Put;
+
+    Put = READ_SIZE - Buffer->Used;
+    if (Put > Length)
+        Put = Length;
+
+    memcpy(&Buffer->Data[Buffer->Used], Data, Put);
+    Buffer->Used += Put;
+    Buffer->Dropped += Length - Put;
+}
+
+static unsigned int
+Check(
+    const char  *Name,
+    const char  *Data,
+    size_t      Length,
+    size_t      Position
+    )
+{
+    size_t      Offset;
+
+    for (Offset = 0; Offset < Length; Offset++) {
+        if ((unsigned char)Data[Offset] != __Pattern(Position + Offset)) {
+            fprintf(stderr, "%s: byte %zu is %02x, expected %02x\n",
+                    Name,
+                    Position + Offset,
+                    (unsigned char)Data[Offset],
+                    __Pattern(Position + Offset));
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    static char         InData[IN_SIZE];
+    static char         BroadcastData[BROADCAST_SIZE];
+    static char         Scratch[BROADCAST_SIZE];
+    static READ_BUFFER  Idle;
+    RING_INDICES        Indices;
+    XENCONS_SPSC        In;
+    XENCONS_BROADCAST   Broadcast;
+    SUBSCRIBER          Fast;
+    SUBSCRIBER          Slow;
+    size_t              Written;
+    ULONG               Read;
+    unsigned int        Errors;
+
+    memset(&Indices, 0, sizeof (Indices));
+    SpscInitialize(&In, InData, IN_SIZE, &Indices.prod, &Indices.cons);
+
+    memset(&Broadcast, 0, sizeof (Broadcast));
+    Broadcast.Data = BroadcastData;
+    Broadcast.Size = BROADCAST_SIZE;
+    Broadcast.References = 2;
+
+    memset(&Fast, 0, sizeof (Fast));
+    memset(&Slow, 0, sizeof (Slow));
+
+    Errors = 0;
+
+    for (Written = 0; Written < TOTAL; ) {
+        char    Chunk[IN_SIZE];
+        ULONG   Length;
+        ULONG   Taken;
+        ULONG   Offset;
+
+        // Fill the input ring as the backend would
+        Length = SpscFree(&In);
+        if (Length > TOTAL - Written)
+            Length = (ULONG)(TOTAL - Written);
+
+        for (Offset = 0; Offset < Length; Offset++)
+            Chunk[Offset] = (char)__Pattern(Written + Offset);
+
+        Length = SpscWrite(&In, Chunk, Length);
+        Written += Length;
+
+        Taken = BroadcastFill(&Broadcast, &In, Publish, &Idle);
+
+        if (Taken != Length || SpscUsed(&In) != 0) {
+            fprintf(stderr, "fill took %u of %u bytes\n", Taken, Length);
+            Errors++;
+            break;
+        }
+
+        Read = BroadcastGet(&Broadcast,
+                            &Fast.Cursor,
+                            &Fast.Dropped,
+                            Scratch,
+                            sizeof (Scratch));
+        Errors += Check("fast", Scratch, Read, Fast.Received);
+        Fast.Received += Read;
+    }
+
+    if (Fast.Received != TOTAL || Fast.Dropped != 0) {
+        fprintf(stderr, "fast: received %zu dropped %u\n",
+                Fast.Received, Fast.Dropped);
+        Errors++;
+    }
+
+    // Lapped: only the most recent input is still held
+    Read = BroadcastGet(&Broadcast,
+                        &Slow.Cursor,
+                        &Slow.Dropped,
+                        Scratch,
+                        sizeof (Scratch));
+    Errors += Check("slow", Scratch, Read, Slow.Dropped);
+
+    if (Read != BROADCAST_SIZE || Slow.Dropped != TOTAL - BROADCAST_SIZE) {
+        fprintf(stderr, "slow: read %u dropped %u\n", Read, Slow.Dropped);
+        Errors++;
+    }
+
+    // The idle reader keeps the oldest input and loses the rest
+    Errors += Check("idle", Idle.Data, Idle.Used, 0);
+
+    if (Idle.Used != READ_SIZE || Idle.Dropped != TOTAL - READ_SIZE) {
+        fprintf(stderr, "idle: held %u dropped %u\n", Idle.Used, Idle.Dropped);
+        Errors++;
+    }
+
+    printf("broadcast_test: %u bytes, slow dropped %u, idle dropped %u%s\n",
+           (ULONG)TOTAL,
+           Slow.Dropped,
+           Idle.Dropped,
+           Errors ? " FAILED" : "");
+
+    return Errors ? 1 : 0;
+}
@@ -0,0 +1,489 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+// Host tests for the monitor's event loop (src/monitor/loop.c), run
+// against a stand-in backend. The stand-in has a clock that only moves
+// when the loop waits with nothing to do, and a FIFO of completions
+// that tests post into directly; once both are exhausted it asks the
+// loop to exit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/monitor/loop.h"
+
+#define QUEUE_SIZE  64
+#define EVENT_COUNT 64
+
+typedef struct _PACKET {
+    PMONITOR_OPERATION  Operation;
+    DWORD               Error;
+    DWORD               Length;
+} PACKET;
+
+typedef struct _STANDIN {
+    ULONGLONG           Now;
+    PACKET              Queue[QUEUE_SIZE];
+    unsigned int        Head;
+    unsigned int        Count;
+} STANDIN;
+
+// What each completion saw, in the order they ran
+typedef struct _EVENT {
+    const char          *Name;
+    DWORD               Error;
+    DWORD               Length;
+    ULONGLONG           Now;
+} EVENT;
+
+static STANDIN      Standin;
+static MONITOR_LOOP Loop;
+static EVENT        Events[EVENT_COUNT];
+static unsigned int EventCount;
+static unsigned int Failures;
+
+static ULONGLONG
+StandinNow(
+    IN  PVOID   Context
+    )
+{
+    STANDIN     *Backend = Context;
+
+    return Backend->Now;
+}
+
+static void
+StandinQueue(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    PACKET                  *Packet;
+
+    if (Standin.Count == QUEUE_SIZE) {
+        fprintf(stderr, "stand-in queue overflow\n");
+        exit(2);
+    }
+
+    Packet = &Standin.Queue[(Standin.Head + Standin.Count++) % QUEUE_SIZE];
+    Packet->Operation = Operation;
+    Packet->Error = Error;
+    Packet->Length = Length;
+}
+
+static BOOL
+StandinPost(
+    IN  PVOID               Context,
+    IN  PMONITOR_OPERATION  Operation
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    StandinQueue(Operation, ERROR_SUCCESS, 0);
+    return TRUE;
+}
+
+static BOOL
+StandinWait(
+    IN  PVOID               Context,
+    IN  DWORD               Timeout,
+    OUT PMONITOR_OPERATION  *Operation,
+    OUT PDWORD              Error,
+    OUT PDWORD              Length
+    )
+{
+    STANDIN                 *Backend = Context;
+    PACKET                  *Packet;
+
+    if (Backend->Count == 0) {
+        // Nothing will ever arrive, so either time out straight away
+        // or ask the loop to exit
+        if (Timeout != INFINITE) {
+            Backend->Now += Timeout;
+            return FALSE;
+        }
+
+        *Operation = NULL;
+        return TRUE;
+    }
+
+    Packet = &Backend->Queue[Backend->Head];
+    Backend->Head = (Backend->Head + 1) % QUEUE_SIZE;
+    Backend->Count--;
+
+    *Operation = Packet->Operation;
+    *Error = Packet->Error;
+    *Length = Packet->Length;
+    return TRUE;
+}
+
+static const MONITOR_LOOP_BACKEND StandinBackend = {
+    StandinNow,
+    StandinPost,
+    StandinWait
+};
+
+static void
+Reset(
+    void
+    )
+{
+    memset(&Standin, 0, sizeof (Standin));
+    Standin.Now = 1000;
+
+    LoopInitialize(&Loop, &StandinBackend, &Standin);
+
+    memset(Events, 0, sizeof (Events));
+    EventCount = 0;
+}
+
+static void
+Record(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    EVENT                   *Event;
+
+    if (EventCount == EVENT_COUNT) {
+        fprintf(stderr, "too many events\n");
+        exit(2);
+    }
+
+    Event = &Events[EventCount++];
+    Event->Name = Operation->Argument;
+    Event->Error = Error;
+    Event->Length = Length;
+    Event->Now = Standin.Now;
+}
+
+static void
+OperationInitialize(
+    OUT PMONITOR_OPERATION  Operation,
+    IN  MONITOR_COMPLETION  Complete,
+    IN  const char          *Name
+    )
+{
+    memset(Operation, 0, sizeof (MONITOR_OPERATION));
+    Operation->Complete = Complete;
+    Operation->Argument = (PVOID)Name;
+}
+
+static void
+TimerInitialize(
+    OUT PMONITOR_TIMER      Timer,
+    IN  MONITOR_COMPLETION  Complete,
+    IN  const char          *Name
+    )
+{
+    memset(Timer, 0, sizeof (MONITOR_TIMER));
+    OperationInitialize(&Timer->Operation, Complete, Name);
+    __InitializeListHead(&Timer->ListEntry);
+}
+
+#define CHECK(_Test, _Condition)                                    \
+    do {                                                            \
+        if (!(_Condition)) {                                        \
+            fprintf(stderr, "%s: %s:%d: %s\n",                      \
+                    (_Test), __FILE__, __LINE__, #_Condition);      \
+            Failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static void
+CheckEvent(
+    IN  const char      *Test,
+    IN  unsigned int    Index,
+    IN  const char      *Name,
+    IN  DWORD           Error,
+    IN  DWORD           Length,
+    IN  ULONGLONG       Now
+    )
+{
+    if (Index >= EventCount) {
+        fprintf(stderr, "%s: event %u (%s) missing\n", Test, Index, Name);
+        Failures++;
+        return;
+    }
+
+    if (strcmp(Events[Index].Name, Name) != 0 ||
+        Events[Index].Error != Error ||
+        Events[Index].Length != Length ||
+        Events[Index].Now != Now) {
+        fprintf(stderr,
+                "%s: event %u: got %s (%u, %u) at %llu, "
+                "expected %s (%u, %u) at %llu\n",
+                Test, Index,
+                Events[Index].Name, Events[Index].Error,
+                Events[Index].Length,
+                (unsigned long long)Events[Index].Now,
+                Name, Error, Length, (unsigned long long)Now);
+        Failures++;
+    }
+}
+
+// Timers fire in deadline order, whatever order they were set in, and
+// each at its own deadline
+static void
+TestTimerOrder(
+    void
+    )
+{
+    MONITOR_TIMER   Timer[3];
+
+    Reset();
+
+    TimerInitialize(&Timer[0], Record, "a");
+    TimerInitialize(&Timer[1], Record, "b");
+    TimerInitialize(&Timer[2], Record, "c");
+
+    LoopTimerSet(&Loop, &Timer[0], 30);
+    LoopTimerSet(&Loop, &Timer[1], 10);
+    LoopTimerSet(&Loop, &Timer[2], 20);
+
+    LoopRun(&Loop);
+
+    CHECK(__func__, EventCount == 3);
+    CheckEvent(__func__, 0, "b", ERROR_TIMEOUT, 0, 1010);
+    CheckEvent(__func__, 1, "c", ERROR_TIMEOUT, 0, 1020);
+    CheckEvent(__func__, 2, "a", ERROR_TIMEOUT, 0, 1030);
+    CHECK(__func__, !Timer[0].Armed && !Timer[1].Armed && !Timer[2].Armed);
+    CHECK(__func__, __IsListEmpty(&Loop.TimerList));
+}
+
+// Setting an armed timer moves its deadline rather than arming it
+// twice, and a cancelled timer never fires
+static void
+TestTimerRearmCancel(
+    void
+    )
+{
+    MONITOR_TIMER   Timer[2];
+
+    Reset();
+
+    TimerInitialize(&Timer[0], Record, "moved");
+    TimerInitialize(&Timer[1], Record, "cancelled");
+
+    LoopTimerSet(&Loop, &Timer[0], 10);
+    LoopTimerSet(&Loop, &Timer[1], 5);
+    LoopTimerSet(&Loop, &Timer[0], 50);
+    LoopTimerCancel(&Timer[1]);
+    LoopTimerCancel(&Timer[1]);
+
+    LoopRun(&Loop);
+
+    CHECK(__func__, EventCount == 1);
+    CheckEvent(__func__, 0, "moved", ERROR_TIMEOUT, 0, 1050);
+}
+
+static MONITOR_TIMER    Chained[3];
+
+// Re-arms itself once, cancels the "victim" timer and arms "late"
+static void
+ChainComplete(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    static int              Count;
+
+    Record(Operation, Error, Length);
+
+    if (EventCount == 1) {
+        Count = 0;
+        LoopTimerCancel(&Chained[1]);
+        LoopTimerSet(&Loop, &Chained[2], 0);
+    }
+
+    if (Count++ == 0)
+        LoopTimerSet(&Loop, &Chained[0], 15);
+}
+
+// A timer callback may set and cancel timers, including itself, and a
+// timer that becomes due during the callback fires before the loop
+// waits again
+static void
+TestTimerCallback(
+    void
+    )
+{
+    Reset();
+
+    TimerInitialize(&Chained[0], ChainComplete, "chain");
+    TimerInitialize(&Chained[1], Record, "victim");
+    TimerInitialize(&Chained[2], Record, "late");
+
+    LoopTimerSet(&Loop, &Chained[0], 10);
+    LoopTimerSet(&Loop, &Chained[1], 12);
+
+    LoopRun(&Loop);
+
+    CHECK(__func__, EventCount == 3);
+    CheckEvent(__func__, 0, "chain", ERROR_TIMEOUT, 0, 1010);
+    CheckEvent(__func__, 1, "late", ERROR_TIMEOUT, 0, 1010);
+    CheckEvent(__func__, 2, "chain", ERROR_TIMEOUT, 0, 1025);
+}
+
+static MONITOR_OPERATION    Follow;
+
+static void
+ReadComplete(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    Record(Operation, Error, Length);
+
+    // As a device read completion starts the next read
+    if (Error == ERROR_SUCCESS)
+        (VOID) LoopPost(&Loop, &Follow);
+}
+
+static void
+WriteComplete(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    Record(Operation, Error, Length);
+}
+
+// Each completion goes to its own operation's routine, with its
+// argument and the status and length the backend returned, in the
+// order they were queued. Completions posted by a routine run after
+// those already queued.
+static void
+TestCompletions(
+    void
+    )
+{
+    MONITOR_OPERATION   Read;
+    MONITOR_OPERATION   Write;
+    MONITOR_OPERATION   Start;
+
+    Reset();
+
+    OperationInitialize(&Read, ReadComplete, "read");
+    OperationInitialize(&Write, WriteComplete, "write");
+    OperationInitialize(&Start, Record, "start");
+    OperationInitialize(&Follow, Record, "follow");
+
+    CHECK(__func__, LoopPost(&Loop, &Start));
+    StandinQueue(&Read, ERROR_SUCCESS, 512);
+    StandinQueue(&Write, 109, 0);   // ERROR_BROKEN_PIPE
+    StandinQueue(&Read, 995, 0);    // ERROR_OPERATION_ABORTED
+
+    LoopRun(&Loop);
+
+    CHECK(__func__, EventCount == 5);
+    CheckEvent(__func__, 0, "start", ERROR_SUCCESS, 0, 1000);
+    CheckEvent(__func__, 1, "read", ERROR_SUCCESS, 512, 1000);
+    CheckEvent(__func__, 2, "write", 109, 0, 1000);
+    CheckEvent(__func__, 3, "read", 995, 0, 1000);
+    CheckEvent(__func__, 4, "follow", ERROR_SUCCESS, 0, 1000);
+}
+
+static MONITOR_TIMER    Window;
+
+static void
+AdvanceComplete(
+    IN  PMONITOR_OPERATION  Operation,
+    IN  DWORD               Error,
+    IN  DWORD               Length
+    )
+{
+    Record(Operation, Error, Length);
+
+    // Time passes while a completion runs
+    Standin.Now += 5;
+}
+
+// Timers are checked before every completion, so one that falls due
+// while completions are queued fires between them rather than after
+// the queue drains
+static void
+TestTimerBetweenCompletions(
+    void
+    )
+{
+    MONITOR_OPERATION   Operation[3];
+
+    Reset();
+
+    OperationInitialize(&Operation[0], AdvanceComplete, "first");
+    OperationInitialize(&Operation[1], AdvanceComplete, "second");
+    OperationInitialize(&Operation[2], AdvanceComplete, "third");
+    TimerInitialize(&Window, Record, "window");
+
+    LoopTimerSet(&Loop, &Window, 8);
+
+    StandinQueue(&Operation[0], ERROR_SUCCESS, 1);
+    StandinQueue(&Operation[1], ERROR_SUCCESS, 2);
+    StandinQueue(&Operation[2], ERROR_SUCCESS, 3);
+
+    LoopRun(&Loop);
+
+    CHECK(__func__, EventCount == 4);
+    CheckEvent(__func__, 0, "first", ERROR_SUCCESS, 1, 1000);
+    CheckEvent(__func__, 1, "second", ERROR_SUCCESS, 2, 1005);
+    CheckEvent(__func__, 2, "window", ERROR_TIMEOUT, 0, 1010);
+    CheckEvent(__func__, 3, "third", ERROR_SUCCESS, 3, 1010);
+}
+
+int
+main(
+    void
+    )
+{
+    TestTimerOrder();
+    TestTimerRearmCancel();
+    TestTimerCallback();
+    TestCompletions();
+    TestTimerBetweenCompletions();
+
+    LoopTeardown(&Loop);
+
+    if (Failures != 0) {
+        printf("loop_test: %u FAILED\n", Failures);
+        return 1;
+    }
+
+    printf("loop_test: passed\n");
+    return 0;
+}
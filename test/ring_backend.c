@@ -0,0 +1,331 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+// Stand-in console backend for measuring multi-page rings.
+//
+// The shared area is laid out as RingSetLayout() in src/xencons/ring.c
+// does for a given order, and the guest side moves its output with the
+// same SPSC engine as the driver. The backend thread plays the part of
+// xenconsoled: it sleeps until notified, pays a fixed wakeup latency
+// to model event channel delivery and scheduling, drains everything
+// the output ring holds and notifies the guest in return. The guest
+// writes a burst of console output (a boot log or crash dump) in
+// WriteFile() sized pieces and, whenever the ring is full, blocks as a
+// pending write IRP would until the backend has made space.
+//
+// For each order the burst time, throughput and number of times the
+// guest stalled on a full ring are reported, and every byte the
+// backend receives is checked.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../src/xencons/spsc.h"
+
+#define PAGE_SIZE               4096
+#define MAXIMUM_ORDER           4
+
+typedef struct _RING_INDICES {
+    volatile ULONG  in_cons;
+    volatile ULONG  in_prod;
+    volatile ULONG  out_cons;
+    volatile ULONG  out_prod;
+} RING_INDICES;
+
+// One direction of an event channel
+typedef struct _EVENT {
+    pthread_mutex_t Lock;
+    pthread_cond_t  Cond;
+    int             Pending;
+} EVENT;
+
+typedef struct _BENCH {
+    unsigned int    Order;
+    char            *Shared;
+    RING_INDICES    *Indices;
+    XENCONS_SPSC    Guest;      // Guest produces into the output ring
+    XENCONS_SPSC    Backend;    // Backend consumes from it
+    EVENT           ToBackend;
+    EVENT           ToGuest;
+    size_t          Burst;
+    size_t          WriteSize;
+    long            Latency;    // ns per backend wakeup
+    size_t          Received;
+    unsigned int    Wakeups;
+    unsigned int    Stalls;
+    unsigned int    Errors;
+} BENCH;
+
+static inline unsigned char
+__Pattern(
+    size_t  Position
+    )
+{
+    return (unsigned char)((Position * 2654435761u) >> 13);
+}
+
+static void
+EventInitialize(
+    EVENT   *Event
+    )
+{
+    pthread_mutex_init(&Event->Lock, NULL);
+    pthread_cond_init(&Event->Cond, NULL);
+    Event->Pending = 0;
+}
+
+static void
+EventTeardown(
+    EVENT   *Event
+    )
+{
+    pthread_cond_destroy(&Event->Cond);
+    pthread_mutex_destroy(&Event->Lock);
+}
+
+static void
+EventSend(
+    EVENT   *Event
+    )
+{
+    pthread_mutex_lock(&Event->Lock);
+    Event->Pending = 1;
+    pthread_cond_signal(&Event->Cond);
+    pthread_mutex_unlock(&Event->Lock);
+}
+
+static void
+EventWait(
+    EVENT   *Event
+    )
+{
+    pthread_mutex_lock(&Event->Lock);
+    while (!Event->Pending)
+        pthread_cond_wait(&Event->Cond, &Event->Lock);
+    Event->Pending = 0;
+    pthread_mutex_unlock(&Event->Lock);
+}
+
+// As RingSetLayout(): a quarter for input, a half for output and the
+// indices at the start of the final quarter (order 0, which is struct
+// xencons_interface) or packed into its last bytes
+static void
+SetLayout(
+    BENCH       *Bench
+    )
+{
+    ULONG       Size = PAGE_SIZE << Bench->Order;
+    ULONG       Offset;
+
+    Offset = (Bench->Order == 0) ?
+             (Size / 4) * 3 :
+             Size - sizeof (RING_INDICES);
+
+    Bench->Indices = (RING_INDICES *)(Bench->Shared + Offset);
+
+    SpscInitialize(&Bench->Guest,
+                   Bench->Shared + Size / 4,
+                   Size / 2,
+                   &Bench->Indices->out_prod,
+                   &Bench->Indices->out_cons);
+
+    // The backend sees the same ring from the other end
+    Bench->Backend = Bench->Guest;
+}
+
+static void *
+Backend(
+    void            *Argument
+    )
+{
+    BENCH           *Bench = Argument;
+    char            Buffer[PAGE_SIZE];
+    struct timespec Latency = { 0, Bench->Latency };
+
+    while (Bench->Received < Bench->Burst) {
+        ULONG   Read;
+
+        EventWait(&Bench->ToBackend);
+        Bench->Wakeups++;
+
+        if (Bench->Latency != 0)
+            nanosleep(&Latency, NULL);
+
+        while ((Read = SpscRead(&Bench->Backend,
+                                Buffer,
+                                sizeof (Buffer))) != 0) {
+            ULONG   Offset;
+
+            for (Offset = 0; Offset < Read; Offset++)
+                if ((unsigned char)Buffer[Offset] !=
+                    __Pattern(Bench->Received + Offset) &&
+                    Bench->Errors++ == 0)
+                    fprintf(stderr, "mismatch at byte %zu\n",
+                            Bench->Received + Offset);
+
+            Bench->Received += Read;
+        }
+
+        EventSend(&Bench->ToGuest);
+    }
+
+    return NULL;
+}
+
+static void
+Guest(
+    BENCH       *Bench
+    )
+{
+    char        *Buffer = malloc(Bench->WriteSize);
+    size_t      Position = 0;
+
+    while (Position < Bench->Burst) {
+        size_t  Length = Bench->WriteSize;
+        size_t  Offset;
+
+        if (Length > Bench->Burst - Position)
+            Length = Bench->Burst - Position;
+
+        for (Offset = 0; Offset < Length; Offset++)
+            Buffer[Offset] = (char)__Pattern(Position + Offset);
+
+        Offset = 0;
+        for (;;) {
+            Offset += SpscWrite(&Bench->Guest,
+                                Buffer + Offset,
+                                (ULONG)(Length - Offset));
+            EventSend(&Bench->ToBackend);
+
+            if (Offset == Length)
+                break;
+
+            // The write pends until the backend frees some space
+            Bench->Stalls++;
+            EventWait(&Bench->ToGuest);
+        }
+
+        Position += Length;
+    }
+
+    free(Buffer);
+}
+
+static double
+Run(
+    BENCH           *Bench
+    )
+{
+    pthread_t       Thread;
+    struct timespec Start;
+    struct timespec End;
+
+    Bench->Shared = calloc(1, PAGE_SIZE << Bench->Order);
+    SetLayout(Bench);
+
+    EventInitialize(&Bench->ToBackend);
+    EventInitialize(&Bench->ToGuest);
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+
+    pthread_create(&Thread, NULL, Backend, Bench);
+    Guest(Bench);
+    pthread_join(Thread, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &End);
+
+    if (Bench->Received != Bench->Burst)
+        Bench->Errors++;
+
+    EventTeardown(&Bench->ToGuest);
+    EventTeardown(&Bench->ToBackend);
+
+    free(Bench->Shared);
+
+    return (End.tv_sec - Start.tv_sec) +
+           (End.tv_nsec - Start.tv_nsec) / 1e9;
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    size_t      Burst = (size_t)1 << 20;
+    long        Latency = 50000;
+    unsigned    Order;
+    int         Failed = 0;
+
+    // bench [latency-us [burst-KiB]]
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        Burst = (size_t)8 << 20;
+        if (argc > 2)
+            Latency = strtol(argv[2], NULL, 0) * 1000;
+        if (argc > 3)
+            Burst = (size_t)strtoul(argv[3], NULL, 0) << 10;
+    }
+
+    printf("burst %zu KiB, %ld us backend wakeup latency\n",
+           Burst >> 10, Latency / 1000);
+
+    for (Order = 0; Order <= MAXIMUM_ORDER; Order++) {
+        BENCH   Bench;
+        double  Seconds;
+
+        memset(&Bench, 0, sizeof (Bench));
+        Bench.Order = Order;
+        Bench.Burst = Burst;
+        Bench.WriteSize = PAGE_SIZE;
+        Bench.Latency = Latency;
+
+        Seconds = Run(&Bench);
+
+        printf("order %u (out %5u bytes): %8.3f ms %8.2f MiB/s "
+               "stalls %6u wakeups %6u%s\n",
+               Order,
+               (PAGE_SIZE << Order) / 2,
+               Seconds * 1000,
+               (Burst / 1048576.0) / Seconds,
+               Bench.Stalls,
+               Bench.Wakeups,
+               Bench.Errors ? " FAILED" : "");
+
+        if (Bench.Errors)
+            Failed = 1;
+    }
+
+    return Failed;
+}
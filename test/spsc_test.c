@@ -0,0 +1,356 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+// Host harness for src/xencons/spsc.h.
+//
+// The stress test runs a producer thread and a consumer thread through
+// SpscWrite()/SpscRead() with varying chunk sizes and indices that start
+// just short of 32-bit wrap, and checks that the consumer sees exactly
+// the byte sequence the producer generated.
+//
+// The benchmark moves the same amount of data through the engine and
+// through a copy of the loops RingCopyToWrite()/RingCopyFromRead() used
+// before the engine existed, with KeMemoryBarrier() mapped to a full
+// fence, and reports the throughput of each.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "../src/xencons/spsc.h"
+
+#define RING_SIZE       1024
+
+typedef struct _RING_INDICES {
+    volatile ULONG  cons;
+    volatile ULONG  prod;
+} RING_INDICES;
+
+typedef struct _TEST {
+    char            Data[RING_SIZE];
+    RING_INDICES    Indices;
+    XENCONS_SPSC    Spsc;
+    int             Legacy;
+    size_t          Total;
+    size_t          MaxChunk;
+    unsigned int    Errors;
+} TEST;
+
+static inline unsigned char
+__Pattern(
+    size_t  Position
+    )
+{
+    return (unsigned char)((Position * 2654435761u) >> 13);
+}
+
+static inline unsigned int
+__Random(
+    unsigned int    *Seed
+    )
+{
+    *Seed = *Seed * 1103515245u + 12345u;
+    return *Seed >> 8;
+}
+
+#define KeMemoryBarrier()   __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+// The pre-engine RingCopyToWrite() loop
+static ULONG
+LegacyWrite(
+    TEST        *Test,
+    const char  *Data,
+    ULONG       Length
+    )
+{
+    ULONG       cons;
+    ULONG       prod;
+    ULONG       Offset;
+
+    KeMemoryBarrier();
+
+    prod = Test->Indices.prod;
+    cons = Test->Indices.cons;
+
+    KeMemoryBarrier();
+
+    Offset = 0;
+    while (Length != 0) {
+        ULONG   Available;
+        ULONG   Index;
+        ULONG   CopyLength;
+
+        Available = cons + RING_SIZE - prod;
+
+        if (Available == 0)
+            break;
+
+        Index = prod & (RING_SIZE - 1);
+
+        CopyLength = Length < Available ? Length : Available;
+        if (CopyLength > RING_SIZE - Index)
+            CopyLength = RING_SIZE - Index;
+
+        memcpy(&Test->Data[Index], Data + Offset, CopyLength);
+
+        Offset += CopyLength;
+        Length -= CopyLength;
+
+        prod += CopyLength;
+    }
+
+    KeMemoryBarrier();
+
+    Test->Indices.prod = prod;
+
+    KeMemoryBarrier();
+
+    return Offset;
+}
+
+// The pre-engine RingCopyFromRead() loop
+static ULONG
+LegacyRead(
+    TEST        *Test,
+    char        *Data,
+    ULONG       Length
+    )
+{
+    ULONG       cons;
+    ULONG       prod;
+    ULONG       Offset;
+
+    KeMemoryBarrier();
+
+    cons = Test->Indices.cons;
+    prod = Test->Indices.prod;
+
+    KeMemoryBarrier();
+
+    Offset = 0;
+    while (Length != 0) {
+        ULONG   Available;
+        ULONG   Index;
+        ULONG   CopyLength;
+
+        Available = prod - cons;
+
+        if (Available == 0)
+            break;
+
+        Index = cons & (RING_SIZE - 1);
+
+        CopyLength = Length < Available ? Length : Available;
+        if (CopyLength > RING_SIZE - Index)
+            CopyLength = RING_SIZE - Index;
+
+        memcpy(Data + Offset, &Test->Data[Index], CopyLength);
+
+        Offset += CopyLength;
+        Length -= CopyLength;
+
+        cons += CopyLength;
+    }
+
+    KeMemoryBarrier();
+
+    Test->Indices.cons = cons;
+
+    KeMemoryBarrier();
+
+    return Offset;
+}
+
+static void *
+Producer(
+    void            *Argument
+    )
+{
+    TEST            *Test = Argument;
+    char            *Buffer = malloc(Test->MaxChunk);
+    unsigned int    Seed = 1;
+    size_t          Position = 0;
+
+    while (Position < Test->Total) {
+        size_t  Chunk = 1 + __Random(&Seed) % Test->MaxChunk;
+        size_t  Offset;
+
+        if (Chunk > Test->Total - Position)
+            Chunk = Test->Total - Position;
+
+        for (Offset = 0; Offset < Chunk; Offset++)
+            Buffer[Offset] = (char)__Pattern(Position + Offset);
+
+        Offset = 0;
+        while (Offset < Chunk) {
+            ULONG   Written;
+
+            if (Test->Legacy)
+                Written = LegacyWrite(Test, Buffer + Offset,
+                                      (ULONG)(Chunk - Offset));
+            else
+                Written = SpscWrite(&Test->Spsc, Buffer + Offset,
+                                    (ULONG)(Chunk - Offset));
+
+            // Let the consumer in rather than spin when the ring is
+            // full: the harness must also make progress on one CPU
+            if (Written == 0)
+                sched_yield();
+
+            Offset += Written;
+        }
+
+        Position += Chunk;
+    }
+
+    free(Buffer);
+    return NULL;
+}
+
+static void *
+Consumer(
+    void            *Argument
+    )
+{
+    TEST            *Test = Argument;
+    char            *Buffer = malloc(Test->MaxChunk);
+    unsigned int    Seed = 2;
+    size_t          Position = 0;
+
+    while (Position < Test->Total) {
+        size_t  Chunk = 1 + __Random(&Seed) % Test->MaxChunk;
+        ULONG   Read;
+        ULONG   Offset;
+
+        if (Test->Legacy)
+            Read = LegacyRead(Test, Buffer, (ULONG)Chunk);
+        else
+            Read = SpscRead(&Test->Spsc, Buffer, (ULONG)Chunk);
+
+        if (Read == 0)
+            sched_yield();
+
+        for (Offset = 0; Offset < Read; Offset++) {
+            if ((unsigned char)Buffer[Offset] !=
+                __Pattern(Position + Offset) &&
+                Test->Errors++ == 0)
+                fprintf(stderr, "mismatch at byte %zu\n",
+                        Position + Offset);
+        }
+
+        Position += Read;
+    }
+
+    free(Buffer);
+    return NULL;
+}
+
+static double
+Run(
+    TEST        *Test
+    )
+{
+    pthread_t       Threads[2];
+    struct timespec Start;
+    struct timespec End;
+
+    // Start just short of 32-bit wrap so the free-running indices
+    // overflow early in the run
+    Test->Indices.cons = Test->Indices.prod = 0xFFFFF000u;
+    SpscInitialize(&Test->Spsc, Test->Data, RING_SIZE,
+                   &Test->Indices.prod, &Test->Indices.cons);
+    Test->Errors = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+
+    pthread_create(&Threads[0], NULL, Producer, Test);
+    pthread_create(&Threads[1], NULL, Consumer, Test);
+    pthread_join(Threads[0], NULL);
+    pthread_join(Threads[1], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &End);
+
+    if (Test->Indices.prod != Test->Indices.cons ||
+        Test->Indices.prod != 0xFFFFF000u + (ULONG)Test->Total) {
+        fprintf(stderr, "indices prod = %08x cons = %08x\n",
+                Test->Indices.prod, Test->Indices.cons);
+        Test->Errors++;
+    }
+
+    return (End.tv_sec - Start.tv_sec) +
+           (End.tv_nsec - Start.tv_nsec) / 1e9;
+}
+
+int
+main(
+    int     argc,
+    char    **argv
+    )
+{
+    static TEST Test;
+    size_t      MaxChunk[] = { 7, 64, RING_SIZE / 4, RING_SIZE * 2 };
+    int         Bench = (argc > 1 && strcmp(argv[1], "bench") == 0);
+    size_t      Total = Bench ? (size_t)256 << 20 : (size_t)16 << 20;
+    unsigned    Index;
+    int         Failed = 0;
+
+    for (Index = 0; Index < sizeof (MaxChunk) / sizeof (MaxChunk[0]); Index++) {
+        int     Legacy;
+
+        for (Legacy = 0; Legacy <= Bench; Legacy++) {
+            double  Seconds;
+
+            memset(&Test, 0, sizeof (Test));
+            Test.Legacy = Legacy;
+            Test.Total = Total;
+            Test.MaxChunk = MaxChunk[Index];
+
+            Seconds = Run(&Test);
+
+            printf("%-6s chunk <= %4zu: %zu MiB in %.3fs (%.1f MiB/s)%s\n",
+                   Legacy ? "legacy" : "spsc",
+                   Test.MaxChunk,
+                   Total >> 20,
+                   Seconds,
+                   (Total >> 20) / Seconds,
+                   Test.Errors ? " FAILED" : "");
+
+            if (Test.Errors)
+                Failed = 1;
+        }
+    }
+
+    return Failed;
+}